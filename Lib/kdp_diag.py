@@ -0,0 +1,147 @@
+#!/usr/bin/env python
+'''
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+
+Reader for the binary KDP diagnostics files written by KdpDiagSink, see
+_ncarb.setKdpDiagnostics. The file layout is described in KdpDiagSink.hh.
+
+Run as a script to list the rays in a file, or to print the bins of one ray.
+
+@file
+@author Daniel Michelson, Environment and Climate Change Canada
+@date 2019-12-12
+'''
+from __future__ import print_function
+import sys
+import numpy as np
+
+MAGIC = b"KDPDIAG1"
+NAME_LEN = 16
+
+# Header of each ray's record
+RAY_HEADER = np.dtype([("record_bytes", "i4"), ("nbins", "i4"),
+                       ("cond_iterations", "i4"), ("spare", "i4"),
+                       ("time", "f8"), ("elangle", "f8"), ("azimuth", "f8"),
+                       ("rstart", "f8"), ("rscale", "f8"), ("missing", "f8")])
+
+# Bits of the validity flags
+VALID_KDP = 1
+VALID_UNFOLD = 2
+
+
+## Diagnostics for one ray. Header values are attributes: time (seconds since
+#  the epoch), elangle and azimuth (degrees), rstart (km, centre of the first
+#  bin), rscale (km), missing, nbins (bins processed, up to the max range) and
+#  cond_iterations. The fields are float32 arrays in the dictionary fields,
+#  and the validity flags are boolean arrays valid_kdp and valid_unfold.
+class KdpDiagRay(object):
+  def __init__(self, header, names, data, flags):
+    for name in RAY_HEADER.names:
+      setattr(self, name, header[name].item())
+    self.fields = {}
+    for i in range(len(names)):
+      self.fields[names[i]] = data[i]
+    self.valid_kdp = (flags & VALID_KDP) != 0
+    self.valid_unfold = (flags & VALID_UNFOLD) != 0
+
+
+## Reads a diagnostics file. An incomplete record at the end, from a file
+#  still being written, is left out.
+# @param string input file string
+# @return tuple of the field names and a list of KdpDiagRay objects, in the
+#  order they were written
+def read(fstr):
+  fd = open(fstr, "rb")
+  buf = fd.read()
+  fd.close()
+  if buf[:len(MAGIC)] != MAGIC:
+    raise IOError("%s is not a KDP diagnostics file" % fstr)
+
+  offset = len(MAGIC)
+  nfields = int(np.frombuffer(buf, "i4", 1, offset)[0])
+  offset += 4
+  names = []
+  for i in range(nfields):
+    name = buf[offset:offset + NAME_LEN].rstrip(b"\0").decode("ascii")
+    names.append(name)
+    offset += NAME_LEN
+
+  rays = []
+  while offset + RAY_HEADER.itemsize <= len(buf):
+    header = np.frombuffer(buf, RAY_HEADER, 1, offset)[0]
+    record_bytes = int(header["record_bytes"])
+    if record_bytes <= 0 or offset + record_bytes > len(buf): break
+    nbins = int(header["nbins"])
+    start = offset + RAY_HEADER.itemsize
+    data = np.frombuffer(buf, "f4", nfields * nbins, start)
+    flags = np.frombuffer(buf, "u1", nbins, start + 4 * nfields * nbins)
+    rays.append(KdpDiagRay(header, names, data.reshape(nfields, nbins), flags))
+    offset += record_bytes
+
+  return names, rays
+
+
+## Lists the rays in a file, one line per ray.
+# @param list of KdpDiagRay objects
+def listRays(rays):
+  print("# ray elangle azimuth nbins cond_iterations valid_kdp max_kdp")
+  for i in range(len(rays)):
+    ray = rays[i]
+    kdp = ray.fields["kdp"]
+    print("%4d %7.2f %7.2f %5d %3d %5d %8.3f" %
+          (i, ray.elangle, ray.azimuth, ray.nbins, ray.cond_iterations,
+           np.sum(ray.valid_kdp), kdp.max() if ray.nbins else 0.0))
+
+
+## Prints the bins of a ray as columns, one line per bin.
+# @param list of field names
+# @param KdpDiagRay object
+def printRay(names, ray):
+  print("# bin validKdp validUnfold " + " ".join(names))
+  for b in range(ray.nbins):
+    vals = " ".join(["%10.3f" % ray.fields[name][b] for name in names])
+    print("%4d %d %d %s" % (b, ray.valid_kdp[b], ray.valid_unfold[b], vals))
+
+
+if __name__=="__main__":
+  from optparse import OptionParser
+
+  description = "Reads a binary KDP diagnostics file"
+
+  usage = "usage: %prog -i <input file> [-r <ray>] [h]"
+
+  parser = OptionParser(usage=usage, description=description)
+
+  parser.add_option("-i", "--infile", dest="ifile",
+                    help="Name of input diagnostics file.")
+
+  parser.add_option("-r", "--ray", dest="ray", type="int", default=-1,
+                    help="Index of a ray in the file, to print its bins. Defaults to listing the rays.")
+
+  (options, args) = parser.parse_args()
+
+  if not options.ifile:
+    parser.print_help()
+    sys.exit()
+
+  names, rays = read(options.ifile)
+  if options.ray < 0:
+    listRays(rays)
+  else:
+    printRay(names, rays[options.ray])
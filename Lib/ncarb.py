@@ -42,6 +42,8 @@ initialized = 0
 
 # Cannot proceed without these
 REQUIRED_PARAMETERS = ('DBZH', 'ZDR', 'KDP', 'RHOHV', 'PHIDP')
+# ... or these, when KDP is derived along with PID
+REQUIRED_PARAMETERS_NO_KDP = ('DBZH', 'ZDR', 'RHOHV', 'PHIDP')
 
 
 def init(id = "nexrad"):
@@ -101,17 +103,74 @@ def getTempcProfile(scan, profile):
   return rtempc
 
 
+## Derives particle identification for a scan. The texture fields (standard
+#  deviations of ZDR and PHIDP) are computed along each ray by default. Setting
+#  texture_rays > 1 computes them over a box of texture_rays by texture_gates
+#  for the whole scan instead.
+#  With compute_kdp, KDP is derived along each ray from the moments read out
+#  for PID, instead of being read from the scan, and is only added to the scan
+#  if keep_kdp is also set.
+#  With atten_corr, DBZH and ZDR are corrected for attenuation, using KDP
+#  derived along each ray, before they are classified. This is intended for
+#  C and X band, and implies compute_kdp.
+#  With kdp_texture, the texture fields along each ray are taken from the
+#  kernel stats computed while deriving KDP, rather than computed again, and
+#  the PHIDP texture is the circular standard deviation, unaffected by
+#  folding. This implies compute_kdp. A 2-D texture takes precedence.
+#  With native_tempc, the temperature of each bin is computed in C from the
+#  profile at the bin's beam height, instead of being interpolated here and
+#  added to the scan as how/tempc. Heights assume 4/3 earth radius
+#  propagation. The profile is kept for later scans, so profile may be None
+#  if it has already been set.
+#  With per_ray_tempc, the temperatures are computed natively for each ray
+#  from its own elevation angle in how/elangles, for RHIs and scans whose
+#  elevation varies from ray to ray. This implies native_tempc.
+#  With temp_grid, the temperature of each gate is interpolated in C from the
+#  model grid read with _ncarb.setTempGrid (see temp_grid.py), and profile is
+#  not used. Otherwise the grid is cleared.
+# @param PolarScanCore object
+# @param array (2-D) containing profile heights[0] and temperatures[1]
+# @param int median filter length to apply on PID, 0 = no filter
+# @param string identifier of PID thresholds, see THRESHOLDS_FILE
+# @param float ZDR offset in dB
+# @param int whether (1) to derive depolarization ratio or not (0)
+# @param float ZDR scaling factor used when deriving depolarization ratio
+# @param boolean whether to keep the extra fields SNRH and CLASS2
+# @param int number of rays in the texture kernel, 0 or 1 = along range only
+# @param int number of gates in the texture kernel
+# @param boolean whether to derive KDP along with PID
+# @param boolean whether to keep the derived KDP, replacing any existing KDP
+# @param boolean whether to correct DBZH and ZDR for attenuation
+# @param boolean whether to take the texture fields from the KDP stats
+# @param boolean whether to compute the temperatures natively from the profile
+# @param boolean whether to interpolate the temperatures from the model grid
+# @param boolean whether to compute the temperatures from each ray's elevation
 def pidScan(scan, profile, median_filter_len=0, pid_thresholds=None, 
-            zdr_offset=0.0, derive_dr=0, zdr_scale=1.0, keepExtras=False):
-  if not all(elem in scan.getParameterNames() for elem in REQUIRED_PARAMETERS):
-    raise NameError, "Missing one or more required parameters: %s" % ", ".join(REQUIRED_PARAMETERS)
+            zdr_offset=0.0, derive_dr=0, zdr_scale=1.0, keepExtras=False,
+            texture_rays=0, texture_gates=9, compute_kdp=False,
+            keep_kdp=False, atten_corr=False, kdp_texture=False,
+            native_tempc=False, temp_grid=False, per_ray_tempc=False):
+  if atten_corr or kdp_texture: compute_kdp = True
+  if per_ray_tempc: native_tempc = True
+  required = REQUIRED_PARAMETERS_NO_KDP if compute_kdp else REQUIRED_PARAMETERS
+  if not all(elem in scan.getParameterNames() for elem in required):
+    raise NameError, "Missing one or more required parameters: %s" % ", ".join(required)
   if not initialized:
     if pid_thresholds: init(pid_thresholds)
     else: init()
   if pid_thresholds: _ncarb.readThresholdsFromFile(THRESHOLDS_FILE[pid_thresholds])
-  rtempc = getTempcProfile(scan, profile)
-  scan.addAttribute('how/tempc', rtempc)
-  _ncarb.generateNcar_pid(scan, median_filter_len, zdr_offset, derive_dr, zdr_scale)
+  if not temp_grid: _ncarb.setTempGrid(None)
+  if native_tempc:
+    if profile is not None: _ncarb.setTempProfile(profile[0], profile[1])
+  elif not temp_grid:
+    _ncarb.setTempProfile(None)
+    rtempc = getTempcProfile(scan, profile)
+    scan.addAttribute('how/tempc', rtempc)
+  _ncarb.setTextureKernel(texture_rays, texture_gates)
+  _ncarb.setPerRayTempc(int(per_ray_tempc))
+  _ncarb.generateNcar_pid(scan, median_filter_len, zdr_offset, derive_dr,
+                          zdr_scale, int(compute_kdp), int(keep_kdp),
+                          int(atten_corr), int(kdp_texture))
 
   if not keepExtras:
     for param in ["SNRH", "CLASS2"]:
@@ -119,20 +178,41 @@ def pidScan(scan, profile, median_filter_len=0, pid_thresholds=None,
 
 
 def ncar_PID(rio, profile_fstr, median_filter_len=0, pid_thresholds=None, 
-             zdr_offset=0.0, derive_dr=0, zdr_scale=1.0, keepExtras=False):
-  profile = readProfile(profile_fstr, scale_height=1000.0)
+             zdr_offset=0.0, derive_dr=0, zdr_scale=1.0, keepExtras=False,
+             texture_rays=0, texture_gates=9, compute_kdp=False,
+             keep_kdp=False, atten_corr=False, kdp_texture=False,
+             native_tempc=False, temp_grid_fstr=None, per_ray_tempc=False):
   pobject = rio.object
+  if per_ray_tempc: native_tempc = True
+
+  # With a model grid, the profile isn't needed
+  temp_grid = temp_grid_fstr is not None
+  if temp_grid:
+    if not _ncarb.setTempGrid(temp_grid_fstr):
+      raise IOError("Failed to read temperature grid: %s" % temp_grid_fstr)
+    profile = None
+  else:
+    profile = readProfile(profile_fstr, scale_height=1000.0)
+
+  # With native temperatures, the profile is only handed over once
+  if native_tempc and not temp_grid:
+    _ncarb.setTempProfile(profile[0], profile[1])
+    profile = None
 
   if _polarvolume.isPolarVolume(pobject):
     nscans = pobject.getNumberOfScans(pobject)
     for n in range(nscans):
       scan = pobject.getScan(n)
       pidScan(scan, profile, median_filter_len, pid_thresholds, zdr_offset, 
-              derive_dr, zdr_scale, keepExtras)
+              derive_dr, zdr_scale, keepExtras, texture_rays, texture_gates,
+              compute_kdp, keep_kdp, atten_corr, kdp_texture, native_tempc,
+              temp_grid, per_ray_tempc)
 
   elif _polarscan.isPolarScan(pobject):
     pidScan(pobject, profile, median_filter_len, pid_thresholds, zdr_offset, 
-            derive_dr, zdr_scale, keepExtras)
+            derive_dr, zdr_scale, keepExtras, texture_rays, texture_gates,
+            compute_kdp, keep_kdp, atten_corr, kdp_texture, native_tempc,
+            temp_grid, per_ray_tempc)
 
   else:
     raise IOError("Input object is neither polar volume nor scan")
@@ -0,0 +1,104 @@
+#!/usr/bin/env python
+'''
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+
+Writer and reader for the model temperature grid files read by TempGrid, see
+_ncarb.setTempGrid. The file layout is described in TempGrid.hh.
+
+The grid is regular in latitude and longitude, with levels at fixed heights
+above sea level. Model fields on pressure or hybrid levels need to be
+interpolated to fixed heights before they are written.
+
+@file
+@author Daniel Michelson, Environment and Climate Change Canada
+@date 2019-12-16
+'''
+import numpy as np
+
+MAGIC = b"NCARBTG1"
+
+# Header following the magic string
+HEADER = np.dtype([("nx", "i4"), ("ny", "i4"), ("nz", "i4"), ("spare", "i4"),
+                   ("lon0", "f8"), ("lat0", "f8"),
+                   ("dlon", "f8"), ("dlat", "f8")])
+
+
+## Writes a temperature grid file.
+# @param string output file string
+# @param float longitude of the centre of the first cell, degrees
+# @param float latitude of the centre of the first cell, degrees
+# @param float cell spacing in longitude, degrees
+# @param float cell spacing in latitude, degrees
+# @param array (1-D) of level heights, m above sea level, ascending
+# @param array (3-D) of temperatures in C, indexed [level, row, column],
+#  rows going north from lat0 and columns east from lon0
+def write(fstr, lon0, lat0, dlon, dlat, heights, tempc):
+  heights = np.asarray(heights, "f8")
+  tempc = np.asarray(tempc, "f4")
+  if tempc.ndim != 3 or tempc.shape[0] != len(heights):
+    raise ValueError("Temperatures must be 3-D, with one plane per level")
+  if np.any(np.diff(heights) <= 0):
+    raise ValueError("Level heights must be ascending")
+  nz, ny, nx = tempc.shape
+  header = np.array([(nx, ny, nz, 0, lon0, lat0, dlon, dlat)], HEADER)
+
+  fd = open(fstr, "wb")
+  fd.write(MAGIC)
+  fd.write(header.tobytes())
+  fd.write(heights.tobytes())
+  fd.write(np.ascontiguousarray(tempc).tobytes())
+  fd.close()
+
+
+## Reads a temperature grid file.
+# @param string input file string
+# @return tuple of the header (numpy record with nx, ny, nz, lon0, lat0, dlon
+#  and dlat), the level heights and the temperatures [level, row, column]
+def read(fstr):
+  fd = open(fstr, "rb")
+  buf = fd.read()
+  fd.close()
+  if buf[:len(MAGIC)] != MAGIC:
+    raise IOError("%s is not a temperature grid file" % fstr)
+
+  offset = len(MAGIC)
+  header = np.frombuffer(buf, HEADER, 1, offset)[0]
+  offset += HEADER.itemsize
+  nx, ny, nz = int(header["nx"]), int(header["ny"]), int(header["nz"])
+  heights = np.frombuffer(buf, "f8", nz, offset)
+  offset += 8 * nz
+  tempc = np.frombuffer(buf, "f4", nx * ny * nz, offset).reshape(nz, ny, nx)
+  return header, heights, tempc
+
+
+## Writes a grid with the same profile at every point, which is mainly useful
+#  for testing.
+# @param string output file string
+# @param array (2-D) containing profile heights[0] and temperatures[1], as
+#  returned by ncarb.readProfile
+# @param float longitude of the centre of the first cell, degrees
+# @param float latitude of the centre of the first cell, degrees
+# @param float cell spacing in longitude, degrees
+# @param float cell spacing in latitude, degrees
+# @param int number of columns
+# @param int number of rows
+def writeFromProfile(fstr, profile, lon0, lat0, dlon, dlat, nx, ny):
+  heights, temps = np.asarray(profile[0]), np.asarray(profile[1])
+  tempc = np.repeat(temps, nx * ny).reshape(len(temps), ny, nx)
+  write(fstr, lon0, lat0, dlon, dlat, heights, tempc)
@@ -32,6 +32,7 @@ along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
 #include "pypolarscan.h"
 #include "pyrave_debug.h"
 #include "ncar_pid.h"
+#include "ncar_kdp.h"
 
 /**
  * Debug this module
@@ -81,18 +82,218 @@ static PyObject* _readThresholdsFromFile_func(PyObject* self, PyObject* args) {
 }
 
 
+/**
+ * Sets the kernel size for the ZDR and PHIDP texture fields
+ * @param[in] number of rays and number of gates in the kernel
+ * @return None
+ */
+static PyObject* _setTextureKernel_func(PyObject* self, PyObject* args) {
+  int nrays, ngates;
+
+  if (!PyArg_ParseTuple(args, "ii", &nrays, &ngates)) {
+    return NULL;
+  }
+
+  if (ngates < 1) {
+    raiseException_returnNULL(PyExc_ValueError, "Texture kernel must contain at least one gate");
+  }
+  setTextureKernel(nrays, ngates);
+
+  Py_RETURN_NONE;
+}
+
+
+/**
+ * Sets the height-temperature profile used to compute the temperature of each
+ * bin in generateNcar_pid, instead of reading it from how/tempc
+ * @param[in] sequence of heights (m above sea level), ascending, and sequence
+ * of temperatures (C). None clears the profile, so that how/tempc is used.
+ * @return None
+ */
+static PyObject* _setTempProfile_func(PyObject* self, PyObject* args) {
+  PyObject* hobj = NULL;
+  PyObject* tobj = NULL;
+  PyArrayObject* height = NULL;
+  PyArrayObject* tempc = NULL;
+  PyObject* result = NULL;
+
+  if (!PyArg_ParseTuple(args, "O|O", &hobj, &tobj)) {
+    return NULL;
+  }
+  if (hobj == Py_None) {
+    setTempProfile(NULL, NULL, 0);
+    Py_RETURN_NONE;
+  }
+  if (tobj == NULL) {
+    raiseException_returnNULL(PyExc_TypeError, "Temperatures are required with heights");
+  }
+
+  height = (PyArrayObject*)PyArray_ContiguousFromObject(hobj, NPY_DOUBLE, 1, 1);
+  tempc = (PyArrayObject*)PyArray_ContiguousFromObject(tobj, NPY_DOUBLE, 1, 1);
+  if ( (height == NULL) || (tempc == NULL) ) {
+    raiseException_gotoTag(done, PyExc_TypeError, "Heights and temperatures must be 1-D sequences of numbers");
+  }
+  if ( (PyArray_DIM(height, 0) != PyArray_DIM(tempc, 0)) || (PyArray_DIM(height, 0) < 1) ) {
+    raiseException_gotoTag(done, PyExc_ValueError, "Heights and temperatures must have the same, non-zero, length");
+  }
+  if (!setTempProfile((const double*)PyArray_DATA(height), (const double*)PyArray_DATA(tempc), (int)PyArray_DIM(height, 0))) {
+    raiseException_gotoTag(done, PyExc_ValueError, "Profile heights must be ascending");
+  }
+  Py_INCREF(Py_None);
+  result = Py_None;
+
+ done:
+  Py_XDECREF(height);
+  Py_XDECREF(tempc);
+  return result;
+}
+
+
+/**
+ * Sets whether temperatures are computed for each ray from its own elevation
+ * angle in how/elangles, when they are computed from a profile
+ * @param[in] boolean whether to use each ray's elevation
+ * @return None
+ */
+static PyObject* _setPerRayTempc_func(PyObject* self, PyObject* args) {
+  int per_ray;
+
+  if (!PyArg_ParseTuple(args, "i", &per_ray)) {
+    return NULL;
+  }
+  setPerRayTempc(per_ray);
+
+  Py_RETURN_NONE;
+}
+
+
+/**
+ * Appends a sounding to a local sounding archive, creating it if need be
+ * @param[in] path of the archive, station name, launch time in seconds
+ * since the epoch, and sequences of pressures (hPa), heights (m above sea
+ * level) and temperatures (C)
+ * @return None
+ */
+static PyObject* _appendSounding_func(PyObject* self, PyObject* args) {
+  const char* path = NULL;
+  const char* station = NULL;
+  long sounding_time;
+  PyObject* pobj = NULL;
+  PyObject* hobj = NULL;
+  PyObject* tobj = NULL;
+  PyArrayObject* pressure = NULL;
+  PyArrayObject* height = NULL;
+  PyArrayObject* tempc = NULL;
+  PyObject* result = NULL;
+
+  if (!PyArg_ParseTuple(args, "sslOOO", &path, &station, &sounding_time, &pobj, &hobj, &tobj)) {
+    return NULL;
+  }
+
+  pressure = (PyArrayObject*)PyArray_ContiguousFromObject(pobj, NPY_DOUBLE, 1, 1);
+  height = (PyArrayObject*)PyArray_ContiguousFromObject(hobj, NPY_DOUBLE, 1, 1);
+  tempc = (PyArrayObject*)PyArray_ContiguousFromObject(tobj, NPY_DOUBLE, 1, 1);
+  if ( (pressure == NULL) || (height == NULL) || (tempc == NULL) ) {
+    raiseException_gotoTag(done, PyExc_TypeError, "Pressures, heights and temperatures must be 1-D sequences of numbers");
+  }
+  if ( (PyArray_DIM(pressure, 0) != PyArray_DIM(height, 0)) || (PyArray_DIM(height, 0) != PyArray_DIM(tempc, 0)) ) {
+    raiseException_gotoTag(done, PyExc_ValueError, "Pressures, heights and temperatures must have the same length");
+  }
+  if (!appendSounding(path, station, sounding_time, (const double*)PyArray_DATA(pressure), (const double*)PyArray_DATA(height), (const double*)PyArray_DATA(tempc), (int)PyArray_DIM(height, 0))) {
+    raiseException_gotoTag(done, PyExc_IOError, "Failed to append to sounding archive");
+  }
+  Py_INCREF(Py_None);
+  result = Py_None;
+
+ done:
+  Py_XDECREF(pressure);
+  Py_XDECREF(height);
+  Py_XDECREF(tempc);
+  return result;
+}
+
+
+/**
+ * Sets the temperature profile from the latest valid sounding in a local
+ * sounding archive, at or before a time and within a search margin
+ * @param[in] path of the archive, station name, data time in seconds since
+ * the epoch, and optionally the search margin in seconds, default 1 day
+ * @return the launch time of the sounding, or None if there is none, in
+ * which case the profile is cleared
+ */
+static PyObject* _setTempProfileFromArchive_func(PyObject* self, PyObject* args) {
+  const char* path = NULL;
+  const char* station = NULL;
+  long data_time, sounding_time;
+  int margin_secs = 86400;
+
+  if (!PyArg_ParseTuple(args, "ssl|i", &path, &station, &data_time, &margin_secs)) {
+    return NULL;
+  }
+  sounding_time = setTempProfileFromArchive(path, station, data_time, margin_secs);
+  if (sounding_time < 0) {
+    Py_RETURN_NONE;
+  }
+
+  return PyLong_FromLong(sounding_time);
+}
+
+
+/**
+ * Reads a model temperature grid, from which PID then interpolates the 
+ * temperature of each gate, taking precedence over a profile and how/tempc
+ * @param[in] path of the grid file, or None to clear the grid
+ * @return None
+ */
+static PyObject* _setTempGrid_func(PyObject* self, PyObject* args) {
+  const char* path = NULL;
+
+  if (!PyArg_ParseTuple(args, "z", &path)) {
+    return NULL;
+  }
+  if (!setTempGrid(path)) {
+    raiseException_returnNULL(PyExc_IOError, "Failed to read temperature grid file");
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+/**
+ * Sets the memory limit of the cache of per-bin beam heights, temperatures
+ * and SNR noise, kept from volume to volume for the same scan geometry
+ * @param[in] limit in bytes
+ * @return None
+ */
+static PyObject* _setGeometryCacheLimit_func(PyObject* self, PyObject* args) {
+  long max_bytes;
+
+  if (!PyArg_ParseTuple(args, "l", &max_bytes)) {
+    return NULL;
+  }
+  setGeometryCacheLimit(max_bytes);
+
+  Py_RETURN_NONE;
+}
+
+
 /**
  * Derives particle identification (PID) from a scan of polarimetric moments
- * @param[in] 
- * @return 
+ * @param[in] scan, median filter length, ZDR offset, whether to derive DR,
+ * ZDR scale, and optionally whether to derive KDP along each ray instead of
+ * reading it from the scan, whether to keep the derived KDP, whether to
+ * correct DBZH and ZDR for attenuation before classifying, and whether to
+ * take the texture fields from the KDP stats
+ * @return None
  */
 static PyObject* _generateNcar_pid_func(PyObject* self, PyObject* args) {
   PyObject* object = NULL;
   PyPolarScan* pyscan = NULL;
   int median_filter_len, derive_dr;
+  int compute_kdp = 0, keep_kdp = 0, atten_corr = 0, kdp_texture = 0;
   double zdr_offset, zdr_scale;
 
-  if (!PyArg_ParseTuple(args, "Oidid", &object, &median_filter_len, &zdr_offset, &derive_dr, &zdr_scale)) {
+  if (!PyArg_ParseTuple(args, "Oidid|iiii", &object, &median_filter_len, &zdr_offset, &derive_dr, &zdr_scale, &compute_kdp, &keep_kdp, &atten_corr, &kdp_texture)) {
     return NULL;
   }
 
@@ -102,8 +303,139 @@ static PyObject* _generateNcar_pid_func(PyObject* self, PyObject* args) {
     raiseException_returnNULL(PyExc_AttributeError, "NCAR PID requires scan (in principle sweep or RHI) as input");
   }
 
+  setPidKdp(compute_kdp, keep_kdp, atten_corr, kdp_texture);
   if (!generateNcar_pid(pyscan->scan, median_filter_len, zdr_offset, derive_dr, zdr_scale)) {
-    raiseException_returnNULL(PyExc_AttributeError, "Something went wrong");
+    raiseException_returnNULL(PyExc_AttributeError, "Something went wrong. Does the scan have how/tempc, or has a temperature profile or grid been set?");
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+/**
+ * Gets the number of gates at which each particle type was eligible, i.e.
+ * within its threshold limits, in the last call to generateNcar_pid
+ * @return dictionary of counts, keyed by particle label
+ */
+static PyObject* _getPidEligibleCounts_func(PyObject* self, PyObject* args) {
+  const char* labels[32];
+  long counts[32];
+  int ntypes, ii;
+  PyObject* result = NULL;
+
+  if (!PyArg_ParseTuple(args, "")) {
+    return NULL;
+  }
+  ntypes = MY_MIN(getPidEligibleCounts(labels, counts, 32), 32);
+
+  result = PyDict_New();
+  if (result == NULL) {
+    return NULL;
+  }
+  for (ii = 0; ii < ntypes; ii++) {
+    PyObject* count = PyLong_FromLong(counts[ii]);
+    if ( (count == NULL) || (PyDict_SetItemString(result, labels[ii], count) < 0) ) {
+      Py_XDECREF(count);
+      Py_DECREF(result);
+      return NULL;
+    }
+    Py_DECREF(count);
+  }
+
+  return result;
+}
+
+
+/**
+ * Derives KDP from a scan of polarimetric moments
+ * @param[in] scan, and optionally number of threads, whether to add PSOB 
+ * whether to add attenuation corrections (PIA, PIDA), the maximum range
+ * (km) to process, 0 for no limit, and whether to apply the repeated FIR
+ * filter passes as one composite filter
+ * @return None
+ */
+static PyObject* _kdpScan_func(PyObject* self, PyObject* args) {
+  PyObject* object = NULL;
+  PyPolarScan* pyscan = NULL;
+  int nthreads = 1, psob = 0, atten_corr = 0, composite = 0;
+  double max_range_km = 0.0;
+
+  if (!PyArg_ParseTuple(args, "O|iiidi", &object, &nthreads, &psob, &atten_corr, &max_range_km, &composite)) {
+    return NULL;
+  }
+
+  if (PyPolarScan_Check(object)) {
+    pyscan = (PyPolarScan*)object;
+  } else {
+    raiseException_returnNULL(PyExc_AttributeError, "NCAR KDP requires scan (in principle sweep or RHI) as input");
+  }
+
+  setKdpOptions(nthreads, psob, atten_corr, max_range_km, composite);
+  if (!kdpFilterCompute(pyscan->scan)) {
+    raiseException_returnNULL(PyExc_AttributeError, "Something went wrong. Does the scan contain PHIDP?");
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+/**
+ * Sets the FIR filter used by kdpScan
+ * @param[in] filter length (gates), and optionally the numbers of passes
+ * over the unfolded and the conditioned PHIDP
+ * @return None
+ */
+static PyObject* _setKdpFirFilter_func(PyObject* self, PyObject* args) {
+  int fir_len;
+  int n_iter_unfolded = 2, n_iter_cond = 4;
+
+  if (!PyArg_ParseTuple(args, "i|ii", &fir_len, &n_iter_unfolded, &n_iter_cond)) {
+    return NULL;
+  }
+  if (!setKdpFirFilter(fir_len, n_iter_unfolded, n_iter_cond)) {
+    raiseException_returnNULL(PyExc_ValueError, "FIR filter length must be 125, 60, 40, 30, 20 or 10 gates, with at least one pass");
+  }
+
+  Py_RETURN_NONE;
+}
+
+
+/**
+ * Sets the filtering of the conditioned PHIDP used by kdpScan
+ * @param[in] whether to use iterative filtering, and optionally the
+ * convergence tolerance (deg) at which to stop iterating, negative to
+ * always run all the iterations
+ * @return None
+ */
+static PyObject* _setKdpIterativeFiltering_func(PyObject* self, PyObject* args) {
+  int iterative;
+  double tolerance = -1.0;
+
+  if (!PyArg_ParseTuple(args, "i|d", &iterative, &tolerance)) {
+    return NULL;
+  }
+  setKdpIterativeFiltering(iterative, tolerance);
+
+  Py_RETURN_NONE;
+}
+
+
+/**
+ * Starts or ends writing KDP diagnostics for selected rays to a binary file
+ * @param[in] path of the file, None or empty to close the file being
+ * written, and optionally the min and max elevation angles and azimuths
+ * (deg) of the rays to write
+ * @return None
+ */
+static PyObject* _setKdpDiagnostics_func(PyObject* self, PyObject* args) {
+  const char *path = NULL;
+  double min_elev = -90.0, max_elev = 90.0, min_az = 0.0, max_az = 360.0;
+
+  if (!PyArg_ParseTuple(args, "z|dddd", &path, &min_elev, &max_elev, &min_az, &max_az)) {
+    return NULL;
+  }
+  if (!setKdpDiagnostics(path, min_elev, max_elev, min_az, max_az)) {
+    raiseException_returnNULL(PyExc_IOError, "Failed to open KDP diagnostics file");
   }
 
   Py_RETURN_NONE;
@@ -114,6 +446,18 @@ static struct PyMethodDef _ncarb_functions[] =
 {
   {"readThresholdsFromFile", (PyCFunction) _readThresholdsFromFile_func, METH_VARARGS },
   {"generateNcar_pid", (PyCFunction) _generateNcar_pid_func, METH_VARARGS },
+  {"getPidEligibleCounts", (PyCFunction) _getPidEligibleCounts_func, METH_VARARGS },
+  {"setTempProfile", (PyCFunction) _setTempProfile_func, METH_VARARGS },
+  {"setPerRayTempc", (PyCFunction) _setPerRayTempc_func, METH_VARARGS },
+  {"appendSounding", (PyCFunction) _appendSounding_func, METH_VARARGS },
+  {"setTempProfileFromArchive", (PyCFunction) _setTempProfileFromArchive_func, METH_VARARGS },
+  {"setTempGrid", (PyCFunction) _setTempGrid_func, METH_VARARGS },
+  {"setGeometryCacheLimit", (PyCFunction) _setGeometryCacheLimit_func, METH_VARARGS },
+  {"setTextureKernel", (PyCFunction) _setTextureKernel_func, METH_VARARGS },
+  {"kdpScan", (PyCFunction) _kdpScan_func, METH_VARARGS },
+  {"setKdpFirFilter", (PyCFunction) _setKdpFirFilter_func, METH_VARARGS },
+  {"setKdpIterativeFiltering", (PyCFunction) _setKdpIterativeFiltering_func, METH_VARARGS },
+  {"setKdpDiagnostics", (PyCFunction) _setKdpDiagnostics_func, METH_VARARGS },
   { NULL, NULL }
 };
 
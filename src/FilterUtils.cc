@@ -36,6 +36,10 @@
 #include <cstring>
 #include <cstdlib>
 #include <vector>
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "FilterUtils.hh"
 #include "TaArray.hh"
 
@@ -225,3 +229,431 @@ void FilterUtils::computeSdevInRange(double *field,
 
 }
 
+
+/////////////////////////////////////////////////////////////////
+// compute standard deviation of a scan field, over a kernel box
+// in azimuth and range, using summed-area tables
+//
+// The field is stored ray by ray. Range limits are clipped as in
+// computeSdevInRange(). Azimuth limits wrap if wrapAzimuth is true.
+// The sdev will be set to missingVal if not enough data is
+// available for computing the standard deviation.
+
+void FilterUtils::computeSdevInBox(const double *field,
+                                   double *sdev,
+                                   int nRays,
+                                   int nGates,
+                                   int nRaysKernel,
+                                   int nGatesKernel,
+                                   bool wrapAzimuth,
+                                   double missingVal)
+  
+{
+
+  if (nRays < 1 || nGates < 1) {
+    return;
+  }
+
+  int nRaysHalf = nRaysKernel / 2;
+  int nGatesHalf = nGatesKernel / 2;
+  if (wrapAzimuth && 2 * nRaysHalf + 1 > nRays) {
+    // kernel covers the whole circle - do not count any ray twice
+    nRaysHalf = (nRays - 1) / 2;
+  }
+
+  // remove the mean before summing, to keep the sum of squares
+  // well conditioned for fields with a large offset, e.g. phidp
+
+  int nPts = nRays * nGates;
+  double sumAll = 0.0;
+  double nAll = 0.0;
+  for (int ii = 0; ii < nPts; ii++) {
+    if (field[ii] != missingVal) {
+      sumAll += field[ii];
+      nAll++;
+    }
+  }
+  double ref = 0.0;
+  if (nAll > 0) {
+    ref = sumAll / nAll;
+  }
+
+  // the tables have one extra leading row and column of zeros,
+  // and when wrapping, nRaysHalf extra rays at each end
+
+  int nRowsExt = nRays;
+  if (wrapAzimuth) {
+    nRowsExt = nRays + 2 * nRaysHalf;
+  }
+  int nCols = nGates + 1;
+  int tableLen = (nRowsExt + 1) * nCols;
+
+  TaArray<double> sum_, sumSq_;
+  TaArray<int> count_;
+  double *sum = sum_.alloc(tableLen);
+  double *sumSq = sumSq_.alloc(tableLen);
+  int *count = count_.alloc(tableLen);
+
+  for (int jj = 0; jj < nCols; jj++) {
+    sum[jj] = 0.0;
+    sumSq[jj] = 0.0;
+    count[jj] = 0;
+  }
+
+  for (int irow = 0; irow < nRowsExt; irow++) {
+
+    int iray = irow;
+    if (wrapAzimuth) {
+      iray = (irow - nRaysHalf + nRays) % nRays;
+    }
+    const double *fld = field + (size_t) iray * nGates;
+    
+    double *sumPrev = sum + (size_t) irow * nCols;
+    double *sumSqPrev = sumSq + (size_t) irow * nCols;
+    int *countPrev = count + (size_t) irow * nCols;
+    double *sumRow = sumPrev + nCols;
+    double *sumSqRow = sumSqPrev + nCols;
+    int *countRow = countPrev + nCols;
+
+    sumRow[0] = 0.0;
+    sumSqRow[0] = 0.0;
+    countRow[0] = 0;
+
+    double rowSum = 0.0;
+    double rowSumSq = 0.0;
+    int rowCount = 0;
+    for (int igate = 0; igate < nGates; igate++) {
+      double zz = fld[igate];
+      if (zz != missingVal) {
+        double dz = zz - ref;
+        rowSum += dz;
+        rowSumSq += dz * dz;
+        rowCount++;
+      }
+      sumRow[igate + 1] = sumPrev[igate + 1] + rowSum;
+      sumSqRow[igate + 1] = sumSqPrev[igate + 1] + rowSumSq;
+      countRow[igate + 1] = countPrev[igate + 1] + rowCount;
+    } // igate
+
+  } // irow
+
+  // set up gate limits, as table column indices
+
+  vector<int> startCol(nGates);
+  vector<int> endCol(nGates);
+  for (int igate = 0; igate < nGates; igate++) {
+    int start = igate - nGatesHalf;
+    if (start < 0) {
+      start = 0;
+    }
+    startCol[igate] = start;
+    int end = igate + nGatesHalf;
+    if (end > nGates - 1) {
+      end = nGates - 1;
+    }
+    endCol[igate] = end + 1;
+  } // igate
+
+  // sdev computed in the box
+  
+  for (int iray = 0; iray < nRays; iray++) {
+
+    // table row indices bounding the kernel
+
+    int startRow, endRow;
+    if (wrapAzimuth) {
+      startRow = iray;
+      endRow = iray + 2 * nRaysHalf + 1;
+    } else {
+      startRow = iray - nRaysHalf;
+      if (startRow < 0) {
+        startRow = 0;
+      }
+      endRow = iray + nRaysHalf + 1;
+      if (endRow > nRays) {
+        endRow = nRays;
+      }
+    }
+
+    const double *sumLo = sum + (size_t) startRow * nCols;
+    const double *sumHi = sum + (size_t) endRow * nCols;
+    const double *sumSqLo = sumSq + (size_t) startRow * nCols;
+    const double *sumSqHi = sumSq + (size_t) endRow * nCols;
+    const int *countLo = count + (size_t) startRow * nCols;
+    const int *countHi = count + (size_t) endRow * nCols;
+    double *sd = sdev + (size_t) iray * nGates;
+
+    for (int igate = 0; igate < nGates; igate++) {
+
+      sd[igate] = missingVal;
+
+      int c0 = startCol[igate];
+      int c1 = endCol[igate];
+      int nVal = countHi[c1] - countHi[c0] - countLo[c1] + countLo[c0];
+      if (nVal > 2) {
+        double sumVal = sumHi[c1] - sumHi[c0] - sumLo[c1] + sumLo[c0];
+        double sumValSq =
+          sumSqHi[c1] - sumSqHi[c0] - sumSqLo[c1] + sumSqLo[c0];
+        double meanVal = sumVal / nVal;
+        double term1 = sumValSq / nVal;
+        double term2 = meanVal * meanVal;
+        if (term1 >= term2) {
+          sd[igate] = sqrt(term1 - term2);
+        }
+      }
+
+    } // igate
+    
+  } // iray
+
+}
+
+/////////////////////////////////////////////////////////////////
+// apply FIR filter using direct convolution
+//
+// out[ii] = sum over jj of coeff[jj] * in[ii + jj]
+//
+// With SSE2, blocks of eight outputs are held in four registers
+// while the coefficients are run through, so each step only loads
+// the input. The remaining outputs are computed in blocks held in
+// cache, with the coefficient loop outside the gate loop. Either
+// way each output is summed over jj in order.
+
+void FilterUtils::applyFirFilter(const double *in,
+                                 double *out,
+                                 int nOut,
+                                 const double *coeff,
+                                 int nCoeff)
+  
+{
+
+  int first = 0;
+
+#ifdef __SSE2__
+  for (; first + 8 <= nOut; first += 8) {
+    const double *inp = in + first;
+    __m128d acc0 = _mm_setzero_pd();
+    __m128d acc1 = _mm_setzero_pd();
+    __m128d acc2 = _mm_setzero_pd();
+    __m128d acc3 = _mm_setzero_pd();
+    for (int jj = 0; jj < nCoeff; jj++) {
+      __m128d cc = _mm_set1_pd(coeff[jj]);
+      const double *inj = inp + jj;
+      acc0 = _mm_add_pd(acc0, _mm_mul_pd(cc, _mm_loadu_pd(inj)));
+      acc1 = _mm_add_pd(acc1, _mm_mul_pd(cc, _mm_loadu_pd(inj + 2)));
+      acc2 = _mm_add_pd(acc2, _mm_mul_pd(cc, _mm_loadu_pd(inj + 4)));
+      acc3 = _mm_add_pd(acc3, _mm_mul_pd(cc, _mm_loadu_pd(inj + 6)));
+    } // jj
+    _mm_storeu_pd(out + first, acc0);
+    _mm_storeu_pd(out + first + 2, acc1);
+    _mm_storeu_pd(out + first + 4, acc2);
+    _mm_storeu_pd(out + first + 6, acc3);
+  } // first
+#endif
+
+  const int blockLen = 256;
+  double acc[blockLen];
+
+  for (int start = first; start < nOut; start += blockLen) {
+
+    int nn = nOut - start;
+    if (nn > blockLen) {
+      nn = blockLen;
+    }
+    const double *inBlock = in + start;
+
+    for (int ii = 0; ii < nn; ii++) {
+      acc[ii] = 0.0;
+    }
+    for (int jj = 0; jj < nCoeff; jj++) {
+      double cc = coeff[jj];
+      const double *inj = inBlock + jj;
+      for (int ii = 0; ii < nn; ii++) {
+        acc[ii] = acc[ii] + cc * inj[ii];
+      }
+    } // jj
+
+    memcpy(out + start, acc, nn * sizeof(double));
+
+  } // start
+
+}
+
+/////////////////////////////////////////////////////////////////
+// apply FIR filter using FFT convolution
+//
+// out[ii] = sum over jj of coeff[jj] * in[ii + jj]
+
+void FilterUtils::applyFirFilterFft(const double *in,
+                                    double *out,
+                                    int nOut,
+                                    const double *coeff,
+                                    int nCoeff)
+  
+{
+
+  // the circular convolution must hold all of the input
+  // so that the outputs we need are not wrapped
+
+  int nIn = nOut + nCoeff - 1;
+  int nFft = 1;
+  while (nFft < nIn) {
+    nFft *= 2;
+  }
+
+  // pack the input into the real part and the reversed coefficients
+  // into the imaginary part, so one transform gives both spectra.
+  // Reversing the coefficients turns correlation into convolution.
+
+  TaArray<double> zRe_, zIm_;
+  double *zRe = zRe_.alloc(nFft);
+  double *zIm = zIm_.alloc(nFft);
+  for (int ii = 0; ii < nFft; ii++) {
+    zRe[ii] = 0.0;
+    zIm[ii] = 0.0;
+  }
+  memcpy(zRe, in, nIn * sizeof(double));
+
+  // scale the coefficients to the size of the input data, otherwise
+  // separating the spectra loses precision in the smaller one
+
+  double maxIn = 0.0;
+  for (int ii = 0; ii < nIn; ii++) {
+    maxIn = max(maxIn, fabs(in[ii]));
+  }
+  double maxCoeff = 0.0;
+  for (int jj = 0; jj < nCoeff; jj++) {
+    maxCoeff = max(maxCoeff, fabs(coeff[jj]));
+  }
+  double scale = 1.0;
+  if (maxIn > 0 && maxCoeff > 0) {
+    scale = maxIn / maxCoeff;
+  }
+  for (int jj = 0; jj < nCoeff; jj++) {
+    zIm[jj] = coeff[nCoeff - 1 - jj] * scale;
+  }
+
+  _fft(zRe, zIm, nFft, false);
+
+  // separate the spectra and multiply them
+  //   X[k] = (Z[k] + conj(Z[n-k])) / 2
+  //   C[k] = (Z[k] - conj(Z[n-k])) / 2i
+  // the product is conjugate symmetric, so work on pairs k, n-k
+
+  for (int kk = 0; kk <= nFft / 2; kk++) {
+    int mm = (nFft - kk) & (nFft - 1);
+    double aRe = zRe[kk], aIm = zIm[kk];
+    double bRe = zRe[mm], bIm = zIm[mm];
+    double xRe = 0.5 * (aRe + bRe);
+    double xIm = 0.5 * (aIm - bIm);
+    double cRe = 0.5 * (aIm + bIm);
+    double cIm = -0.5 * (aRe - bRe);
+    double yRe = xRe * cRe - xIm * cIm;
+    double yIm = xRe * cIm + xIm * cRe;
+    zRe[kk] = yRe;
+    zIm[kk] = yIm;
+    zRe[mm] = yRe;
+    zIm[mm] = -yIm;
+  }
+
+  _fft(zRe, zIm, nFft, true);
+
+  // the convolution is offset by the filter length
+
+  for (int ii = 0; ii < nOut; ii++) {
+    out[ii] = zRe[nCoeff - 1 + ii] / scale;
+  }
+
+}
+
+/////////////////////////////////////////////////////////////////
+// convolve two sets of filter coefficients
+
+void FilterUtils::convolveCoeffs(const double *aa, int nA,
+                                 const double *bb, int nB,
+                                 double *ab)
+  
+{
+
+  for (int ii = 0; ii < nA + nB - 1; ii++) {
+    ab[ii] = 0.0;
+  }
+  for (int ii = 0; ii < nA; ii++) {
+    for (int jj = 0; jj < nB; jj++) {
+      ab[ii + jj] += aa[ii] * bb[jj];
+    }
+  }
+
+}
+
+/////////////////////////////////////////////////////////////////
+// in-place radix-2 complex FFT
+// the inverse is scaled by 1/nn
+
+void FilterUtils::_fft(double *re, double *im, int nn, bool inverse)
+  
+{
+
+  // bit reversal permutation
+
+  for (int ii = 1, jj = 0; ii < nn; ii++) {
+    int bit = nn >> 1;
+    for (; jj & bit; bit >>= 1) {
+      jj ^= bit;
+    }
+    jj ^= bit;
+    if (ii < jj) {
+      double tmp = re[ii];
+      re[ii] = re[jj];
+      re[jj] = tmp;
+      tmp = im[ii];
+      im[ii] = im[jj];
+      im[jj] = tmp;
+    }
+  }
+
+  // butterflies. The twiddle factors of each stage are tabulated
+  // first, so the butterflies run through the array in order
+  // rather than striding across it once per factor.
+
+  TaArray<double> wRe_, wIm_;
+  double *wRe = wRe_.alloc(nn / 2 + 1);
+  double *wIm = wIm_.alloc(nn / 2 + 1);
+
+  for (int len = 2; len <= nn; len *= 2) {
+    double ang = 2.0 * M_PI / len * (inverse ? 1.0 : -1.0);
+    double stepRe = cos(ang);
+    double stepIm = sin(ang);
+    int half = len / 2;
+    wRe[0] = 1.0;
+    wIm[0] = 0.0;
+    for (int kk = 1; kk < half; kk++) {
+      // twiddle factors by recurrence
+      wRe[kk] = wRe[kk - 1] * stepRe - wIm[kk - 1] * stepIm;
+      wIm[kk] = wRe[kk - 1] * stepIm + wIm[kk - 1] * stepRe;
+    }
+    for (int ii0 = 0; ii0 < nn; ii0 += len) {
+      double *re0 = re + ii0;
+      double *im0 = im + ii0;
+      double *re1 = re0 + half;
+      double *im1 = im0 + half;
+      for (int kk = 0; kk < half; kk++) {
+        double tRe = re1[kk] * wRe[kk] - im1[kk] * wIm[kk];
+        double tIm = re1[kk] * wIm[kk] + im1[kk] * wRe[kk];
+        re1[kk] = re0[kk] - tRe;
+        im1[kk] = im0[kk] - tIm;
+        re0[kk] += tRe;
+        im0[kk] += tIm;
+      }
+    }
+  }
+
+  if (inverse) {
+    double scale = 1.0 / nn;
+    for (int ii = 0; ii < nn; ii++) {
+      re[ii] *= scale;
+      im[ii] *= scale;
+    }
+  }
+
+}
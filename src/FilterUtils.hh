@@ -99,9 +99,98 @@ public:
 				 int nGatesKernel,
 				 double missingVal);
   
+  /**
+   * Compute standard deviation of a scan field, over a kernel box
+   * in azimuth and range. The field is stored ray by ray, i.e.
+   * field[iray * nGates + igate]. The sums are taken from summed-area
+   * tables of the value, the squared value and the valid count, so the
+   * cost per gate is independent of the kernel size.
+   * Kernel limits are clipped at the start and end of the rays, in the
+   * same way as computeSdevInRange(). In azimuth the kernel wraps
+   * around from the last ray to the first if wrapAzimuth is true,
+   * otherwise it is clipped.
+   * The sdev will be set to missingVal if not enough data is
+   * available for computing the standard deviation.
+   * @param[in] field The scan data to compute a standard deviation for
+   * @param[out] sdev The computed sdev, same layout as field
+   * @param[in] nRays Number of rays in the scan
+   * @param[in] nGates Number of gates per ray
+   * @param[in] nRaysKernel Number of rays over which to compute sdev
+   * @param[in] nGatesKernel Number of gates over which to compute sdev
+   * @param[in] wrapAzimuth True if the scan covers the full circle
+   * @param[in] missingVal The value to use for missing data
+   */
+  static void computeSdevInBox(const double *field,
+                               double *sdev,
+                               int nRays,
+                               int nGates,
+                               int nRaysKernel,
+                               int nGatesKernel,
+                               bool wrapAzimuth,
+                               double missingVal);
+  
+  /**
+   * Apply an FIR filter to an array, using a direct convolution.
+   * With SSE2, eight outputs at a time are accumulated in registers,
+   * two per vector. For each output gate the sum is accumulated over
+   * the coefficients in order, so the results are the same as for the
+   * simple nested loop.
+   * out[ii] = sum over jj of coeff[jj] * in[ii + jj], for ii in [0, nOut)
+   * @param[in] in The input data, nOut + nCoeff - 1 values
+   * @param[out] out The filtered data, nOut values
+   * @param[in] nOut Number of output values
+   * @param[in] coeff The filter coefficients
+   * @param[in] nCoeff Number of filter coefficients
+   */
+  static void applyFirFilter(const double *in,
+                             double *out,
+                             int nOut,
+                             const double *coeff,
+                             int nCoeff);
+
+  /**
+   * Apply an FIR filter to an array, using FFT convolution.
+   * Same definition as applyFirFilter(), but cheaper for long filters.
+   * Results agree with the direct convolution to rounding precision.
+   * @param[in] in The input data, nOut + nCoeff - 1 values
+   * @param[out] out The filtered data, nOut values
+   * @param[in] nOut Number of output values
+   * @param[in] coeff The filter coefficients
+   * @param[in] nCoeff Number of filter coefficients
+   */
+  static void applyFirFilterFft(const double *in,
+                                double *out,
+                                int nOut,
+                                const double *coeff,
+                                int nCoeff);
+
+  /**
+   * Convolve two sets of filter coefficients, to give the coefficients
+   * of the filter equivalent to applying both filters in turn.
+   * @param[in] aa The first set of coefficients
+   * @param[in] nA Number of coefficients in aa
+   * @param[in] bb The second set of coefficients
+   * @param[in] nB Number of coefficients in bb
+   * @param[out] ab The combined coefficients, nA + nB - 1 values
+   */
+  static void convolveCoeffs(const double *aa, int nA,
+                             const double *bb, int nB,
+                             double *ab);
+
 protected:
 private:
 
+  /**
+   * In-place radix-2 complex FFT
+   * @param[in][out] re Real part of the data
+   * @param[in][out] im Imaginary part of the data
+   * @param[in] nn Number of points, must be a power of 2
+   * @param[in] inverse True for the inverse transform, which is
+   *   scaled by 1/nn
+   */
+  static void _fft(double *re, double *im, int nn, bool inverse);
+
+
   /**
    * Comparison function needed for double qsort
    * @param[in] i Pointer to the first value to compare
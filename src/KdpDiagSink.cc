@@ -0,0 +1,428 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// KdpDiagSink.cc
+//
+// Binary diagnostics file for KdpFilt.
+//
+/////////////////////////////////////////////////////////////
+
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "KdpDiagSink.hh"
+#include "KdpFilt.hh"
+
+#define DIAG_MAGIC "KDPDIAG1"
+#define DIAG_NAME_LEN 16
+#define DIAG_HEADER_BYTES (4 * sizeof(int) + 6 * sizeof(double))
+
+// names of the fields, in the order they are packed by _packRay()
+
+static const char *diagFieldNames[KdpDiagSink::N_FIELDS] = {
+  "snr", "dbz", "zdr", "rhohv", "phidp",
+  "phidpMean", "phidpMeanValid", "phidpJitter", "phidpSdev",
+  "phidpMeanUnfold", "phidpUnfold", "phidpFilt",
+  "phidpCond", "phidpCondFilt", "zdrSdev",
+  "psob", "kdp", "dbzAttenCorr", "zdrAttenCorr"
+};
+
+////////////////////////////////////////////////////
+// Constructor
+
+KdpDiagSink::KdpDiagSink()
+
+{
+  _out = NULL;
+  _minElevDeg = -90.0;
+  _maxElevDeg = 90.0;
+  _minAzDeg = 0.0;
+  _maxAzDeg = 360.0;
+  _maxQueueBytes = 64 * 1024 * 1024;
+  _queueBytes = 0;
+  _nRaysWritten = 0;
+  _nRaysDropped = 0;
+#ifdef PTHREAD_SUPPORTED
+  pthread_mutex_init(&_mutex, NULL);
+  pthread_cond_init(&_cond, NULL);
+  _threadRunning = false;
+  _stopping = false;
+#endif
+}
+
+////////////////////////////////////////////////////
+// Destructor
+
+KdpDiagSink::~KdpDiagSink()
+
+{
+  close();
+  for (size_t ii = 0; ii < _spare.size(); ii++) {
+    delete _spare[ii];
+  }
+#ifdef PTHREAD_SUPPORTED
+  pthread_cond_destroy(&_cond);
+  pthread_mutex_destroy(&_mutex);
+#endif
+}
+
+/////////////////////////////////////
+// open the file and start the writer
+
+int KdpDiagSink::open(const string &path)
+
+{
+
+  close();
+
+  _out = fopen(path.c_str(), "wb");
+  if (_out == NULL) {
+    int errNum = errno;
+    cerr << "ERROR - KdpDiagSink::open()" << endl;
+    cerr << "  Cannot open file: " << path << endl;
+    cerr << "  " << strerror(errNum) << endl;
+    return -1;
+  }
+  _path = path;
+  _nRaysWritten = 0;
+  _nRaysDropped = 0;
+
+  // file header
+
+  int nFields = N_FIELDS;
+  fwrite(DIAG_MAGIC, 1, 8, _out);
+  fwrite(&nFields, sizeof(int), 1, _out);
+  for (int ii = 0; ii < N_FIELDS; ii++) {
+    char name[DIAG_NAME_LEN];
+    memset(name, 0, DIAG_NAME_LEN);
+    strncpy(name, diagFieldNames[ii], DIAG_NAME_LEN - 1);
+    fwrite(name, 1, DIAG_NAME_LEN, _out);
+  }
+
+#ifdef PTHREAD_SUPPORTED
+  _stopping = false;
+  if (pthread_create(&_thread, NULL, _writerMain, this) == 0) {
+    _threadRunning = true;
+  } else {
+    // rays are written by the computing threads instead
+    _threadRunning = false;
+  }
+#endif
+
+  return 0;
+
+}
+
+/////////////////////////////////////
+// write out the queue and close the file
+
+void KdpDiagSink::close()
+
+{
+
+  if (_out == NULL) {
+    return;
+  }
+
+#ifdef PTHREAD_SUPPORTED
+  if (_threadRunning) {
+    pthread_mutex_lock(&_mutex);
+    _stopping = true;
+    pthread_cond_signal(&_cond);
+    pthread_mutex_unlock(&_mutex);
+    pthread_join(_thread, NULL);
+    _threadRunning = false;
+  }
+#endif
+
+  if (_nRaysDropped > 0) {
+    cerr << "WARNING - KdpDiagSink::close()" << endl;
+    cerr << "  " << _nRaysDropped << " rays dropped from: " << _path << endl;
+  }
+
+  fclose(_out);
+  _out = NULL;
+
+}
+
+/////////////////////////////////////
+// set the ray selection
+
+void KdpDiagSink::setElevationLimits(double minElevDeg, double maxElevDeg)
+
+{
+  _minElevDeg = minElevDeg;
+  _maxElevDeg = maxElevDeg;
+}
+
+void KdpDiagSink::setAzimuthLimits(double minAzDeg, double maxAzDeg)
+
+{
+  _minAzDeg = minAzDeg;
+  _maxAzDeg = maxAzDeg;
+}
+
+/////////////////////////////////////
+// is the ray to be written?
+
+bool KdpDiagSink::wantRay(double elevDeg, double azDeg) const
+
+{
+  if (_out == NULL) {
+    return false;
+  }
+  if (elevDeg < _minElevDeg || elevDeg > _maxElevDeg) {
+    return false;
+  }
+  if (_minAzDeg <= _maxAzDeg) {
+    return (azDeg >= _minAzDeg && azDeg <= _maxAzDeg);
+  }
+  // sector across north
+  return (azDeg >= _minAzDeg || azDeg <= _maxAzDeg);
+}
+
+/////////////////////////////////////
+// queue a ray for writing
+
+void KdpDiagSink::putRay(const KdpFilt &filt)
+
+{
+
+#ifdef PTHREAD_SUPPORTED
+
+  if (_threadRunning) {
+
+    // pack outside the lock, so threads only wait for the queue
+
+    pthread_mutex_lock(&_mutex);
+    vector<char> *rec = _getBuffer();
+    pthread_mutex_unlock(&_mutex);
+
+    _packRay(filt, *rec);
+
+    pthread_mutex_lock(&_mutex);
+    if (_queueBytes + rec->size() > _maxQueueBytes) {
+      _nRaysDropped++;
+      _spare.push_back(rec);
+    } else {
+      _queueBytes += rec->size();
+      _queue.push_back(rec);
+      pthread_cond_signal(&_cond);
+    }
+    pthread_mutex_unlock(&_mutex);
+    return;
+
+  }
+
+  // no writer thread, write in the calling thread
+
+  pthread_mutex_lock(&_mutex);
+  vector<char> *rec = _getBuffer();
+  _packRay(filt, *rec);
+  _countRecord(_writeRecord(*rec));
+  _spare.push_back(rec);
+  pthread_mutex_unlock(&_mutex);
+
+#else
+
+  vector<char> *rec = _getBuffer();
+  _packRay(filt, *rec);
+  _countRecord(_writeRecord(*rec));
+  _spare.push_back(rec);
+
+#endif
+
+}
+
+#ifdef PTHREAD_SUPPORTED
+
+/////////////////////////////////////
+// writer thread
+
+void *KdpDiagSink::_writerMain(void *arg)
+
+{
+  KdpDiagSink *sink = (KdpDiagSink *) arg;
+  sink->_writeQueue();
+  return NULL;
+}
+
+/////////////////////////////////////
+// write records as they are queued,
+// until stopped and the queue is empty
+
+void KdpDiagSink::_writeQueue()
+
+{
+
+  pthread_mutex_lock(&_mutex);
+
+  while (true) {
+
+    if (_queue.empty()) {
+      if (_stopping) {
+        break;
+      }
+      // flush while idle, so the file is readable between scans
+      pthread_mutex_unlock(&_mutex);
+      fflush(_out);
+      pthread_mutex_lock(&_mutex);
+      while (_queue.empty() && !_stopping) {
+        pthread_cond_wait(&_cond, &_mutex);
+      }
+      continue;
+    }
+
+    vector<char> *rec = _queue.front();
+    _queue.pop_front();
+
+    // write without holding the lock
+
+    pthread_mutex_unlock(&_mutex);
+    bool written = _writeRecord(*rec);
+    pthread_mutex_lock(&_mutex);
+
+    _countRecord(written);
+    _queueBytes -= rec->size();
+    _spare.push_back(rec);
+
+  }
+
+  pthread_mutex_unlock(&_mutex);
+
+}
+
+#endif
+
+/////////////////////////////////////
+// get an empty buffer
+
+vector<char> *KdpDiagSink::_getBuffer()
+
+{
+  if (_spare.empty()) {
+    return new vector<char>;
+  }
+  vector<char> *rec = _spare.back();
+  _spare.pop_back();
+  return rec;
+}
+
+/////////////////////////////////////
+// pack the current ray of filt into a record
+
+void KdpDiagSink::_packRay(const KdpFilt &filt, vector<char> &rec)
+
+{
+
+  int nGates = filt._nGates;
+  size_t nBytes = DIAG_HEADER_BYTES +
+    N_FIELDS * nGates * sizeof(float) + nGates;
+  nBytes = (nBytes + 7) & ~((size_t) 7);
+  rec.resize(nBytes);
+  char *buf = &rec[0];
+
+  // everything but the padding is set below, and buffers are
+  // re-used, so only the padding needs clearing
+
+  size_t nUsed = DIAG_HEADER_BYTES + N_FIELDS * nGates * sizeof(float) + nGates;
+  memset(buf + nUsed, 0, nBytes - nUsed);
+
+  // ray header
+
+  int ints[4];
+  ints[0] = (int) nBytes;
+  ints[1] = nGates;
+  ints[2] = filt._nFiltIterCondUsed;
+  ints[3] = 0;
+  double dbls[6];
+  dbls[0] = (double) filt._timeSecs + filt._timeFractionSecs;
+  dbls[1] = filt._elevDeg;
+  dbls[2] = filt._azDeg;
+  dbls[3] = filt._startRangeKm;
+  dbls[4] = filt._gateSpacingKm;
+  dbls[5] = filt._missingValue;
+  memcpy(buf, ints, sizeof(ints));
+  memcpy(buf + sizeof(ints), dbls, sizeof(dbls));
+
+  // fields, in the order of diagFieldNames
+
+  const double *fields[N_FIELDS] = {
+    filt._snr, filt._dbz, filt._zdr, filt._rhohv, filt._phidp,
+    filt._phidpMean, filt._phidpMeanValid, filt._phidpJitter,
+    filt._phidpSdev, filt._phidpMeanUnfold, filt._phidpUnfold,
+    filt._phidpFilt, filt._phidpCond, filt._phidpCondFilt,
+    filt._zdrSdev, filt._psob, filt._kdp,
+    filt._dbzAttenCorr, filt._zdrAttenCorr
+  };
+
+  float *data = (float *) (buf + DIAG_HEADER_BYTES);
+  for (int ifield = 0; ifield < N_FIELDS; ifield++) {
+    const double *vals = fields[ifield];
+    float *out = data + (size_t) ifield * nGates;
+    int igate = 0;
+#ifdef __SSE2__
+    // four gates at a time; the record is only byte aligned
+    for (; igate + 4 <= nGates; igate += 4) {
+      __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(vals + igate));
+      __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(vals + igate + 2));
+      _mm_storeu_ps(out + igate, _mm_movelh_ps(lo, hi));
+    }
+#endif
+    for (; igate < nGates; igate++) {
+      out[igate] = (float) vals[igate];
+    }
+  }
+
+  // validity flags
+
+  unsigned char *flags = (unsigned char *) (data + (size_t) N_FIELDS * nGates);
+  for (int igate = 0; igate < nGates; igate++) {
+    flags[igate] = (unsigned char)
+      ((filt._validForKdp[igate] ? 1 : 0) |
+       (filt._validForUnfold[igate] ? 2 : 0));
+  }
+
+}
+
+/////////////////////////////////////
+// write a record, returns true on success
+
+bool KdpDiagSink::_writeRecord(const vector<char> &rec)
+
+{
+  return (fwrite(&rec[0], 1, rec.size(), _out) == rec.size());
+}
+
+/////////////////////////////////////
+// count a record as written or dropped
+
+void KdpDiagSink::_countRecord(bool written)
+
+{
+  if (written) {
+    _nRaysWritten++;
+  } else {
+    _nRaysDropped++;
+  }
+}
@@ -0,0 +1,208 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// KdpDiagSink.hh
+//
+// Binary diagnostics file for KdpFilt.
+//
+// For selected rays, the intermediate arrays of KdpFilt are
+// packed into a record by the computing thread and appended to
+// the file by a writer thread, so that the computing threads
+// never wait on the disk. If the writer falls behind by more
+// than the queue limit, rays are dropped and counted.
+//
+// File layout, in native byte order:
+//
+//   char    magic[8]             "KDPDIAG1"
+//   int32   nFields
+//   char    names[nFields][16]   null-padded field names
+//
+// followed by one record per ray:
+//
+//   int32   recordBytes          size of the record, this word included
+//   int32   nGates               gates processed, up to the max range
+//   int32   nFiltIterCondUsed
+//   int32   spare
+//   float64 timeSecs, elevDeg, azDeg, startRangeKm, gateSpacingKm,
+//           missingValue
+//   float32 data[nFields][nGates]
+//   uint8   flags[nGates]        bit 0 validForKdp, bit 1 validForUnfold
+//   padding to a multiple of 8 bytes
+//
+// Lib/kdp_diag.py reads these files.
+//
+/////////////////////////////////////////////////////////////
+
+/**
+ * @file KdpDiagSink.hh
+ * @class KdpDiagSink
+ * @brief Writes KdpFilt diagnostics for selected rays to a binary file
+ */
+
+#ifndef KdpDiagSink_hh
+#define KdpDiagSink_hh
+
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <deque>
+#ifdef PTHREAD_SUPPORTED
+#include <pthread.h>
+#endif
+
+using namespace std;
+
+class KdpFilt;
+
+////////////////////////
+// This class
+
+class KdpDiagSink {
+
+public:
+
+  /**
+   * Number of float32 fields written per gate
+   */
+  static const int N_FIELDS = 19;
+
+  /**
+   * Constructor
+   */
+  KdpDiagSink();
+
+  /**
+   * Destructor - closes the file, writing out any queued rays
+   */
+  ~KdpDiagSink();
+
+  /**
+   * Open a file for the diagnostics, replacing any existing file,
+   * and start the writer thread. Closes any file already open.
+   * @param[in] path The file path
+   * @return 0 on success, -1 on failure
+   */
+  int open(const string &path);
+
+  /**
+   * Write out any queued rays and close the file
+   */
+  void close();
+
+  /**
+   * Is a file open?
+   * @return true if open
+   */
+  bool isOpen() const { return _out != NULL; }
+
+  /**
+   * Select the rays by elevation, in degrees, inclusive.
+   * Default is all elevations.
+   */
+  void setElevationLimits(double minElevDeg, double maxElevDeg);
+
+  /**
+   * Select the rays by azimuth, in degrees, inclusive. If minAzDeg
+   * is greater than maxAzDeg the sector includes north.
+   * Default is all azimuths.
+   */
+  void setAzimuthLimits(double minAzDeg, double maxAzDeg);
+
+  /**
+   * Set the most bytes which may be queued for the writer thread,
+   * beyond which rays are dropped. Default is 64 MB.
+   */
+  void setMaxQueueBytes(size_t nBytes) { _maxQueueBytes = nBytes; }
+
+  /**
+   * Is a file open, and is a ray within the selected limits?
+   * @param[in] elevDeg The beam elevation
+   * @param[in] azDeg The beam azimuth
+   * @return true if the ray is to be written
+   */
+  bool wantRay(double elevDeg, double azDeg) const;
+
+  /**
+   * Queue the current ray of a KdpFilt object for writing.
+   * Called by KdpFilt at the end of compute(). Safe to call
+   * from several threads.
+   * @param[in] filt The object which has just computed the ray
+   */
+  void putRay(const KdpFilt &filt);
+
+  /**
+   * Get the numbers of rays written and dropped since open()
+   */
+  long getNRaysWritten() const { return _nRaysWritten; }
+  long getNRaysDropped() const { return _nRaysDropped; }
+
+protected:
+
+private:
+
+  FILE *_out;
+  string _path;
+
+  double _minElevDeg, _maxElevDeg;
+  double _minAzDeg, _maxAzDeg;
+
+  size_t _maxQueueBytes;
+  size_t _queueBytes;
+  long _nRaysWritten;
+  long _nRaysDropped;
+
+  // records waiting to be written, and spare buffers for re-use
+
+  deque<vector<char> *> _queue;
+  vector<vector<char> *> _spare;
+
+#ifdef PTHREAD_SUPPORTED
+  pthread_mutex_t _mutex;
+  pthread_cond_t _cond;
+  pthread_t _thread;
+  bool _threadRunning;
+  bool _stopping;
+
+  /// the writer thread
+
+  static void *_writerMain(void *arg);
+  void _writeQueue();
+#endif
+
+  /// get an empty buffer, from the spares if possible
+
+  vector<char> *_getBuffer();
+
+  /// pack the current ray of filt into a record
+
+  static void _packRay(const KdpFilt &filt, vector<char> &rec);
+
+  /// write a record to the file, and count it
+
+  bool _writeRecord(const vector<char> &rec);
+  void _countRecord(bool written);
+
+  // copy constructor and assignment are private, a sink owns its file
+
+  KdpDiagSink(const KdpDiagSink &);
+  KdpDiagSink &operator=(const KdpDiagSink &);
+
+};
+
+#endif
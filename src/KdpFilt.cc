@@ -38,20 +38,34 @@
 #include <cerrno>
 #include <cmath>
 #include <cstring>
-#if 0
-#include <toolsa/os_config.h>
-#include <toolsa/toolsa_macros.h>
-#include <toolsa/file_io.h>
-#include <toolsa/sincos.h>
-#include <toolsa/DateTime.hh>
-#endif
 #include "KdpFilt.hh"
+#include "KdpDiagSink.hh"
 #include "FilterUtils.hh"
 //#include "../ncar_pid/DpolFilter.hh"
 
 #define RAD_TO_DEG (180.0/M_PI)
 #define DEG_TO_RAD (M_PI/180.0)
 
+// kdp is clipped at this value for attenuation correction,
+// and coeff * kdp^expon is tabulated at this resolution up to it
+
+#define ATTEN_KDP_MAX 20.0
+#define ATTEN_TABLE_RES 0.01
+
+/***********************************************
+ * get an array with room for at least nelem values.
+ * Arrays only grow, so that they are allocated once
+ * for the longest ray and re-used after that.
+ */
+template <class T>
+static T *reserveArray(TaArray<T> &arr, int nelem)
+{
+  if (arr.size() < nelem) {
+    arr.alloc(nelem);
+  }
+  return arr.buf();
+}
+
 /***********************************************
  * compute sin and cos together for efficiency
  */
@@ -192,6 +206,7 @@ KdpFilt::KdpFilt()
   _nFiltIterUnfolded = 2;
   _nFiltIterCond = 4;
 
+  _nGatesRay = 0;
   _nGates = 0;
   setNGatesStats(9);
 
@@ -220,11 +235,30 @@ KdpFilt::KdpFilt()
 
   _phidpJitterMax = 30.0;
   _phidpSdevMax = 20.0;
+  _computePhidpCircSdev = false;
 
   _minValidAbsKdp = 0.05;
 
   _useIterativeFiltering = false;
   _phidpDiffThreshold = 4.0;
+  _iterCondConvergence = false;
+  _iterCondTolerance = 0.0;
+  _nFiltIterCondUsed = 0;
+
+  _useCompositeFilter = false;
+  for (int ii = 0; ii < 2; ii++) {
+    _compositeFirLength[ii] = 0;
+    _compositeNIter[ii] = 0;
+  }
+
+  _phidpQuantGain = 1.0;
+  _phidpQuantOffset = 0.0;
+  _phidpQuantNLevels = 0;
+  _sinCosTableReady = false;
+  _sinCosTableFoldsAt90 = false;
+  _sinCosTablePhidp = NULL;
+  _sinTable = NULL;
+  _cosTable = NULL;
 
   // initialize attenuation correction for Sband
 
@@ -234,11 +268,18 @@ KdpFilt::KdpFilt()
   _zdrAttenExpon = 1.05;
   _doComputeAttenCorr = false;
   _attenCoeffsSpecified = false;
+  _attenTableReady = false;
+  _attenTableLen = 0;
+  for (int ii = 0; ii < 4; ii++) {
+    _attenTableCoeffs[ii] = 0.0;
+  }
+  _dbzAttenTable = NULL;
+  _zdrAttenTable = NULL;
   
   // debugging
 
   _debug = false;
-  _writeRayFile = false;
+  _diagSink = NULL;
 
 }
 
@@ -289,16 +330,30 @@ void KdpFilt::setFIRFilterLen(fir_filter_len_t len)
 }
 
 //////////////////////////////////////////
-// set to write ray data to specified dir
+// copy the options for filtering the unfolded phidp
+
+void KdpFilt::copyFilterParams(const KdpFilt &other)
 
-void KdpFilt::setWriteRayFile(bool state /* = true */,
-                              string dir /* = "" */)
-  
 {
-  _writeRayFile = state;
-  _rayFileDir = dir;
+
+  if (&other == this) {
+    return;
+  }
+
+  _firLength = other._firLength;
+  _firLenHalf = other._firLenHalf;
+  _firCoeff = other._firCoeff;
+  _nFiltIterUnfolded = other._nFiltIterUnfolded;
+  _nFiltIterCond = other._nFiltIterCond;
+  _useIterativeFiltering = other._useIterativeFiltering;
+  _phidpDiffThreshold = other._phidpDiffThreshold;
+  _iterCondConvergence = other._iterCondConvergence;
+  _iterCondTolerance = other._iterCondTolerance;
+  _useCompositeFilter = other._useCompositeFilter;
+  _minValidAbsKdp = other._minValidAbsKdp;
+
 }
-  
+
 //////////////////////////////////////////
 // Set flag to indicate we should compute corrections.
 // Uses default coefficients.
@@ -306,7 +361,25 @@ void KdpFilt::setWriteRayFile(bool state /* = true */,
 void KdpFilt::setComputeAttenCorr(bool val)
 
 {
-  _doComputeAttenCorr = true;
+  _doComputeAttenCorr = val;
+}
+
+//////////////////////////////////////////
+// set the quantisation of the input phidp
+
+void KdpFilt::setPhidpQuantisation(double gain, double offset, int nLevels)
+
+{
+  if (gain == 0.0 || nLevels < 0) {
+    nLevels = 0;
+  }
+  if (gain != _phidpQuantGain || offset != _phidpQuantOffset ||
+      nLevels != _phidpQuantNLevels) {
+    _sinCosTableReady = false;
+  }
+  _phidpQuantGain = gain;
+  _phidpQuantOffset = offset;
+  _phidpQuantNLevels = nLevels;
 }
   
 //////////////////////////////////////////
@@ -336,8 +409,9 @@ void KdpFilt::setAttenCoeffs(double dbzCoeff, double dbzExpon,
 void KdpFilt::initializeArrays(int nGates)
 
 {
+  _nGatesRay = nGates;
   _nGates = nGates;
-  _initArrays(NULL, NULL, NULL, NULL, NULL, _nGates);
+  _initArrays(NULL, NULL, NULL, NULL, NULL);
 }
 
 /////////////////////////////////////
@@ -360,6 +434,54 @@ int KdpFilt::compute(time_t timeSecs,
   
 {
 
+  // set ray details and initialize the data arrays
+
+  _initRay(timeSecs, timeFractionSecs, elevDeg, azDeg, wavelengthCm,
+           nGates, startRangeKm, gateSpacingKm,
+           snr, dbz, zdr, rhohv, phidp, missingValue);
+  
+  // unfold phidp
+  
+  if (_unfoldPhidp()) {
+    _setNoValidData();
+    return 0;
+  }
+
+  // compute filtered phidp,
+  // and kdp from the filtered data
+
+  _computeKdp();
+
+  // psob, thresholds and attenuation correction
+
+  _finishRay();
+
+  return 0;
+
+}
+
+/////////////////////////////////////
+// set ray details and initialize the data arrays,
+// ready for computing KDP
+
+void KdpFilt::_initRay(time_t timeSecs,
+                       double timeFractionSecs,
+                       double elevDeg,
+                       double azDeg,
+                       double wavelengthCm,
+                       int nGates,
+                       double startRangeKm,
+                       double gateSpacingKm,
+                       const double *snr,
+                       const double *dbz,
+                       const double *zdr,
+                       const double *rhohv,
+                       const double *phidp,
+                       double missingValue)
+  
+{
+
+
   // set time
 
   _timeSecs = timeSecs;
@@ -416,40 +538,62 @@ int KdpFilt::compute(time_t timeSecs,
   _startRangeKm = startRangeKm;
   _gateSpacingKm = gateSpacingKm;
 
-  // set number of gates
-
-  _nGates = nGates;
-
-  // compute max number of valid gates
+  // set number of gates, and the number to process,
+  // up to the max range
 
-  int nGatesMaxValid = _nGates;
-  if (_limitMaxRange) {
-    int nGatesMaxValid =
-      (int) ((_maxRangeKm - _startRangeKm) / _gateSpacingKm + 0.5);
-    if (nGatesMaxValid > _nGates) {
-      nGatesMaxValid = _nGates;
-    }
-  }
+  _nGatesRay = nGates;
+  _nGates = _computeNGatesInRange();
 
   // initialize the data arrays
   
   _missingValue = missingValue;
-  _initArrays(snr, dbz, zdr, rhohv, phidp, nGatesMaxValid);
+  _initArrays(snr, dbz, zdr, rhohv, phidp);
+
+}
+
+/////////////////////////////////////
+// no good data in whole ray, fill with missing
+// there is no attenuation to correct for
+
+void KdpFilt::_setNoValidData()
   
-  // unfold phidp
+{
+  _nFiltIterCondUsed = 0;
+  for (int igate = 0; igate < _nGatesRay; igate++) {
+    _kdp[igate] = _missingValue;
+    _dbzAttenCorr[igate] = 0.0;
+    _zdrAttenCorr[igate] = 0.0;
+  }
+}
+
+/////////////////////////////////////
+// compute the number of gates to process,
+// up to the max range if that is limited
+
+int KdpFilt::_computeNGatesInRange() const
   
-  if (_unfoldPhidp()) {
-    // no good data in whole ray, fill with missing, return early
-    for (int igate = 0; igate < _nGates; igate++) {
-      _kdp[igate] = _missingValue;
-    }
-    return 0;
+{
+  if (!_limitMaxRange || _gateSpacingKm <= 0.0) {
+    return _nGatesRay;
   }
+  int nGatesInRange =
+    (int) ((_maxRangeKm - _startRangeKm) / _gateSpacingKm + 0.5);
+  if (nGatesInRange > _nGatesRay) {
+    nGatesInRange = _nGatesRay;
+  }
+  if (nGatesInRange < 0) {
+    nGatesInRange = 0;
+  }
+  return nGatesInRange;
+}
 
-  // compute filtered phidp,
-  // and kdp from the filtered data
+/////////////////////////////////////
+// finish the ray after the filtering:
+// psob, thresholds on kdp and attenuation correction
 
-  _computeKdp();
+void KdpFilt::_finishRay()
+  
+{
 
   // compute phase shift on backscatter as the difference between
   // measured and filtered phidp
@@ -463,12 +607,6 @@ int KdpFilt::compute(time_t timeSecs,
     }
   }
   
-  // write ray file if requested
-
-  if (_writeRayFile) {
-    _writeRayDataToFile();
-  }
-    
   // set KDP and PSOB to 0
   // for small values of KDP, and non-good gates
   
@@ -487,7 +625,28 @@ int KdpFilt::compute(time_t timeSecs,
     _computeAttenCorrection();
   }
 
-  return 0;
+  // beyond max range, KDP is 0 as for other non-good gates,
+  // and the attenuation stays at its value at max range
+
+  if (_nGates < _nGatesRay) {
+    for (int ii = _nGates; ii < _nGatesRay; ii++) {
+      _kdp[ii] = 0.0;
+    }
+    if (_doComputeAttenCorr && _nGates > 0) {
+      double dbzCorr = _dbzAttenCorr[_nGates - 1];
+      double zdrCorr = _zdrAttenCorr[_nGates - 1];
+      for (int ii = _nGates; ii < _nGatesRay; ii++) {
+        _dbzAttenCorr[ii] = dbzCorr;
+        _zdrAttenCorr[ii] = zdrCorr;
+      }
+    }
+  }
+
+  // diagnostics for selected rays
+
+  if (_diagSink != NULL && _diagSink->wantRay(_elevDeg, _azDeg)) {
+    _diagSink->putRay(*this);
+  }
 
 }
   
@@ -511,25 +670,16 @@ int KdpFilt::computePhidpStats(int nGates,
   _startRangeKm = startRangeKm;
   _gateSpacingKm = gateSpacingKm;
 
-  // set number of gates
+  // set number of gates, and the number to process,
+  // up to the max range
 
-  _nGates = nGates;
-
-  // compute max number of valid gates
-  
-  int nGatesMaxValid = _nGates;
-  if (_limitMaxRange) {
-    int nGatesMaxValid =
-      (int) ((_maxRangeKm - _startRangeKm) / _gateSpacingKm + 0.5);
-    if (nGatesMaxValid > _nGates) {
-      nGatesMaxValid = _nGates;
-    }
-  }
+  _nGatesRay = nGates;
+  _nGates = _computeNGatesInRange();
 
   // initialize the data arrays
   
   _missingValue = missingValue;
-  _initArrays(NULL, NULL, NULL, NULL, phidp, nGatesMaxValid);
+  _initArrays(NULL, NULL, NULL, NULL, phidp);
   
   // check if fold is at 90 or 180
   
@@ -544,14 +694,8 @@ int KdpFilt::computePhidpStats(int nGates,
   // compute mean and standard deviation of phidp
   // and mean angular jitter at each gate
 
-  for (int ii = _nGatesStatsHalf; 
-       ii < _nGates - _nGatesStatsHalf; ii++) {
-    _computePhidpStats(ii);
-    _phidpJitter[ii] = _gateStates[ii].phidpJitter;
-    _phidpMean[ii] = _gateStates[ii].phidpMean;
-    _phidpMeanValid[ii] = _gateStates[ii].phidpMean;
-    _phidpSdev[ii] = _gateStates[ii].phidpSdev;
-  }
+  _computePhidpStats();
+  memcpy(_phidpMeanValid, _phidpMean, _nGates * sizeof(double));
   
   return 0;
 
@@ -564,8 +708,7 @@ void KdpFilt::_initArrays(const double *snr,
                           const double *dbz,
                           const double *zdr,
                           const double *rhohv,
-                          const double *phidp,
-                          int nGatesMaxValid)
+                          const double *phidp)
   
 {
   
@@ -575,34 +718,40 @@ void KdpFilt::_initArrays(const double *snr,
   }
   _arrayLen = _nGates + 2 * _arrayExtra;
 
-  // allocate the arrays needed
+  // allocate the arrays needed, if not already big enough
   // copy input arrays, leaving extra space at the beginning
   // for negative indices and at the end for filtering as required
 
-  _snr = _snr_.alloc(_nGates);
-  _dbz = _dbz_.alloc(_nGates);
-  _dbzMax = _dbzMax_.alloc(_nGates);
-  _zdr = _zdr_.alloc(_nGates);
-  _zdrSdev = _zdrSdev_.alloc(_nGates);
-  _rhohv = _rhohv_.alloc(_nGates);
-  _phidp = _phidp_.alloc(_nGates);
-  _phidpMean = _phidpMean_.alloc(_nGates);
-  _phidpMeanValid = _phidpMeanValid_.alloc(_nGates);
-  _phidpSdev = _phidpSdev_.alloc(_nGates);
-  _phidpJitter = _phidpJitter_.alloc(_nGates);
-  _phidpMeanUnfold = _phidpMeanUnfold_.alloc(_nGates);
-  _phidpUnfold = _phidpUnfold_.alloc(_nGates);
-  _phidpFilt = _phidpFilt_.alloc(_nGates);
-  _phidpCond = _phidpCond_.alloc(_nGates);
-  _phidpCondFilt = _phidpCondFilt_.alloc(_nGates);
-  _phidpAccumFilt = _phidpAccumFilt_.alloc(_nGates);
-  _validForKdp = _validForKdp_.alloc(_nGates);
-  _validForUnfold = _validForUnfold_.alloc(_nGates);
-  _kdp = _kdp_.alloc(_nGates);
-  _psob = _psob_.alloc(_nGates);
-  _dbzAttenCorr = _dbzAttenCorr_.alloc(_nGates);
-  _zdrAttenCorr = _zdrAttenCorr_.alloc(_nGates);
-  _gateStates = _gateStates_.alloc(_nGates);
+  _snr = reserveArray(_snr_, _nGatesRay);
+  _dbz = reserveArray(_dbz_, _nGatesRay);
+  _dbzMax = reserveArray(_dbzMax_, _nGatesRay);
+  _dbzMaxQueue = reserveArray(_dbzMaxQueue_, _nGatesRay);
+  _zdr = reserveArray(_zdr_, _nGatesRay);
+  _zdrSdev = reserveArray(_zdrSdev_, _nGatesRay);
+  _rhohv = reserveArray(_rhohv_, _nGatesRay);
+  _phidp = reserveArray(_phidp_, _nGatesRay);
+  _phidpMean = reserveArray(_phidpMean_, _nGatesRay);
+  _phidpMeanValid = reserveArray(_phidpMeanValid_, _nGatesRay);
+  _phidpSdev = reserveArray(_phidpSdev_, _nGatesRay);
+  _phidpCircSdev = reserveArray(_phidpCircSdev_, _nGatesRay);
+  _phidpJitter = reserveArray(_phidpJitter_, _nGatesRay);
+  _phidpMeanUnfold = reserveArray(_phidpMeanUnfold_, _nGatesRay);
+  _phidpUnfold = reserveArray(_phidpUnfold_, _nGatesRay);
+  _phidpFilt = reserveArray(_phidpFilt_, _nGatesRay);
+  _phidpCond = reserveArray(_phidpCond_, _nGatesRay);
+  _phidpCondFilt = reserveArray(_phidpCondFilt_, _nGatesRay);
+  _phidpAccumFilt = reserveArray(_phidpAccumFilt_, _nGatesRay);
+  _validForKdp = reserveArray(_validForKdp_, _nGatesRay);
+  _validForUnfold = reserveArray(_validForUnfold_, _nGatesRay);
+  _kdp = reserveArray(_kdp_, _nGatesRay);
+  _psob = reserveArray(_psob_, _nGatesRay);
+  _dbzAttenCorr = reserveArray(_dbzAttenCorr_, _nGatesRay);
+  _zdrAttenCorr = reserveArray(_zdrAttenCorr_, _nGatesRay);
+  _stateXx = reserveArray(_stateXx_, _nGatesRay);
+  _stateYy = reserveArray(_stateYy_, _nGatesRay);
+  _stateMeanXx = reserveArray(_stateMeanXx_, _nGatesRay);
+  _stateMeanYy = reserveArray(_stateMeanYy_, _nGatesRay);
+  _stateDistFromPrev = reserveArray(_stateDistFromPrev_, _nGatesRay);
   
   // copy data to working arrays
 
@@ -654,7 +803,7 @@ void KdpFilt::_initArrays(const double *snr,
 
   // beyond max range, set input values to missing
 
-  for (int igate = nGatesMaxValid; igate < _nGates; igate++) {
+  for (int igate = _nGates; igate < _nGatesRay; igate++) {
     _snr[igate] = _missingValue;
     _dbz[igate] = _missingValue;
     _zdr[igate] = _missingValue;
@@ -662,18 +811,15 @@ void KdpFilt::_initArrays(const double *snr,
     _rhohv[igate] = _missingValue;
   }
 
-  // compute max dbz for surrounding gates
-  
-  _computeDbzMax();
-  
-  // initialize computed arrays
+  // initialize computed arrays, for the whole ray
 
-  for (int ii = 0; ii < _nGates; ii++) {
+  for (int ii = 0; ii < _nGatesRay; ii++) {
     _zdrSdev[ii] = _missingValue;
     _phidpMean[ii] = _missingValue;
     _phidpMeanValid[ii] = _missingValue;
     _phidpJitter[ii] = _missingValue;
     _phidpSdev[ii] = _missingValue;
+    _phidpCircSdev[ii] = _missingValue;
     _phidpMeanUnfold[ii] = _missingValue;
     _phidpUnfold[ii] = _missingValue;
     _phidpFilt[ii] = _missingValue;
@@ -684,8 +830,10 @@ void KdpFilt::_initArrays(const double *snr,
     _validForUnfold[ii] = false;
     _kdp[ii] = _missingValue;
     _psob[ii] = _missingValue;
+    _dbzAttenCorr[ii] = 0.0;
+    _zdrAttenCorr[ii] = 0.0;
   }
-  
+
 }
 
 /////////////////////////////////////////////
@@ -707,17 +855,24 @@ int KdpFilt::_unfoldPhidp()
   
   // compute mean and standard deviation of phidp
   // and mean angular jitter at each gate
-  // also compute zdr sdev
+  // also compute zdr sdev and max dbz for surrounding gates
 
-  for (int ii = _nGatesStatsHalf; 
-       ii < _nGates - _nGatesStatsHalf; ii++) {
-    _computePhidpStats(ii);
-    _computeZdrSdev(ii);
-    _phidpJitter[ii] = _gateStates[ii].phidpJitter;
-    _phidpMean[ii] = _gateStates[ii].phidpMean;
-    _phidpMeanValid[ii] = _gateStates[ii].phidpMean;
-    _phidpSdev[ii] = _gateStates[ii].phidpSdev;
-  }
+  _computeRangeStats();
+  memcpy(_phidpMeanValid, _phidpMean, _nGates * sizeof(double));
+
+  // unfold using the runs of valid phidp
+
+  return _unfoldValidRuns();
+
+}
+
+/////////////////////////////////////////////
+// unfold phidp, once the phidp stats are known
+// returns -1 if there are no valid runs
+
+int KdpFilt::_unfoldValidRuns()
+
+{
   
   // load up runs of valid phidp
 
@@ -736,12 +891,14 @@ int KdpFilt::_unfoldPhidp()
     // fill in first half of gap
     for (int jj = startGap; jj < midGap; jj++) {
       _phidpMeanValid[jj] = _phidpMeanValid[startGap-1];
-      _gateStates[jj] = _gateStates[startGap-1];
+      _stateMeanXx[jj] = _stateMeanXx[startGap-1];
+      _stateMeanYy[jj] = _stateMeanYy[startGap-1];
     }
     // fill in last half of gap
     for (int jj = midGap; jj <= endGap; jj++) {
       _phidpMeanValid[jj] = _phidpMeanValid[endGap+1];
-      _gateStates[jj] = _gateStates[endGap+1];
+      _stateMeanXx[jj] = _stateMeanXx[endGap+1];
+      _stateMeanYy[jj] = _stateMeanYy[endGap+1];
     }
   }
 
@@ -750,12 +907,10 @@ int KdpFilt::_unfoldPhidp()
   int sumFold = 0;
   for (int ii = _firstValidGate; ii <= _lastValidGate; ii++) {
     int fold = 0;
-    GateState &statePrev = _gateStates[ii-1];
-    GateState &stateThis = _gateStates[ii];
-    if (statePrev.meanxx < 0 && stateThis.meanxx < 0) {
-      if (statePrev.meanyy < 0 && stateThis.meanyy > 0) {
+    if (_stateMeanXx[ii-1] < 0 && _stateMeanXx[ii] < 0) {
+      if (_stateMeanYy[ii-1] < 0 && _stateMeanYy[ii] > 0) {
         fold = -1;
-      } else if (statePrev.meanyy > 0 && stateThis.meanyy < 0) {
+      } else if (_stateMeanYy[ii-1] > 0 && _stateMeanYy[ii] < 0) {
         fold = 1;
       }
     }
@@ -858,11 +1013,10 @@ void KdpFilt::_computeKdp()
   }
   int arrayLen = _nGates + 2 * arrayOffset;
   
-  // allocate working arrays
+  // get working arrays
   
-  TaArray<double> yyy_, zzz_;
-  double *yyy = yyy_.alloc(arrayLen) + arrayOffset;
-  double *zzz = zzz_.alloc(arrayLen) + arrayOffset;
+  double *yyy = reserveArray(_yyy_, arrayLen) + arrayOffset;
+  double *zzz = reserveArray(_zzz_, arrayLen) + arrayOffset;
 
   // initialize working array zzz
   
@@ -871,10 +1025,15 @@ void KdpFilt::_computeKdp()
   
   // apply FIR filter, computing yyy from zzz, iterate
     
-  for (int iloop = 0; iloop < _nFiltIterUnfolded; iloop++) {
-    _applyFirFilter(zzz, yyy);
+  if (_useCompositeFilter && _nFiltIterUnfolded > 1) {
+    _applyCompositeFilter(zzz, yyy, _nFiltIterUnfolded, 0);
     _copyArray(zzz, yyy);
-  } // iloop
+  } else {
+    for (int iloop = 0; iloop < _nFiltIterUnfolded; iloop++) {
+      _applyFirFilter(zzz, yyy);
+      _copyArray(zzz, yyy);
+    } // iloop
+  }
   
   // save filtered phidp
 
@@ -890,9 +1049,14 @@ void KdpFilt::_computeKdp()
     _copyArray(zzz, _phidpCond);
     _padArray(zzz);
 
+    _nFiltIterCondUsed = 0;
     for (int iloop = 0; iloop < _nFiltIterCond; iloop++) {
       _applyFirFilter(zzz, yyy);
-      _copyArrayCond(zzz, yyy, _phidpCond);
+      double maxChange = _copyArrayCond(zzz, yyy, _phidpCond);
+      _nFiltIterCondUsed++;
+      if (_iterCondConvergence && maxChange <= _iterCondTolerance) {
+        break;
+      }
     } // iloop
     
     _copyArray(_phidpCondFilt, zzz);
@@ -902,29 +1066,42 @@ void KdpFilt::_computeKdp()
     // compute phidp conditioned to remove phase shift on backscatter
     
     _computePhidpConditioned();
+    _nFiltIterCondUsed = _nFiltIterCond;
     
     // apply the FIR filter to the increasing phidp
     
     _copyArray(zzz, _phidpCond);
     _padArray(zzz);
     
-    for (int iloop = 0; iloop < _nFiltIterCond; iloop++) {
-      _applyFirFilter(zzz, yyy);
+    if (_useCompositeFilter && _nFiltIterCond > 1) {
+      _applyCompositeFilter(zzz, yyy, _nFiltIterCond, 1);
       _copyArray(zzz, yyy);
-    } // iloop
+    } else {
+      for (int iloop = 0; iloop < _nFiltIterCond; iloop++) {
+        _applyFirFilter(zzz, yyy);
+        _copyArray(zzz, yyy);
+      } // iloop
+    }
 
     _copyArray(_phidpCondFilt, yyy);
 
   }
   
-  // load up conditioned KDP
+  // load up conditioned KDP and accumulated filtered phidp
 
-  _loadKdp(_phidpCondFilt, _kdp);
+  _loadKdpFromCondFilt();
 
-  // load up accumulated filtered phidp along range
+}
 
-  _loadPhidpAccumFilt(_phidpCondFilt, _phidpAccumFilt);
+/////////////////////////////////////////////
+// Load up conditioned KDP, and accumulated filtered phidp
+// along range, from the filtered conditioned phidp
+
+void KdpFilt::_loadKdpFromCondFilt()
 
+{
+  _loadKdp(_phidpCondFilt, _kdp);
+  _loadPhidpAccumFilt(_phidpCondFilt, _phidpAccumFilt);
 }
 
 /////////////////////////////////////////////
@@ -937,20 +1114,24 @@ void KdpFilt::_copyArray(double *array, const double *vals)
 }
 
 /////////////////////////////////////////////
-// copy array conditionally
+// copy array conditionally,
+// returning the max change in the array values
 
-void KdpFilt::_copyArrayCond(double *array, const double *vals,
-                             const double *original)
+double KdpFilt::_copyArrayCond(double *array, const double *vals,
+                               const double *original)
 
 {
+  double maxChange = 0.0;
   for (int ii = 0; ii < _nGates; ii++) {
     double diff = vals[ii] - array[ii];
-    if (fabs(diff) < _phidpDiffThreshold) {
-      array[ii] = original[ii];
-    } else {
-      array[ii] = vals[ii];
+    double val = (fabs(diff) < _phidpDiffThreshold) ? original[ii] : vals[ii];
+    double change = fabs(val - array[ii]);
+    if (change > maxChange) {
+      maxChange = change;
     }
+    array[ii] = val;
   }
+  return maxChange;
 }
 
 /////////////////////////////////////////////
@@ -1036,6 +1217,10 @@ void KdpFilt::_computeAttenCorrection()
   
 {
 
+  // coeff * kdp^expon, interpolated from the tables
+
+  _initAttenTables();
+
   // accumulate corrections
 
   double sumDbzCorr = 0.0;
@@ -1044,16 +1229,24 @@ void KdpFilt::_computeAttenCorrection()
   for (int ii = 0; ii < _nGates; ii++) {
     
     double kdp = _kdp[ii];
-    if (kdp > 20) {
-      kdp = 20;
+    if (kdp > ATTEN_KDP_MAX) {
+      kdp = ATTEN_KDP_MAX;
     }
     
     double dbzCorr = 0.0;
     double zdrCorr = 0.0;
     
     if (_validForKdp[ii] && kdp != _missingValue && kdp > 0) {
-      dbzCorr = _dbzAttenCoeff * pow(kdp, _dbzAttenExpon);
-      zdrCorr = _zdrAttenCoeff * pow(kdp, _zdrAttenExpon);
+      double pos = kdp / ATTEN_TABLE_RES;
+      int index = (int) pos;
+      if (index >= _attenTableLen - 1) {
+        index = _attenTableLen - 2;
+      }
+      double frac = pos - index;
+      dbzCorr = _dbzAttenTable[index] +
+        frac * (_dbzAttenTable[index + 1] - _dbzAttenTable[index]);
+      zdrCorr = _zdrAttenTable[index] +
+        frac * (_zdrAttenTable[index + 1] - _zdrAttenTable[index]);
     }
 
     sumDbzCorr += (dbzCorr * _gateSpacingKm);
@@ -1066,6 +1259,42 @@ void KdpFilt::_computeAttenCorrection()
 
 }
 
+/////////////////////////////////////////////
+// Tabulate coeff * kdp^expon for the attenuation corrections,
+// over the clipped kdp range. For the band defaults, linear
+// interpolation in the tables is within 3e-5 dB/km of pow().
+// The tables are recomputed if the coefficients change.
+
+void KdpFilt::_initAttenTables()
+
+{
+
+  if (_attenTableReady &&
+      _attenTableCoeffs[0] == _dbzAttenCoeff &&
+      _attenTableCoeffs[1] == _dbzAttenExpon &&
+      _attenTableCoeffs[2] == _zdrAttenCoeff &&
+      _attenTableCoeffs[3] == _zdrAttenExpon) {
+    return;
+  }
+
+  _attenTableLen = (int) (ATTEN_KDP_MAX / ATTEN_TABLE_RES + 0.5) + 1;
+  _dbzAttenTable = _dbzAttenTable_.alloc(_attenTableLen);
+  _zdrAttenTable = _zdrAttenTable_.alloc(_attenTableLen);
+
+  for (int ii = 0; ii < _attenTableLen; ii++) {
+    double kdp = ii * ATTEN_TABLE_RES;
+    _dbzAttenTable[ii] = _dbzAttenCoeff * pow(kdp, _dbzAttenExpon);
+    _zdrAttenTable[ii] = _zdrAttenCoeff * pow(kdp, _zdrAttenExpon);
+  }
+
+  _attenTableReady = true;
+  _attenTableCoeffs[0] = _dbzAttenCoeff;
+  _attenTableCoeffs[1] = _dbzAttenExpon;
+  _attenTableCoeffs[2] = _zdrAttenCoeff;
+  _attenTableCoeffs[3] = _zdrAttenExpon;
+
+}
+
 /////////////////////////////////////////////
 // Apply FIR filter
 
@@ -1073,14 +1302,209 @@ void KdpFilt::_applyFirFilter(const double *in, double *out)
 
 {
 
-  for (int ii = -_firLenHalf; ii < _nGates + _firLenHalf; ii++) {
-    double acc = 0.0;
-    int kk = ii - _firLenHalf;
-    for (int jj = 0; jj < _firLength; jj++, kk++) {
-      acc = acc + _firCoeff[jj] * in[kk];
+  // out[ii] for ii in [-_firLenHalf, _nGates + _firLenHalf)
+
+  FilterUtils::applyFirFilter(in - 2 * _firLenHalf, out - _firLenHalf,
+                              _nGates + 2 * _firLenHalf,
+                              _firCoeff, _firLength);
+
+}
+    
+/////////////////////////////////////////////
+// Apply FIR filter nIter times, over gates [0, _nGates).
+// The input array must be padded.
+// Same as the loop of _applyFirFilter() and _copyArray(),
+// but the input array is left unchanged.
+
+void KdpFilt::_applyFirFilterIter(const double *in, double *out, int nIter)
+
+{
+  _applyFirFilterStrip(in, out, 0, _nGates, nIter);
+}
+    
+/////////////////////////////////////////////
+// Apply FIR filter nIter times, over gates [startGate, endGate).
+// The input array must be padded.
+// Gates outside the strip keep their input values, so within the
+// strip the results are only the same as for the full ray where the
+// effects of those gates do not reach. The strip is therefore
+// shortened by the filter reach at each iteration, at any end which
+// is not an end of the ray, and only the gates which are still
+// valid after the last iteration are copied to out.
+
+void KdpFilt::_applyFirFilterStrip(const double *in, double *out,
+                                   int startGate, int endGate, int nIter)
+
+{
+
+  int nStrip = endGate - startGate;
+  if (nStrip < 1) {
+    return;
+  }
+
+  int reachLeft = _firLenHalf;
+  int reachRight = _firLength - 1 - _firLenHalf;
+  int shrinkStart = (startGate > 0 ? reachLeft : 0);
+  int shrinkEnd = (endGate < _nGates ? reachRight : 0);
+
+  // working arrays, with the input padding on each side
+
+  double *xxx = reserveArray(_stripIn_, nStrip + 2 * _firLength) + _firLength;
+  double *www = reserveArray(_stripOut_, nStrip);
+  memcpy(xxx - _firLength, in + startGate - _firLength,
+         (nStrip + 2 * _firLength) * sizeof(double));
+
+  int i0 = 0;
+  int i1 = nStrip;
+  for (int iloop = 0; iloop < nIter; iloop++) {
+    if (iloop > 0) {
+      i0 += shrinkStart;
+      i1 -= shrinkEnd;
     }
-    out[ii] = acc;
-  } // ii
+    if (i1 <= i0) {
+      return;
+    }
+    FilterUtils::applyFirFilter(xxx + i0 - _firLenHalf, www + i0, i1 - i0,
+                                _firCoeff, _firLength);
+    memcpy(xxx + i0, www + i0, (i1 - i0) * sizeof(double));
+  } // iloop
+
+  memcpy(out + startGate + i0, xxx + i0, (i1 - i0) * sizeof(double));
+
+}
+    
+/////////////////////////////////////////////
+// Apply composite FIR filter, equivalent to nIter iterations
+// of the FIR filter, over gates [0, _nGates).
+// The input array must be padded.
+//
+// The padding is not filtered between iterations, so for gates
+// within (nIter - 1) half filter lengths of the ends of the ray
+// the iterations are done directly.
+// index: 0 for unfolded, 1 for conditioned phidp
+
+void KdpFilt::_applyCompositeFilter(const double *in, double *out,
+                                    int nIter, int index)
+
+{
+
+  // reach of the FIR filter to the left and right of a gate
+
+  int reachLeft = _firLenHalf;
+  int reachRight = _firLength - 1 - _firLenHalf;
+
+  // end zones which must be iterated directly
+
+  int edgeLeft = (nIter - 1) * reachLeft;
+  int edgeRight = (nIter - 1) * reachRight;
+  int nComposite = _nGates - edgeLeft - edgeRight;
+  if (nComposite < 1) {
+    _applyFirFilterIter(in, out, nIter);
+    return;
+  }
+
+  // estimate the cost, in multiply-adds, of the composite filter
+  // compared to plain iteration, and iterate unless the composite
+  // filter is clearly cheaper, allowing for its set-up overhead
+
+  int nCoeff = nIter * (_firLength - 1) + 1;
+  int nExt = _nGates + nCoeff - 1;
+  bool useFft = (nCoeff >= COMPOSITE_FFT_MIN_LEN);
+  double costComposite = 0.0;
+  if (useFft) {
+    int nFft = 1;
+    while (nFft < nComposite + nCoeff - 1) {
+      nFft *= 2;
+    }
+    // measured: the two transforms take as long as about 20 of the
+    // vectorised multiply-adds per nFft * log2(nFft)
+    costComposite = 20.0 * nFft * log2((double) nFft);
+  } else {
+    costComposite = (double) nComposite * nCoeff;
+  }
+  // the end strips shrink by the filter reach at each iteration
+  double nStripGates = edgeLeft + edgeRight + (nIter - 1) * (_firLength - 1);
+  double nStripShrink = (nIter * (nIter - 1) / 2.0) * (_firLength - 1);
+  costComposite += (nIter * nStripGates - nStripShrink) * _firLength;
+  double costIter = (double) nIter * (_nGates + 2 * _firLenHalf) * _firLength;
+  if (costComposite > 0.8 * costIter) {
+    _applyFirFilterIter(in, out, nIter);
+    return;
+  }
+
+  const vector<double> &coeff = _getCompositeCoeff(nIter, index);
+
+  // extend the input with the padding values, far enough for the
+  // composite filter at the ends of the composite zone
+
+  int extLeft = nIter * reachLeft;
+  double *ext = reserveArray(_compositeExt_, nExt);
+  double padStart = in[-1];
+  double padEnd = in[_nGates];
+  for (int ii = 0; ii < nExt; ii++) {
+    int jj = ii - extLeft;
+    if (jj < 0) {
+      ext[ii] = padStart;
+    } else if (jj >= _nGates) {
+      ext[ii] = padEnd;
+    } else {
+      ext[ii] = in[jj];
+    }
+  }
+
+  // composite filter in the interior
+
+  if (useFft) {
+    FilterUtils::applyFirFilterFft(ext + edgeLeft, out + edgeLeft,
+                                   nComposite, &coeff[0], nCoeff);
+  } else {
+    FilterUtils::applyFirFilter(ext + edgeLeft, out + edgeLeft,
+                                nComposite, &coeff[0], nCoeff);
+  }
+
+  // direct iteration at the ends, over strips long enough that
+  // the unfiltered gates beyond the strips do not reach the end zones
+
+  int endLeft = edgeLeft + (nIter - 1) * reachRight;
+  if (endLeft > _nGates) {
+    endLeft = _nGates;
+  }
+  _applyFirFilterStrip(in, out, 0, endLeft, nIter);
+
+  int startRight = _nGates - edgeRight - (nIter - 1) * reachLeft;
+  if (startRight < 0) {
+    startRight = 0;
+  }
+  _applyFirFilterStrip(in, out, startRight, _nGates, nIter);
+
+}
+    
+/////////////////////////////////////////////
+// Get composite FIR filter coefficients for nIter iterations
+// Computed when the FIR filter or iteration count changes.
+// index: 0 for unfolded, 1 for conditioned phidp
+
+const vector<double> &KdpFilt::_getCompositeCoeff(int nIter, int index)
+
+{
+
+  vector<double> &coeff = _compositeCoeff[index];
+  if (_compositeFirLength[index] == _firLength &&
+      _compositeNIter[index] == nIter) {
+    return coeff;
+  }
+
+  coeff.assign(_firCoeff, _firCoeff + _firLength);
+  for (int iter = 1; iter < nIter; iter++) {
+    vector<double> prev(coeff);
+    coeff.resize(prev.size() + _firLength - 1);
+    FilterUtils::convolveCoeffs(&prev[0], (int) prev.size(),
+                                _firCoeff, _firLength, &coeff[0]);
+  }
+
+  _compositeFirLength[index] = _firLength;
+  _compositeNIter[index] = nIter;
+  return coeff;
 
 }
     
@@ -1098,25 +1522,52 @@ double KdpFilt::_getFirFilterGain()
 }
     
 /////////////////////////////////////////////
-// Compute DBZ max for surrounding gates
+// Compute DBZ max for surrounding gates.
+// Sliding window max, using a queue of gate indices with
+// decreasing dbz, so the cost does not depend on _nGatesStats.
 
 void KdpFilt::_computeDbzMax()
 
 {
  
+  int head = 0, tail = 0;
+  for (int jj = 0; jj < _nGatesStatsHalf && jj < _nGates; jj++) {
+    _pushDbzMax(jj, head, tail);
+  }
   for (int ii = 0; ii < _nGates; ii++) {
-    double dmax = _dbz[ii];
-    for (int kk = ii - _nGatesStatsHalf; kk <= ii + _nGatesStatsHalf; kk++) {
-      if (kk >= 0 && kk < _nGates) {
-        double dbz = _dbz[kk];
-        if (dbz > dmax) {
-          dmax = dbz;
-        }
-      }
-    }
-    _dbzMax[ii] = dmax;
-  } // ii
+    _stepDbzMax(ii, head, tail);
+  }
+
+}
+
+/////////////////////////////////////////////
+// Add gate jj to the end of the dbz max queue, dropping the
+// gates which can no longer be the max
+
+inline void KdpFilt::_pushDbzMax(int jj, int &head, int &tail)
 
+{
+  double dbz = _dbz[jj];
+  while (tail > head && _dbz[_dbzMaxQueue[tail - 1]] <= dbz) {
+    tail--;
+  }
+  _dbzMaxQueue[tail++] = jj;
+}
+
+/////////////////////////////////////////////
+// Move the dbz max window on to gate ii, and set the max there
+
+inline void KdpFilt::_stepDbzMax(int ii, int &head, int &tail)
+
+{
+  int jIn = ii + _nGatesStatsHalf;
+  if (jIn < _nGates) {
+    _pushDbzMax(jIn, head, tail);
+  }
+  while (_dbzMaxQueue[head] < ii - _nGatesStatsHalf) {
+    head++;
+  }
+  _dbzMax[ii] = _dbz[_dbzMaxQueue[head]];
 }
     
 ////////////////////////////////////////////////////////////////////
@@ -1299,7 +1750,8 @@ int KdpFilt::_findValidRuns()
   
   // first pass - load up all runs
 
-  vector<PhidpRun> allRuns;
+  vector<PhidpRun> &allRuns = _allRuns;
+  allRuns.clear();
   int runLen = 0;
   for (int igate = 0; igate < _nGates; igate++) {
 
@@ -1334,41 +1786,8 @@ int KdpFilt::_findValidRuns()
   // now combine runs with a gap between them
   // smaller than or equal to _nGatesStatsHalf
 
-  vector<PhidpRun> combRuns;
-  bool done = false;
-  int count = 0;
-  while (!done) {
-    count++;
-    done = true;
-    combRuns.clear();
-    if (allRuns.size() < 2) {
-      combRuns = allRuns;
-      break; // from while loop
-    }
-    for (size_t irun = 0; irun < allRuns.size() - 1; irun++) {
-      PhidpRun thisRun = allRuns[irun];
-      PhidpRun nextRun = allRuns[irun+1];
-      int gapLen = nextRun.ibegin - thisRun.iend - 1;
-      if (gapLen > _nGatesStatsHalf) {
-        combRuns.push_back(thisRun);
-        if (irun == allRuns.size() - 2) {
-          combRuns.push_back(nextRun);
-        }
-      } else {
-        // add combined run
-        thisRun.iend = nextRun.iend;
-        combRuns.push_back(thisRun);
-        for (size_t jrun = irun + 2; jrun < allRuns.size(); jrun++) {
-          // add remainder of runs
-          combRuns.push_back(allRuns[jrun]);
-        } // jrun
-        done = false;
-        // copy modified array back to allRuns ready for another try
-        allRuns = combRuns;
-        break; // from irun loop
-      }
-    } // irun
-  } // while (!done)
+  combineRuns(allRuns, _combRuns, _nGatesStatsHalf);
+  const vector<PhidpRun> &combRuns = _combRuns;
   
   // find runs longer than 2 * _nGatesStats
   // trim each end by _nGatesStats/2
@@ -1432,6 +1851,37 @@ int KdpFilt::_findValidRuns()
 
 }
   
+//////////////////////////////////////////////////////////////////////////
+// Combine runs with a gap between them no longer than maxGapLen.
+// Closing a gap leaves the gap to the following run unchanged, so a
+// single pass gives the same result as repeatedly combining the first
+// pair of runs which is close enough.
+
+void KdpFilt::combineRuns(const vector<PhidpRun> &runs,
+                          vector<PhidpRun> &combRuns,
+                          int maxGapLen)
+{
+
+  combRuns.clear();
+  if (runs.size() < 1) {
+    return;
+  }
+
+  PhidpRun thisRun = runs[0];
+  for (size_t irun = 1; irun < runs.size(); irun++) {
+    const PhidpRun &nextRun = runs[irun];
+    int gapLen = nextRun.ibegin - thisRun.iend - 1;
+    if (gapLen > maxGapLen) {
+      combRuns.push_back(thisRun);
+      thisRun = nextRun;
+    } else {
+      thisRun.iend = nextRun.iend;
+    }
+  } // irun
+  combRuns.push_back(thisRun);
+
+}
+  
 //////////////////////////////////////////////////////////////////////////
 // Check gate for validity
  
@@ -1484,91 +1934,192 @@ void KdpFilt::_gateStatesInit()
 {
 
   // init (x,y) representation of phidp
+  // use the table for values on a quantisation level
+
+  if (_phidpQuantNLevels > 0) {
+    _initSinCosTable();
+  }
 
   for (int ii = 0; ii < _nGates; ii++) {
-    GateState &state = _gateStates[ii];
-    state.init(_missingValue);
+    _stateXx[ii] = 0.0;
+    _stateYy[ii] = 0.0;
+    _stateMeanXx[ii] = 0.0;
+    _stateMeanYy[ii] = 0.0;
+    _stateDistFromPrev[ii] = 0.0;
     if (_phidp[ii] != _missingValue) {
-      state.missing = false;
+      if (_phidpQuantNLevels > 0) {
+        int level = (int) floor((_phidp[ii] - _phidpQuantOffset) /
+                                _phidpQuantGain + 0.5);
+        if (level >= 0 && level < _phidpQuantNLevels &&
+            _sinCosTablePhidp[level] == _phidp[ii]) {
+          _stateXx[ii] = _cosTable[level];
+          _stateYy[ii] = _sinTable[level];
+          continue;
+        }
+      }
       double phase = _phidp[ii];
-      state.phidp = _phidp[ii];
       if (_foldsAt90) {
         phase *= 2.0;
       }
       double sinVal, cosVal;
       ta_sincos(phase * DEG_TO_RAD, &sinVal, &cosVal);
-      state.xx = cosVal;
-      state.yy = sinVal;
+      _stateXx[ii] = cosVal;
+      _stateYy[ii] = sinVal;
     }
   }
 
   // init dist between phidp at successive gates
 
   for (int ii = 1; ii < _nGates; ii++) {
-    GateState &istate0 = _gateStates[ii-1];
-    GateState &istate1 = _gateStates[ii];
-    if (!istate0.missing && !istate1.missing) {
-      double xx0 = istate0.xx;
-      double yy0 = istate0.yy;
-      double xx1 = istate1.xx;
-      double yy1 = istate1.yy;
-      double dx = xx1 - xx0;
-      double dy = yy1 - yy0;
+    if (_phidp[ii-1] != _missingValue && _phidp[ii] != _missingValue) {
+      double dx = _stateXx[ii] - _stateXx[ii-1];
+      double dy = _stateYy[ii] - _stateYy[ii-1];
       double dist = sqrt(dx * dx + dy * dy);
-      _gateStates[ii].distFromPrev = dist;
+      _stateDistFromPrev[ii] = dist;
     }
   }
   
 }
   
+//////////////////////////////////////////////////////////////////////////
+// Tabulate sin and cos of the quantised phidp levels.
+// The table is recomputed if the folding range changes.
+
+void KdpFilt::_initSinCosTable()
+
+{
+
+  if (_sinCosTableReady && _sinCosTableFoldsAt90 == _foldsAt90) {
+    return;
+  }
+
+  _sinCosTablePhidp = _sinCosTablePhidp_.alloc(_phidpQuantNLevels);
+  _sinTable = _sinTable_.alloc(_phidpQuantNLevels);
+  _cosTable = _cosTable_.alloc(_phidpQuantNLevels);
+
+  for (int ii = 0; ii < _phidpQuantNLevels; ii++) {
+    double phidp = _phidpQuantOffset + _phidpQuantGain * ii;
+    double phase = phidp;
+    if (_foldsAt90) {
+      phase *= 2.0;
+    }
+    double sinVal, cosVal;
+    ta_sincos(phase * DEG_TO_RAD, &sinVal, &cosVal);
+    _sinCosTablePhidp[ii] = phidp;
+    _sinTable[ii] = sinVal;
+    _cosTable[ii] = cosVal;
+  }
+
+  _sinCosTableReady = true;
+  _sinCosTableFoldsAt90 = _foldsAt90;
+
+}
+
 //////////////////////////////////////////////////////////////////////////
 //  To calculate the mean phidp, standard deviation, and jitter
-//  in phidp at a gate, using stats on the circle
+//  in phidp at each gate, using stats on the circle.
+//
+//  The sums over the kernel are carried from one gate to the next,
+//  adding the gate entering the kernel and removing the gate leaving it.
+//  They are recomputed from scratch every _nGatesStats gates, to stop
+//  rounding errors from accumulating.
 
-void KdpFilt::_computePhidpStats(int igate)
+void KdpFilt::_computePhidpStats()
   
 {
 
-  GateState &istate = _gateStates[igate];
-  
+  int nHalf = _nGatesStatsHalf;
+  int nResync = (_nGatesStats > 1) ? _nGatesStats : 1;
+
   double count = 0.0;
   double sumxx = 0.0;
   double sumyy = 0.0;
   double sumDist = 0.0;
   double sumDistSq = 0.0;
-  
-  for (int jj = igate - _nGatesStatsHalf; jj <= igate + _nGatesStatsHalf; jj++) {
-    if (jj < 0 || jj >= _nGates) {
-      continue;
-    }
-    GateState &jstate = _gateStates[jj];
-    if (jstate.missing) {
-      continue;
+  int nSteps = 0;
+
+  for (int igate = nHalf; igate < _nGates - nHalf; igate++) {
+
+    if (igate == nHalf || nSteps == nResync) {
+
+      // sum over the whole kernel
+      
+      count = 0.0;
+      sumxx = 0.0;
+      sumyy = 0.0;
+      sumDist = 0.0;
+      sumDistSq = 0.0;
+      for (int jj = igate - nHalf; jj <= igate + nHalf; jj++) {
+        if (_phidp[jj] == _missingValue) {
+          continue;
+        }
+        double dist = _stateDistFromPrev[jj];
+        sumxx += _stateXx[jj];
+        sumyy += _stateYy[jj];
+        sumDist += dist;
+        sumDistSq += dist * dist;
+        count++;
+      }
+      nSteps = 0;
+
+    } else {
+
+      // move the kernel on by one gate
+      
+      int jOut = igate - nHalf - 1;
+      if (_phidp[jOut] != _missingValue) {
+        double dist = _stateDistFromPrev[jOut];
+        sumxx -= _stateXx[jOut];
+        sumyy -= _stateYy[jOut];
+        sumDist -= dist;
+        sumDistSq -= dist * dist;
+        count--;
+      }
+      int jIn = igate + nHalf;
+      if (_phidp[jIn] != _missingValue) {
+        double dist = _stateDistFromPrev[jIn];
+        sumxx += _stateXx[jIn];
+        sumyy += _stateYy[jIn];
+        sumDist += dist;
+        sumDistSq += dist * dist;
+        count++;
+      }
+      nSteps++;
+
     }
-    double xx = jstate.xx;
-    double yy = jstate.yy;
-    double dist = jstate.distFromPrev;
-    sumxx += xx;
-    sumyy += yy;
-    sumDist += dist;
-    sumDistSq += dist * dist;
-    count++;
-  }
+
+    _setPhidpStats(igate, count, sumxx, sumyy, sumDist, sumDistSq);
+
+  } // igate
+  
+}
+
+//////////////////////////////////////////////////////////////////////////
+//  Set the mean phidp, standard deviation, and jitter at a gate,
+//  from the sums over its kernel
+
+void KdpFilt::_setPhidpStats(int igate, double count,
+                             double sumxx, double sumyy,
+                             double sumDist, double sumDistSq)
   
+{
+
   if (count <= _nGatesStatsHalf) {
     return;
   }
 
   // mean phidp
   
-  istate.meanxx = sumxx / count;
-  istate.meanyy = sumyy / count;
+  double meanxx = sumxx / count;
+  double meanyy = sumyy / count;
+  _stateMeanXx[igate] = meanxx;
+  _stateMeanYy[igate] = meanyy;
   
-  double phase = atan2(istate.meanyy, istate.meanxx) * RAD_TO_DEG;
+  double phase = atan2(meanyy, meanxx) * RAD_TO_DEG;
   if (_foldsAt90) {
     phase *= 0.5;
   }
-  istate.phidpMean = phase;
+  _phidpMean[igate] = phase;
   
   // jitter
   
@@ -1577,7 +2128,7 @@ void KdpFilt::_computePhidpStats(int igate)
   if (_foldsAt90) {
     meanAngChangePerGate *= 0.5;
   }
-  istate.phidpJitter = meanAngChangePerGate;
+  _phidpJitter[igate] = meanAngChangePerGate;
   
   // sdev of distance moved, is a proxy for sdev of phidp
   
@@ -1589,161 +2140,157 @@ void KdpFilt::_computePhidpStats(int igate)
       if (_foldsAt90) {
         sdev *= 0.5;
       }
-      istate.phidpSdev = sdev;
+      _phidpSdev[igate] = sdev;
     }
   }
-  
-}
-
-//////////////////////////////////////////////////////////////////////////
-//  To calculate the sdev of ZDR
-
-void KdpFilt::_computeZdrSdev(int igate)
-  
-{
 
-  double count = 0.0;
-  double sum = 0.0;
-  double sumSq = 0.0;
-  
-  for (int jj = igate - _nGatesStatsHalf; jj <= igate + _nGatesStatsHalf; jj++) {
-    if (jj < 0 || jj >= _nGates) {
-      continue;
-    }
-    double zdr = _zdr[jj];
-    if (zdr != _missingValue) {
-      sum += zdr;
-      sumSq += zdr * zdr;
-      count++;
-    }
-  } // jj
+  // circular sdev of phidp, from the length of the mean vector
   
-  if (count <= _nGatesStatsHalf) {
-    // not enough data
-    return;
-  }
-
-  if (count > 2) {
-    double mean = sum / count;
-    double term1 = sumSq / count;
-    double term2 = mean * mean;
-    if (term1 >= term2) {
-      double sdev = sqrt(term1 - term2);
-      _zdrSdev[igate] = sdev;
+  if (_computePhidpCircSdev && count > 2) {
+    double rr = sqrt(meanxx * meanxx + meanyy * meanyy);
+    if (rr > 0.0) {
+      double sdev = (rr < 1.0) ? sqrt(-2.0 * log(rr)) * RAD_TO_DEG : 0.0;
+      if (_foldsAt90) {
+        sdev *= 0.5;
+      }
+      _phidpCircSdev[igate] = sdev;
     }
   }
   
 }
 
 //////////////////////////////////////////////////////////////////////////
-// Write the ray data to a text file
+//  Compute the range kernel stats for the ray in a single pass over
+//  the gates: the phidp stats as for _computePhidpStats(), the sdev
+//  of ZDR and the max DBZ for the surrounding gates.
 
-void KdpFilt::_writeRayDataToFile()
+void KdpFilt::_computeRangeStats()
   
 {
-#if 0
 
-  // make sure output dir exists
+  int nHalf = _nGatesStatsHalf;
+  int nResync = (_nGatesStats > 1) ? _nGatesStats : 1;
 
-  if (ta_makedir_recurse(_rayFileDir.c_str())) {
-    int errNum = errno;
-    cerr << "ERROR - KdpFilt::_writeRayDataToFile()" << endl;
-    cerr << "  Cannot create dir: " << _rayFileDir << endl;
-    cerr << "  " << strerror(errNum) << endl;
-    return;
+  double count = 0.0;
+  double sumxx = 0.0;
+  double sumyy = 0.0;
+  double sumDist = 0.0;
+  double sumDistSq = 0.0;
+  double zdrCount = 0.0;
+  double zdrSum = 0.0;
+  double zdrSumSq = 0.0;
+  int nSteps = 0;
+
+  int head = 0, tail = 0;
+  for (int jj = 0; jj < nHalf && jj < _nGates; jj++) {
+    _pushDbzMax(jj, head, tail);
   }
 
-  // create file name
+  for (int igate = 0; igate < _nGates; igate++) {
 
-  char filePath[MAX_PATH_LEN];
-  DateTime rtime(_timeSecs);
-  int msecs = (int) (_timeFractionSecs * 1000.0 + 0.5);
-  sprintf(filePath, "%s%skdpray_%.4d%.2d%.2d-%.2d%.2d%.2d.%.3d_el-%05.1f_az-%05.1f_.txt",
-          _rayFileDir.c_str(), PATH_DELIM,
-          rtime.getYear(), rtime.getMonth(), rtime.getDay(),
-          rtime.getHour(), rtime.getMin(), rtime.getSec(), msecs,
-          _elevDeg, _azDeg);
+    _stepDbzMax(igate, head, tail);
 
-  // open file
+    if (igate < nHalf || igate >= _nGates - nHalf) {
+      continue;
+    }
 
-  FILE *out = fopen(filePath, "w");
-  if (out == NULL) {
-    int errNum = errno;
-    cerr << "ERROR - KdpFilt::_writeRayDataToFile()" << endl;
-    cerr << "  Cannot open file: " << filePath << endl;
-    cerr << "  " << strerror(errNum) << endl;
-    return;
-  }
+    if (igate == nHalf || nSteps == nResync) {
 
-  // write header line
+      // sum over the whole kernel
+      
+      count = 0.0;
+      sumxx = 0.0;
+      sumyy = 0.0;
+      sumDist = 0.0;
+      sumDistSq = 0.0;
+      zdrCount = 0.0;
+      zdrSum = 0.0;
+      zdrSumSq = 0.0;
+      for (int jj = igate - nHalf; jj <= igate + nHalf; jj++) {
+        if (_phidp[jj] != _missingValue) {
+          double dist = _stateDistFromPrev[jj];
+          sumxx += _stateXx[jj];
+          sumyy += _stateYy[jj];
+          sumDist += dist;
+          sumDistSq += dist * dist;
+          count++;
+        }
+        double zdr = _zdr[jj];
+        if (zdr != _missingValue) {
+          zdrSum += zdr;
+          zdrSumSq += zdr * zdr;
+          zdrCount++;
+        }
+      }
+      nSteps = 0;
 
-  fprintf(out,
-          "# gateNum validKdp validUnfold snr dbz zdr rhohv phidp "
-          "phidpMean phidpMeanValid phidpJitter phidpSdev "
-          "phidpMeanUnfold phidpUnfold phidpFilt phidpCond phidpCondFilt "
-          "zdrSdev psob kdp "
-          "dbzAtten zdrAtten dbzCorrected zdrCorrected\n");
+    } else {
 
-  // write data
+      // move the kernel on by one gate
+      
+      int jOut = igate - nHalf - 1;
+      if (_phidp[jOut] != _missingValue) {
+        double dist = _stateDistFromPrev[jOut];
+        sumxx -= _stateXx[jOut];
+        sumyy -= _stateYy[jOut];
+        sumDist -= dist;
+        sumDistSq -= dist * dist;
+        count--;
+      }
+      double zdrOut = _zdr[jOut];
+      if (zdrOut != _missingValue) {
+        zdrSum -= zdrOut;
+        zdrSumSq -= zdrOut * zdrOut;
+        zdrCount--;
+      }
+      int jIn = igate + nHalf;
+      if (_phidp[jIn] != _missingValue) {
+        double dist = _stateDistFromPrev[jIn];
+        sumxx += _stateXx[jIn];
+        sumyy += _stateYy[jIn];
+        sumDist += dist;
+        sumDistSq += dist * dist;
+        count++;
+      }
+      double zdrIn = _zdr[jIn];
+      if (zdrIn != _missingValue) {
+        zdrSum += zdrIn;
+        zdrSumSq += zdrIn * zdrIn;
+        zdrCount++;
+      }
+      nSteps++;
 
-  for (int igate = 0; igate < _nGates; igate++) {
-    double dbzCorrected = 0;
-    double zdrCorrected = 0;
-    if (_dbz[igate] > -9990 && _dbzAttenCorr[igate] > -9990) {
-      dbzCorrected = _dbz[igate] + _dbzAttenCorr[igate];
-    }
-    if (_zdr[igate] > -9990 && _zdrAttenCorr[igate] > -9990) {
-      zdrCorrected = _zdr[igate] + _zdrAttenCorr[igate];
     }
-    fprintf(out,
-            "%3d %3d %3d "
-            "%10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f "
-            "%10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f %10.3f "
-            "%10.3f %10.3f %10.3f %10.3f %10.3f\n",
-            igate,
-            (_validForKdp[igate]?1:0),
-            (_validForUnfold[igate]?1:0),
-            _getPlotVal(_snr[igate], -10),
-            _getPlotVal(_dbz[igate], -20),
-            _getPlotVal(_zdr[igate], 0),
-            _getPlotVal(_rhohv[igate], 0),
-            _getPlotVal(_phidp[igate], 0),
-            _getPlotVal(_phidpMean[igate], 0),
-            _getPlotVal(_phidpMeanValid[igate], 0),
-            _getPlotVal(_phidpJitter[igate], 0),
-            _getPlotVal(_phidpSdev[igate], 0),
-            _getPlotVal(_phidpMeanUnfold[igate], 0),
-            _getPlotVal(_phidpUnfold[igate], 0),
-            _getPlotVal(_phidpFilt[igate], 0),
-            _getPlotVal(_phidpCond[igate], 0),
-            _getPlotVal(_phidpCondFilt[igate], 0),
-            _getPlotVal(_zdrSdev[igate], 0),
-            _getPlotVal(_psob[igate], 0),
-            _getPlotVal(_kdp[igate], 0),
-            _getPlotVal(_dbzAttenCorr[igate], 0),
-            _getPlotVal(_zdrAttenCorr[igate], 0),
-            _getPlotVal(dbzCorrected, 0),
-            _getPlotVal(zdrCorrected, 0)
-            );
-  }
-  
-  // close file
-
-  fclose(out);
-
-#endif
+
+    _setPhidpStats(igate, count, sumxx, sumyy, sumDist, sumDistSq);
+    _setZdrSdev(igate, zdrCount, zdrSum, zdrSumSq);
+
+  } // igate
+  
 }
 
 //////////////////////////////////////////////////////////////////////////
-// Get a value suitable for plotting
-// i.e. interpret missing data reasonably
+//  Set the sdev of ZDR at a gate, from the sums over its kernel
 
-double KdpFilt::_getPlotVal(double val, double valIfMissing)
+void KdpFilt::_setZdrSdev(int igate, double count,
+                          double sum, double sumSq)
   
 {
-  if (val < -9990) {
-    return valIfMissing;
-  } else {
-    return val;
+
+  if (count <= _nGatesStatsHalf) {
+    // not enough data
+    return;
   }
+
+  if (count > 2) {
+    double mean = sum / count;
+    double term1 = sumSq / count;
+    double term2 = mean * mean;
+    if (term1 >= term2) {
+      double sdev = sqrt(term1 - term2);
+      _zdrSdev[igate] = sdev;
+    }
+  }
+  
 }
+
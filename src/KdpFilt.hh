@@ -45,6 +45,8 @@
 #include <iostream>
 using namespace std;
 
+class KdpDiagSink;
+
 ////////////////////////
 // This class
 
@@ -62,6 +64,15 @@ public:
    */
   ~KdpFilt();
 
+  /**
+   * Copy only the options for filtering the unfolded phidp from
+   * another object: the FIR filter length, the numbers of iterations,
+   * iterative, composite and convergence settings, and the min valid
+   * abs KDP. These options do not affect the unfolding.
+   * @param[in] other The object to copy the options from
+   */
+  void copyFilterParams(const KdpFilt &other);
+
   /**
    * Set FIR filter length
    * valid lengths are 125, 30, 20, 10
@@ -110,6 +121,28 @@ public:
     _useIterativeFiltering = val;
   }
 
+  /**
+   * Option to use a composite FIR filter for the repeated
+   * filter iterations.
+   * The composite filter is the FIR filter convolved with itself
+   * once per iteration, so the iterations are applied in a single
+   * pass. It is used for the unfolded phidp and, with the conditional
+   * filtering method, for the conditioned phidp. The iterative
+   * filtering method depends on the data at each iteration, so it
+   * is always iterated.
+   * Gates near the ends of the ray, which are affected by the
+   * padding, are still iterated directly. Elsewhere the results
+   * agree with the iterated filter to rounding precision.
+   * Long composite filters are applied by FFT convolution.
+   * The composite filter is only used where it is estimated to be
+   * cheaper than iterating, i.e. for long filters with many
+   * iterations on long rays.
+   * Default is false.
+   */
+  void setUseCompositeFilter(bool val) {
+    _useCompositeFilter = val;
+  }
+
   /**
    * For iterative filtering only.
    * Set threshold for difference of phidp.
@@ -125,6 +158,24 @@ public:
     _phidpDiffThreshold = threshold;
   }
 
+  /**
+   * For iterative filtering only.
+   * Stop iterating the filter on the conditioned phidp once it has
+   * converged, i.e. once the max change in phidp over an iteration is
+   * no more than the tolerance, rather than always running
+   * _nFiltIterCond iterations. Each iteration depends only on the
+   * result of the previous one, so with a tolerance of 0 iteration
+   * stops at a fixed point and the results are unchanged.
+   * Default is false.
+   * See getNFiltIterCondUsed().
+   * @param[in] state If true, stop iterating on convergence
+   * @param[in] tolerance The phidp change tolerance (deg)
+   */
+  void setIterCondConvergence(bool state, double tolerance) {
+    _iterCondConvergence = state;
+    _iterCondTolerance = tolerance;
+  }
+
   /**
    * Set number of gates for computing phidp stats
    * default is 9
@@ -135,12 +186,29 @@ public:
     _nGatesStatsHalf = n / 2 + 1;
   }
 
+  /**
+   * Set the quantisation of the input phidp values, if known,
+   * i.e. phidp = offset + gain * level, for level in [0, nLevels).
+   * The sin and cos of phidp at each level are then tabulated,
+   * instead of being computed at every gate. Values which do not
+   * fall on a level are computed directly, so the results do not
+   * depend on this setting.
+   * Default is nLevels = 0, no tabulation.
+   * @param[in] gain The phidp gain
+   * @param[in] offset The phidp offset
+   * @param[in] nLevels Number of quantisation levels
+   */
+  void setPhidpQuantisation(double gain, double offset, int nLevels);
+
   /** 
    * Apply a max range limit in km
    * if true, limit computations to _maxRangeKm
    * useful for avoiding test pulse
    * default is false
+   * Gates beyond the max range are not processed: KDP is set to 0 there,
+   * and the attenuation corrections keep their value at max range.
    * @param[in] state If true, limit computations to max range
+   * @param[in] maxRangeKm The max range in km
    */
 
   // option to limit max range
@@ -192,6 +260,18 @@ public:
     _phidpSdevMax = val;
   }
 
+  /**
+   * Option to compute the circular standard deviation of phidp
+   * over the stats kernel, sqrt(-2 ln R) where R is the length of
+   * the mean (x,y) phidp vector. Unlike the linear sdev of the phidp
+   * values, it is not affected by folding. Used as the phidp texture
+   * for PID. See getPhidpCircSdev().
+   * Default is false.
+   */
+  void setComputePhidpCircSdev(bool val) {
+    _computePhidpCircSdev = val;
+  }
+
   /**
    * Set max allowable jitter for phidp (deg)
    * Jitter is mean absolute change in phidp gate-to-gate
@@ -230,8 +310,9 @@ public:
   }
 
   /**
-   * Set flag to indicate we should compute corrections.
+   * Set flag to indicate whether we should compute corrections.
    * Uses default coefficients.
+   * @param[in] val True to compute corrections
    */
   void setComputeAttenCorr(bool val);
   
@@ -334,6 +415,13 @@ public:
   }
   const double *getZdrSdev() const { return _zdrSdev; }
 
+  /**
+   * Get circular sdev of phidp (deg) after calling compute(),
+   * if setComputePhidpCircSdev() is set, otherwise missing
+   * @return an array of sdev values
+   */
+  const double *getPhidpCircSdev() const { return _phidpCircSdev; }
+
   /**
    * Get flag of valid gates after calling compute()
    * @return an array of flag values
@@ -360,6 +448,15 @@ public:
   const double *getDbzAttenCorr() const { return _dbzAttenCorr; }
   const double *getZdrAttenCorr() const { return _zdrAttenCorr; }
 
+  /**
+   * Get the number of filter iterations applied to the conditioned
+   * phidp by the last call to compute(). Less than the number set
+   * by setNFiltIterCond() if iteration stopped on convergence,
+   * 0 if the ray had no valid phidp.
+   * @return the number of iterations
+   */
+  int getNFiltIterCondUsed() const { return _nFiltIterCondUsed; }
+
   /**
    * set debug on
    * Debug print output will go to stderr
@@ -367,16 +464,65 @@ public:
   void setDebug(bool state = true) { _debug = state; }
 
   /**
-   * set writing of ray file
-   * Ray data will be written to the specified dir
+   * Set the sink for diagnostics. At the end of compute(), the
+   * intermediate arrays for the ray are passed to the sink if it
+   * selects the ray. The sink is not owned, and may be shared by
+   * KdpFilt objects in several threads. NULL for no diagnostics.
+   * @param[in] sink The diagnostics sink
+   */
+  void setDiagSink(KdpDiagSink *sink) { _diagSink = sink; }
+
+  /**
+   * A run of gates, ibegin to iend inclusive.
+   * Used for runs of valid phidp and for the gaps between them.
    */
-  void setWriteRayFile(bool state = true,
-                       string dir = "");
+  class PhidpRun {
+  public:
+    int ibegin;
+    int iend;
+    double phidpBegin;
+    double phidpEnd;
+    PhidpRun() {
+      ibegin = 0;
+      iend = 0;
+      phidpBegin = 0.0;
+      phidpEnd = 0.0;
+    }
+    PhidpRun(int begin, int end) {
+      ibegin = begin;
+      iend = end;
+      phidpBegin = 0.0;
+      phidpEnd = 0.0;
+    }
+    int len() const { return (iend - ibegin + 1); }
+    void print(int irun, ostream &out) {
+      out << "irun, ibegin, iend: "
+          << irun << ","
+          << ibegin << ","
+          << iend << endl;
+    }
+  };
+
+  /**
+   * Combine runs which are separated by a gap of no more than
+   * maxGapLen gates. Runs must be in ascending order of gates.
+   * Single pass, linear in the number of runs.
+   * @param[in] runs The runs to combine
+   * @param[out] combRuns The combined runs
+   * @param[in] maxGapLen Longest gap to close
+   */
+  static void combineRuns(const vector<PhidpRun> &runs,
+                          vector<PhidpRun> &combRuns,
+                          int maxGapLen);
+
   
 protected:
   
 private:
 
+  friend class KdpFiltEnsemble;
+  friend class KdpDiagSink;
+
   double _missingValue; /**< Value for missing or bad data */
 
   // time for ray
@@ -412,8 +558,23 @@ private:
   
   bool _useIterativeFiltering;
   double _phidpDiffThreshold;
+  bool _iterCondConvergence;   /**< stop iterating on convergence */
+  double _iterCondTolerance;   /**< max phidp change for convergence */
+  int _nFiltIterCondUsed;      /**< iterations used for the last ray */
 
-  int _nGates;          /**< n gates in input array */
+  // composite FIR filter, for the unfolded [0] and cond [1] iterations
+
+  bool _useCompositeFilter;
+  vector<double> _compositeCoeff[2]; /**< Composite filter coefficients */
+  int _compositeFirLength[2];        /**< FIR length used for the composite */
+  int _compositeNIter[2];            /**< N iterations used for the composite */
+
+  static const int COMPOSITE_FFT_MIN_LEN = 256; /**< Use FFT convolution for
+                                                 * composite filters at least
+                                                 * this long */
+
+  int _nGatesRay;       /**< n gates in input array */
+  int _nGates;          /**< n gates processed, up to max range */
   int _nGatesStats;     /**< n gates for computing phidp stats
                          * default is 9 */
   int _nGatesStatsHalf; /**< half of _nGatesPhidpStats, truncated */
@@ -451,42 +612,42 @@ private:
 
   double _phidpJitterMax; /**< Max jitter for valid phidp */
   double _phidpSdevMax; /**< Max sdev for valid phidp */
+  bool _computePhidpCircSdev; /**< Compute circular sdev of phidp */
 
   // min valid KDP, default 0.05
   // absolute values less than this are set to 0
 
   double _minValidAbsKdp;
 
-  // phidp state for unfolding
-
-  class GateState {
-  public:
-    void init(double missingValue) {
-      missing = true;
-      phidp = missingValue;
-      xx = 0.0;
-      yy = 0.0;
-      meanxx = 0.0;
-      meanyy = 0.0;
-      distFromPrev = 0.0;
-      phidpMean = missingValue;
-      phidpSdev = missingValue;
-      phidpJitter = missingValue;
-    }
-    bool missing;
-    double phidp;
-    double xx;
-    double yy;
-    double meanxx;
-    double meanyy;
-    double distFromPrev;
-    double phidpMean;
-    double phidpSdev;
-    double phidpJitter;
-  };
-
-  TaArray<GateState> _gateStates_;
-  GateState *_gateStates;
+  // phidp state for unfolding, one array per quantity.
+  // (x,y) is phidp on the unit circle, mean (x,y) is the mean
+  // over the stats kernel, dist is the distance on the circle from
+  // the previous gate. All are 0 at missing gates.
+
+  TaArray<double> _stateXx_;
+  double *_stateXx;
+  TaArray<double> _stateYy_;
+  double *_stateYy;
+  TaArray<double> _stateMeanXx_;
+  double *_stateMeanXx;
+  TaArray<double> _stateMeanYy_;
+  double *_stateMeanYy;
+  TaArray<double> _stateDistFromPrev_;
+  double *_stateDistFromPrev;
+
+  // tabulated sin and cos of quantised phidp
+
+  double _phidpQuantGain;
+  double _phidpQuantOffset;
+  int _phidpQuantNLevels;
+  bool _sinCosTableReady;
+  bool _sinCosTableFoldsAt90;  /**< Fold state the table was computed for */
+  TaArray<double> _sinCosTablePhidp_;
+  double *_sinCosTablePhidp;
+  TaArray<double> _sinTable_;
+  double *_sinTable;
+  TaArray<double> _cosTable_;
+  double *_cosTable;
   
   bool _foldsAt90;
   double _foldVal, _foldRange;
@@ -495,33 +656,8 @@ private:
   
   // runs of valid phidp
 
-  class PhidpRun {
-  public:
-    int ibegin;
-    int iend;
-    double phidpBegin;
-    double phidpEnd;
-    PhidpRun() {
-      ibegin = 0;
-      iend = 0;
-      phidpBegin = 0.0;
-      phidpEnd = 0.0;
-    }
-    PhidpRun(int begin, int end) {
-      ibegin = begin;
-      iend = end;
-      phidpBegin = 0.0;
-      phidpEnd = 0.0;
-    }
-    int len() const { return (iend - ibegin + 1); }
-    void print(int irun, ostream &out) {
-      out << "irun, ibegin, iend: "
-          << irun << ","
-          << ibegin << ","
-          << iend << endl;
-    }
-  };
-
+  vector<PhidpRun> _allRuns;   /**< All runs, before combining */
+  vector<PhidpRun> _combRuns;  /**< Runs after closing small gaps */
   vector<PhidpRun> _validRuns;
   vector<PhidpRun> _gaps;
   
@@ -540,6 +676,8 @@ private:
 
   TaArray<double> _dbzMax_;
   double *_dbzMax;
+  TaArray<int> _dbzMaxQueue_;
+  int *_dbzMaxQueue;
   
   bool _rhohvAvailable;
   TaArray<double> _rhohv_;
@@ -566,6 +704,8 @@ private:
   
   TaArray<double> _phidpSdev_;
   double *_phidpSdev;
+  TaArray<double> _phidpCircSdev_;
+  double *_phidpCircSdev;
   
   TaArray<double> _phidpMeanUnfold_;
   double *_phidpMeanUnfold;
@@ -603,6 +743,14 @@ private:
   TaArray<double> _zdrAttenCorr_;
   double *_zdrAttenCorr;
 
+  // working arrays for filtering, kept from ray to ray
+  // these only grow, so are allocated once for the longest ray
+
+  TaArray<double> _yyy_, _zzz_;      /**< Padded filter in and out */
+  TaArray<double> _stripIn_;         /**< Strip filter input */
+  TaArray<double> _stripOut_;        /**< Strip filter output */
+  TaArray<double> _compositeExt_;    /**< Composite filter input */
+
   // Z and ZDR attenuation correction
 
   bool _doComputeAttenCorr;
@@ -611,48 +759,107 @@ private:
   double _dbzAttenExpon;
   double _zdrAttenCoeff;
   double _zdrAttenExpon;
+
+  // coeff * kdp^expon tabulated over the clipped kdp range
+
+  bool _attenTableReady;
+  double _attenTableCoeffs[4];  /**< Coefficients the tables were computed for */
+  int _attenTableLen;
+  TaArray<double> _dbzAttenTable_;
+  double *_dbzAttenTable;
+  TaArray<double> _zdrAttenTable_;
+  double *_zdrAttenTable;
   
-  // debug printing and writing ray files
+  // debug printing and diagnostics
 
   bool _debug;
-  bool _writeRayFile;
-  string _rayFileDir;
+  KdpDiagSink *_diagSink;
 
   // methods
  
   /**
    * Initialize local arrays and copy input data for filtering,
-   * manipulation, etc.
+   * manipulation, etc. Arrays hold the whole ray, _nGatesRay gates;
+   * input beyond the first _nGates is set to missing.
    */ 
 
   void _initArrays(const double *snr,
                    const double *dbz,
                    const double *zdr,
                    const double *rhohv,
-                   const double *phidp,
-                   int nGatesMaxValid);
+                   const double *phidp);
   
+  /**
+   * Set ray details and initialize the data arrays.
+   * The first stage of compute().
+   */
+  void _initRay(time_t timeSecs,
+                double timeFractionSecs,
+                double elevDeg,
+                double azDeg,
+                double wavelengthCm,
+                int nGates,
+                double startRangeKm,
+                double gateSpacingKm,
+                const double *snr,
+                const double *dbz,
+                const double *zdr,
+                const double *rhohv,
+                const double *phidp,
+                double missingValue);
+
+  /// Set the results for a ray with no valid phidp
+
+  void _setNoValidData();
+
+  /// Number of gates to process, up to the max range
+
+  int _computeNGatesInRange() const;
+
   /**
    * Load up conditioned phidp array, by interpolating
    * phidp between valid runs
    */
   int _unfoldPhidp();
 
+  /// Unfold phidp using the runs of valid phidp,
+  /// once the phidp stats are known
+
+  int _unfoldValidRuns();
+
   /// filter the unfolded phidp array and compute kdp
   
   void _computeKdp();
+  void _loadKdpFromCondFilt();
+
+  /// psob, thresholds on kdp and attenuation correction,
+  /// the last stage of compute()
+
+  void _finishRay();
   void _copyArray(double *array, const double *vals);
-  void _copyArrayCond(double *array, const double *vals,
-                      const double *original);
+  double _copyArrayCond(double *array, const double *vals,
+                        const double *original);
   void _padArray(double *array);
   void _loadKdp(const double *phidp, double *kdp);
   void _loadPhidpAccumFilt(const double *phidp, double *accum);
   void _computeAttenCorrection();
   void _applyFirFilter(const double *in, double *out);
+  void _applyFirFilterIter(const double *in, double *out, int nIter);
+  void _applyFirFilterStrip(const double *in, double *out,
+                            int startGate, int endGate, int nIter);
+  void _applyCompositeFilter(const double *in, double *out,
+                             int nIter, int index);
+  const vector<double> &_getCompositeCoeff(int nIter, int index);
   double _getFirFilterGain();
-  void _computeDbzMax();
   void _computePhidpConditioned();
 
+  /// Compute the max dbz for the gates around each gate,
+  /// using a sliding window max
+
+  void _computeDbzMax();
+  void _pushDbzMax(int jj, int &head, int &tail);
+  void _stepDbzMax(int ii, int &head, int &tail);
+
   /// Compute the folding range by inspecting the phidp data
 
   void _computeFoldingRange();
@@ -669,19 +876,34 @@ private:
 
   void _gateStatesInit();
 
+  /// Tabulate sin and cos of the quantised phidp levels
+
+  void _initSinCosTable();
+
+  /// Tabulate the attenuation corrections against kdp
+
+  void _initAttenTables();
+
   /// To calculate the mean phidp, standard deviation, and jitter
-  /// in phidp at a gate, using stats on the circle
+  /// in phidp at each gate, using stats on the circle.
+  /// Uses running sums, so the cost does not depend on _nGatesStats.
   
-  void _computePhidpStats(int gateNum);
+  void _computePhidpStats();
 
-  // compute sdev of zdr
+  /// Set the phidp stats at a gate from the sums over its kernel
+  
+  void _setPhidpStats(int igate, double count,
+                      double sumxx, double sumyy,
+                      double sumDist, double sumDistSq);
 
-  void _computeZdrSdev(int igate);
+  /// Compute the phidp stats, sdev of zdr and max dbz at each gate,
+  /// in a single pass over the ray
 
-  /// Write ray data to a file
-  
-  void _writeRayDataToFile();
-  double _getPlotVal(double val, double valIfMissing);
+  void _computeRangeStats();
+
+  /// Set the sdev of zdr at a gate from the sums over its kernel
+
+  void _setZdrSdev(int igate, double count, double sum, double sumSq);
 
 };
 
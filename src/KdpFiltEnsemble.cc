@@ -0,0 +1,155 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// KdpFiltEnsemble.cc
+//
+// Compute KDP for a ray with several filter configurations.
+//
+/////////////////////////////////////////////////////////////
+
+#include <cstring>
+#include "KdpFiltEnsemble.hh"
+
+/***********************************************
+ * get an array with room for at least nelem values
+ */
+template <class T>
+static T *reserveArray(TaArray<T> &arr, int nelem)
+{
+  if (arr.size() < nelem) {
+    arr.alloc(nelem);
+  }
+  return arr.buf();
+}
+
+////////////////////////////////////////////////////
+// Constructor
+
+KdpFiltEnsemble::KdpFiltEnsemble()
+
+{
+  _nGates = 0;
+  _kdp = NULL;
+  _psob = NULL;
+  _dbzAttenCorr = NULL;
+  _zdrAttenCorr = NULL;
+}
+
+////////////////////////////////////////////////////
+// Destructor
+
+KdpFiltEnsemble::~KdpFiltEnsemble()
+
+{
+  clearConfigs();
+}
+
+/////////////////////////////////////
+// add a filter configuration
+
+int KdpFiltEnsemble::addConfig(const KdpFilt &config)
+
+{
+  KdpFilt *filt = new KdpFilt();
+  filt->copyFilterParams(config);
+  _configs.push_back(filt);
+  _nFiltIterCondUsed.push_back(0);
+  return (int) _configs.size() - 1;
+}
+
+/////////////////////////////////////
+// remove all the filter configurations
+
+void KdpFiltEnsemble::clearConfigs()
+
+{
+  for (size_t ii = 0; ii < _configs.size(); ii++) {
+    delete _configs[ii];
+  }
+  _configs.clear();
+  _nFiltIterCondUsed.clear();
+}
+
+/////////////////////////////////////
+// compute KDP for each configuration
+
+int KdpFiltEnsemble::compute(time_t timeSecs,
+                             double timeFractionSecs,
+                             double elevDeg,
+                             double azDeg,
+                             double wavelengthCm,
+                             int nGates,
+                             double startRangeKm,
+                             double gateSpacingKm,
+                             const double *snr,
+                             const double *dbz,
+                             const double *zdr,
+                             const double *rhohv,
+                             const double *phidp,
+                             double missingValue)
+
+{
+
+  int nConfigs = (int) _configs.size();
+  if (nConfigs < 1 || nGates < 1) {
+    return -1;
+  }
+
+  _nGates = nGates;
+  int nVals = nConfigs * nGates;
+  _kdp = reserveArray(_kdp_, nVals);
+  _psob = reserveArray(_psob_, nVals);
+  _dbzAttenCorr = reserveArray(_dbzAttenCorr_, nVals);
+  _zdrAttenCorr = reserveArray(_zdrAttenCorr_, nVals);
+
+  // shared stages: set ray details, unfold phidp
+
+  _filt._initRay(timeSecs, timeFractionSecs, elevDeg, azDeg, wavelengthCm,
+                 nGates, startRangeKm, gateSpacingKm,
+                 snr, dbz, zdr, rhohv, phidp, missingValue);
+  bool noValidData = (_filt._unfoldPhidp() != 0);
+  if (noValidData) {
+    _filt._setNoValidData();
+  }
+
+  // filter, compute kdp and finish the ray for each configuration.
+  // These stages write only the filtered phidp and the results,
+  // except psob, which is only set where positive, so is reset.
+
+  size_t nBytes = nGates * sizeof(double);
+  for (int iconfig = 0; iconfig < nConfigs; iconfig++) {
+    if (!noValidData) {
+      _filt.copyFilterParams(*_configs[iconfig]);
+      for (int igate = 0; igate < nGates; igate++) {
+        _filt._psob[igate] = missingValue;
+      }
+      _filt._computeKdp();
+      _filt._finishRay();
+    }
+    int offset = iconfig * nGates;
+    memcpy(_kdp + offset, _filt._kdp, nBytes);
+    memcpy(_psob + offset, _filt._psob, nBytes);
+    memcpy(_dbzAttenCorr + offset, _filt._dbzAttenCorr, nBytes);
+    memcpy(_zdrAttenCorr + offset, _filt._zdrAttenCorr, nBytes);
+    _nFiltIterCondUsed[iconfig] = _filt._nFiltIterCondUsed;
+  }
+
+  return 0;
+
+}
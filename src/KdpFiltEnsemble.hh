@@ -0,0 +1,169 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// KdpFiltEnsemble.hh
+//
+// Compute KDP for a ray with several filter configurations.
+//
+// The stages which do not depend on the filtering, i.e. the
+// folding range, the phidp and zdr kernel stats, finding the
+// valid runs and unfolding phidp, are run once per ray. The
+// filtering of the unfolded phidp, KDP, PSOB and the attenuation
+// corrections are then computed for each configuration in turn.
+//
+/////////////////////////////////////////////////////////////
+
+/**
+ * @file KdpFiltEnsemble.hh
+ * @class KdpFiltEnsemble
+ * @brief Computes KDP for a ray with several filter configurations
+ */
+
+#ifndef KdpFiltEnsemble_hh
+#define KdpFiltEnsemble_hh
+
+#include "KdpFilt.hh"
+
+////////////////////////
+// This class
+
+class KdpFiltEnsemble {
+
+public:
+
+  /**
+   * Constructor
+   */
+  KdpFiltEnsemble();
+
+  /**
+   * Destructor
+   */
+  ~KdpFiltEnsemble();
+
+  /**
+   * Get the object holding the processing options, and which
+   * computes the stages shared by all configurations.
+   * Set the options with the KdpFilt set methods, before compute().
+   * Its filter options are not used. After compute(), the results
+   * of the shared stages, e.g. getPhidpMeanUnfold() and
+   * getValidForKdp(), can be read from it.
+   * @return reference to the options object
+   */
+  KdpFilt &getParams() { return _filt; }
+
+  /**
+   * Add a filter configuration. The options for filtering the
+   * unfolded phidp are copied from config, see
+   * KdpFilt::copyFilterParams(). Its other options are not used.
+   * @param[in] config The object holding the filter options
+   * @return the index of the configuration
+   */
+  int addConfig(const KdpFilt &config);
+
+  /**
+   * Remove all the filter configurations
+   */
+  void clearConfigs();
+
+  /**
+   * Get the number of filter configurations
+   */
+  int getNConfigs() const { return (int) _configs.size(); }
+
+  /**
+   * Compute KDP for a ray, for each filter configuration.
+   * The arguments are as for KdpFilt::compute().
+   * The results for each configuration are the same as for calling
+   * KdpFilt::compute() with the options set on getParams() and the
+   * filter options of that configuration.
+   * @return 0 on success, -1 on failure
+   */
+  int compute(time_t timeSecs,
+              double timeFractionSecs,
+              double elevDeg,
+              double azDeg,
+              double wavelengthCm,
+              int nGates,
+              double startRangeKm,
+              double gateSpacingKm,
+              const double *snr,
+              const double *dbz,
+              const double *zdr,
+              const double *rhohv,
+              const double *phidp,
+              double missingValue);
+
+  /**
+   * Get results for a configuration after calling compute()
+   * @param[in] iconfig The configuration index
+   * @return an array of nGates values
+   */
+  const double *getKdp(int iconfig) const {
+    return _kdp + iconfig * _nGates;
+  }
+  const double *getPsob(int iconfig) const {
+    return _psob + iconfig * _nGates;
+  }
+  const double *getDbzAttenCorr(int iconfig) const {
+    return _dbzAttenCorr + iconfig * _nGates;
+  }
+  const double *getZdrAttenCorr(int iconfig) const {
+    return _zdrAttenCorr + iconfig * _nGates;
+  }
+
+  /**
+   * Get the number of filter iterations applied to the conditioned
+   * phidp for a configuration, see KdpFilt::getNFiltIterCondUsed()
+   * @param[in] iconfig The configuration index
+   * @return the number of iterations
+   */
+  int getNFiltIterCondUsed(int iconfig) const {
+    return _nFiltIterCondUsed[iconfig];
+  }
+
+protected:
+
+private:
+
+  KdpFilt _filt;                /**< Options and workspace */
+  vector<KdpFilt *> _configs;   /**< Filter options of each configuration */
+
+  int _nGates;
+
+  // results, configuration by configuration
+
+  TaArray<double> _kdp_;
+  double *_kdp;
+  TaArray<double> _psob_;
+  double *_psob;
+  TaArray<double> _dbzAttenCorr_;
+  double *_dbzAttenCorr;
+  TaArray<double> _zdrAttenCorr_;
+  double *_zdrAttenCorr;
+  vector<int> _nFiltIterCondUsed;
+
+  // the ensemble holds pointers, so is not copied
+
+  KdpFiltEnsemble(const KdpFiltEnsemble &);
+  KdpFiltEnsemble &operator=(const KdpFiltEnsemble &);
+
+};
+
+#endif
@@ -40,6 +40,10 @@
 #include <functional>
 #include <cerrno>
 #include <cstring>
+#include <cmath>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #if 0
 #include <toolsa/toolsa_macros.h>
 #endif
@@ -109,6 +113,15 @@ NcarParticleId::NcarParticleId()
   _particleList.push_back(_misc1);
   _particleList.push_back(_misc2);
 
+  _tmpTermsNGates = 0;
+  _tmpTermsC = NULL;
+  _tmpMask = NULL;
+  _tmpRowInterest = NULL;
+  _tmpRowWeight = NULL;
+  _eligible = NULL;
+  _eligibleCounts.resize(_particleList.size(), 0);
+  _compileParticles();
+
   // default weights
   
   _tmpWt = 20.0;
@@ -126,6 +139,7 @@ NcarParticleId::NcarParticleId()
   _tmpMaxHtMeters = 0;
   _tmpBottomC = 0;
   _tmpTopC = 0;
+  _tmpUseBins = false;
 
   _snrThreshold = 3.0;
   _snrUpperThreshold = 9999.0; // no thresholding by default
@@ -184,7 +198,14 @@ void NcarParticleId::clear()
 {
 
   _tmpProfile.clear();
-  _tmpHtArray_.free();
+  _tmpSegHtMeters.clear();
+  _tmpSegBaseC.clear();
+  _tmpSegSlope.clear();
+  _tmpBinSeg.clear();
+  _tmpMinHtMeters = 0;
+  _tmpMaxHtMeters = 0;
+  _tmpBottomC = 0;
+  _tmpTopC = 0;
 
 }
 
@@ -197,6 +218,7 @@ int NcarParticleId::readThresholdsFromFile(const string &path)
 {
 
   clear();
+  _tmpTermsNGates = 0;
 
   _thresholdsFilePath = path;
 
@@ -288,6 +310,8 @@ int NcarParticleId::readThresholdsFromFile(const string &path)
   
   fclose(in);
 
+  _compileParticles();
+
   if (!gotWeights) {
     cerr << "ERROR - NcarParticleId::readThresholdsFromFile" << endl;
     cerr << "  No Wts specified in file" << endl;
@@ -318,11 +342,78 @@ double NcarParticleId::getTmpC(double htKm)
     return _tmpTopC;
   }
 
-  int kk = htMeters - _tmpMinHtMeters;
-  return _tmpHtArray[kk];
+  int seg = _findTmpSeg(htMeters);
+  return _tmpSegBaseC[seg] +
+    _tmpSegSlope[seg] * (htMeters - _tmpSegHtMeters[seg]);
 
 }
 
+// get temperatures for an array of heights, walking along the
+// segments while the heights increase, as they do along a beam
+
+void NcarParticleId::getTmpC(const double *htKm, int nHts, double *tmpC)
+
+{
+
+  int seg = 0;
+  for (int ii = 0; ii < nHts; ii++) {
+
+    int htMeters = (int) (htKm[ii] * 1000.0 + 0.5);
+
+    if (htMeters <= _tmpMinHtMeters) {
+      tmpC[ii] = _tmpBottomC;
+      continue;
+    } else if (htMeters >= _tmpMaxHtMeters) {
+      tmpC[ii] = _tmpTopC;
+      continue;
+    }
+
+    if (htMeters < _tmpSegHtMeters[seg]) {
+      // height has decreased, search again
+      seg = _findTmpSeg(htMeters);
+    } else {
+      while (_tmpSegHtMeters[seg + 1] <= htMeters) {
+        seg++;
+      }
+    }
+    tmpC[ii] = _tmpSegBaseC[seg] +
+      _tmpSegSlope[seg] * (htMeters - _tmpSegHtMeters[seg]);
+
+  }
+
+}
+
+// find the segment holding a height, which must be within the
+// profile: the last breakpoint at or below the height
+
+int NcarParticleId::_findTmpSeg(int htMeters) const
+
+{
+
+  if (_tmpUseBins) {
+    int seg = _tmpBinSeg[(htMeters - _tmpMinHtMeters) / TMP_BIN_METERS];
+    while (_tmpSegHtMeters[seg + 1] <= htMeters) {
+      seg++;
+    }
+    return seg;
+  }
+
+  vector<int>::const_iterator it =
+    upper_bound(_tmpSegHtMeters.begin(), _tmpSegHtMeters.end(), htMeters);
+  return (int) (it - _tmpSegHtMeters.begin()) - 1;
+
+}
+
+// use uniform bins to find the segment for a height, instead
+// of a binary search of the breakpoints
+
+void NcarParticleId::setTempLookupBins(bool state)
+
+{
+  _tmpUseBins = state;
+  _computeTempBins();
+}
+
 /////////////////////////////////////////////////////////
 // Initialize the object arrays for later use.
 // Do this if you need access to the arrays, but have not yet called
@@ -376,6 +467,8 @@ void NcarParticleId::initializeArrays(int nGates)
 //   rhohv: correlation coeff
 //   phidp: phase difference
 //   tempC: temperature at each gate, in deg C
+//   sdzdr: optional precomputed std. dev. of zdr, may be NULL
+//   sdphidp: optional precomputed std. dev. of phidp, may be NULL
 //
 // Input fields at a gate should be set to _missingDouble
 // if they are not valid for that gate.
@@ -392,7 +485,9 @@ void NcarParticleId::computePidBeam(int nGates,
                                     const double *ldr,
                                     const double *rhohv,
                                     const double *phidp,
-                                    const double *tempC)
+                                    const double *tempC,
+                                    const double *sdzdr,
+                                    const double *sdphidp)
   
 {
 
@@ -403,6 +498,9 @@ void NcarParticleId::computePidBeam(int nGates,
   for (int ii = 0; ii < (int) _particleList.size(); ii++) {
     _particleList[ii]->allocGateInterest(nGates);
   }
+  for (int ip = 0; ip < _nCmp; ip++) {
+    _cmpGateInterest[ip] = _particleList[_cmpIndex[ip]]->gateInterest;
+  }
 
   // copy input data to local arrays
 
@@ -415,6 +513,10 @@ void NcarParticleId::computePidBeam(int nGates,
   memcpy(_phidp, phidp, nGates * sizeof(double));
   memcpy(_tempC, tempC, nGates * sizeof(double));
 
+  // temperature terms, recomputed only when the temperatures change
+
+  _computeTmpTerms(nGates);
+
   // replace missing LDR values with speficied value, if requested
 
   if (_replaceMissingLdr) {
@@ -455,12 +557,21 @@ void NcarParticleId::computePidBeam(int nGates,
     }
   }
 
-  // compute standard deviations in range
+  // compute standard deviations in range,
+  // unless they have been supplied by the caller
   
-  FilterUtils::computeSdevInRange(_zdr, _sdzdr, nGates,
-                                  _ngatesSdev, _missingDouble);
-  FilterUtils::computeSdevInRange(_phidp, _sdphidp, nGates,
-                                  _ngatesSdev, _missingDouble);
+  if (sdzdr != NULL) {
+    memcpy(_sdzdr, sdzdr, nGates * sizeof(double));
+  } else {
+    FilterUtils::computeSdevInRange(_zdr, _sdzdr, nGates,
+                                    _ngatesSdev, _missingDouble);
+  }
+  if (sdphidp != NULL) {
+    memcpy(_sdphidp, sdphidp, nGates * sizeof(double));
+  } else {
+    FilterUtils::computeSdevInRange(_phidp, _sdphidp, nGates,
+                                    _ngatesSdev, _missingDouble);
+  }
   
   // apply median filter as appropriate
   
@@ -477,25 +588,79 @@ void NcarParticleId::computePidBeam(int nGates,
     FilterUtils::applyMedianFilter(_rhohv, nGates, _rhohvMedianFilterLen);
   }
 
-  // compute PID on all gates
+  // index of the dbz value in the interest map lookup tables,
+  // which is the same for all the maps
 
   for (int igate = 0; igate < nGates; igate++) {
+    _dbzIndex[igate] = PidImapManager::getIndex(_dbz[igate]);
+  }
 
-    // compute pid
+  // particle types within their limits at each gate
+
+  _computeEligibility(nGates);
+
+  // compute PID on all gates
 
-    computePid(_snr[igate], _dbz[igate], 
-               _tempC[igate], _zdr[igate], _kdp[igate],
-               _ldr[igate], _rhohv[igate], _sdzdr[igate], _sdphidp[igate],
-               _pid[igate], _interest[igate], _pid2[igate], _interest2[igate],
-               _confidence[igate]);
+  const double *vals[N_FIELDS];
+  vals[FIELD_ZH] = _dbz;
+  vals[FIELD_TMP] = _tempC;
+  vals[FIELD_ZDR] = _zdr;
+  vals[FIELD_LDR] = _ldr;
+  vals[FIELD_KDP] = _kdp;
+  vals[FIELD_RHV] = _rhohv;
+  vals[FIELD_SDZDR] = _sdzdr;
+  vals[FIELD_SPHI] = _sdphidp;
+
+  // if no LDR, cannot determine second trip
+
+  int skipType = -1;
+  if (fabs(_ldrWt) < 0.0001) {
+    for (int ip = 0; ip < _nCmp; ip++) {
+      if (_particleList[_cmpIndex[ip]] == _trip2) {
+        skipType = ip;
+      }
+    }
+  }
 
-    // save interest value for each particle type
+  for (int igate = 0; igate < nGates; igate++) {
 
-    for (int ii = 0; ii < (int) _particleList.size(); ii++) {
-      _particleList[ii]->gateInterest[igate] =
-        _particleList[ii]->meanWeightedInterest;
+    // compute interest for the eligible particle types, summing the
+    // terms in the same order as Particle::computeInterest()
+
+    int band = _dbzBand[_dbzIndex[igate]];
+    const int *terms = &_cmpTerms[band * _nCmp * N_FIELDS];
+    const int *tmpRows = &_cmpTmpRow[band * _nCmp];
+    unsigned int eligible = _eligible[igate];
+
+    for (int ip = 0; ip < _nCmp; ip++, terms += N_FIELDS) {
+      double meanWeightedInterest = 0.0;
+      if (eligible & (1u << ip)) {
+        _eligibleCounts[_cmpIndex[ip]]++;
+        double sumWeightedInterest = 0.0;
+        double sumWeights = 0.0;
+        _accumTerm(terms[FIELD_ZH], _dbz[igate],
+                   sumWeightedInterest, sumWeights);
+        int tmpIndex = tmpRows[ip] * nGates + igate;
+        sumWeightedInterest += _tmpRowInterest[tmpIndex];
+        sumWeights += _tmpRowWeight[tmpIndex];
+        for (int ifield = FIELD_ZDR; ifield < N_FIELDS; ifield++) {
+          _accumTerm(terms[ifield], vals[ifield][igate],
+                     sumWeightedInterest, sumWeights);
+        }
+        if (sumWeights > 0) {
+          meanWeightedInterest = sumWeightedInterest / sumWeights;
+        }
+      }
+      _cmpInterest[ip] = meanWeightedInterest;
+      _cmpGateInterest[ip][igate] = meanWeightedInterest;
     }
 
+    // compute pid
+
+    _selectPid(_nCmp, &_cmpInterest[0], &_cmpId[0], skipType,
+               _snr[igate], _pid[igate], _interest[igate],
+               _pid2[igate], _interest2[igate], _confidence[igate]);
+
     // set the category
     
     switch (_pid[igate]) {
@@ -560,7 +725,42 @@ void NcarParticleId::computePid(double snr,
     _particleList[ii]->computeInterest(dbz, tempC, zdr, kdp, ldr,
                                        rhohv, sdzdr, sdphidp);
   }
-  
+
+  int nTypes = (int) _particleList.size();
+  vector<double> typeInterest(nTypes);
+  vector<int> typeId(nTypes);
+  int skipType = -1;
+  for (int ii = 0; ii < nTypes; ii++) {
+    typeInterest[ii] = _particleList[ii]->meanWeightedInterest;
+    typeId[ii] = _particleList[ii]->id;
+    if (fabs(_ldrWt) < 0.0001 && _particleList[ii] == _trip2) {
+      // if no LDR, cannot determine second trip
+      skipType = ii;
+    }
+  }
+
+  _selectPid(nTypes, &typeInterest[0], &typeId[0], skipType,
+             snr, pid, interest, pid2, interest2, confidence);
+
+}
+
+/////////////////////////////////////////////////////////
+// find the primary and secondary particle ids from the
+// interest of each particle type
+
+void NcarParticleId::_selectPid(int nTypes,
+                                const double *typeInterest,
+                                const int *typeId,
+                                int skipType,
+                                double snr,
+                                int &pid,
+                                double &interest,
+                                int &pid2,
+                                double &interest2,
+                                double &confidence)
+
+{
+
   // find the particle ID with the max interest
   
   double maxInterest = 0.0;
@@ -569,16 +769,15 @@ void NcarParticleId::computePid(double snr,
   double maxInterest2 = 0.0;
   int idForMax2 = 0;
 
-  for (int ii = (int) _particleList.size() - 1; ii >= 0; ii--) {
-    if (fabs(_ldrWt) < 0.0001 && _particleList[ii] == _trip2) {
-      // if no LDR, cannot determine second trip
+  for (int ii = nTypes - 1; ii >= 0; ii--) {
+    if (ii == skipType) {
       continue;
     }
-    if (_particleList[ii]->meanWeightedInterest > maxInterest) {
+    if (typeInterest[ii] > maxInterest) {
       idForMax2 = idForMax;
       maxInterest2 = maxInterest;
-      idForMax = _particleList[ii]->id;
-      maxInterest = _particleList[ii]->meanWeightedInterest;
+      idForMax = typeId[ii];
+      maxInterest = typeInterest[ii];
     }
   }
 
@@ -609,6 +808,338 @@ void NcarParticleId::computePid(double snr,
 
 }
 
+/////////////////////////////////////////////////////////
+// compute the temperature terms of the interest: the particle
+// types allowed by the temperature at each gate, and the weighted
+// temperature interest and weight of each temperature term.
+// All the rays of a scan normally share a temperature array,
+// so the terms are kept until the temperatures change.
+
+void NcarParticleId::_computeTmpTerms(int nGates)
+
+{
+
+  if (nGates == _tmpTermsNGates &&
+      memcmp(_tmpTermsC, _tempC, nGates * sizeof(double)) == 0) {
+    return;
+  }
+
+  _tmpTermsC = _tmpTermsC_.alloc(nGates);
+  memcpy(_tmpTermsC, _tempC, nGates * sizeof(double));
+
+  _tmpMask = _tmpMask_.alloc(nGates);
+  for (int igate = 0; igate < nGates; igate++) {
+    _tmpMask[igate] = (_nCmp < 32) ? (1u << _nCmp) - 1 : ~0u;
+  }
+  for (int ip = 0; ip < _nCmp; ip++) {
+    int ii = ip * N_FIELDS + FIELD_TMP;
+    if (_cmpLimited[ii]) {
+      const double *vals = _tempC;
+      double rejectVal = _missingDouble;
+      _maskIntervals(nGates, 1, &vals, &_cmpMin[ii], &_cmpMax[ii],
+                     &rejectVal, 1u << ip, _tmpMask);
+    }
+  }
+
+  int nRows = (int) _tmpTermMaps.size();
+  _tmpRowInterest = _tmpRowInterest_.alloc(nRows * nGates);
+  _tmpRowWeight = _tmpRowWeight_.alloc(nRows * nGates);
+  for (int irow = 0; irow < nRows; irow++) {
+    double *interest = _tmpRowInterest + irow * nGates;
+    double *weight = _tmpRowWeight + irow * nGates;
+    for (int igate = 0; igate < nGates; igate++) {
+      interest[igate] = 0.0;
+      weight[igate] = 0.0;
+      _accumTerm(_tmpTermMaps[irow], _tempC[igate],
+                 interest[igate], weight[igate]);
+    }
+  }
+
+  _tmpTermsNGates = nGates;
+
+}
+
+/////////////////////////////////////////////////////////
+// compute the eligible particle types at each gate: those
+// allowed by the temperature, with the other variables within
+// their limits. The limits are checked for the whole beam, one
+// particle type at a time. The gates are counted in computePidBeam().
+
+void NcarParticleId::_computeEligibility(int nGates)
+
+{
+
+  memcpy(_eligible, _tmpMask, nGates * sizeof(unsigned int));
+
+  // the checks of Particle::withinLimits(). LDR may be missing,
+  // and sphi only needs to be present.
+
+  const double *planes[N_FIELDS];
+  planes[FIELD_ZH] = _dbz;
+  planes[FIELD_TMP] = _tempC;
+  planes[FIELD_ZDR] = _zdr;
+  planes[FIELD_LDR] = _ldr;
+  planes[FIELD_KDP] = _kdp;
+  planes[FIELD_RHV] = _rhohv;
+  planes[FIELD_SDZDR] = _sdzdr;
+  planes[FIELD_SPHI] = _sdphidp;
+
+  for (int ip = 0; ip < _nCmp; ip++) {
+    const double *vals[N_FIELDS];
+    double minVals[N_FIELDS], maxVals[N_FIELDS], rejectVals[N_FIELDS];
+    int nChecks = 0;
+    for (int ifield = 0; ifield < N_FIELDS; ifield++) {
+      int ii = ip * N_FIELDS + ifield;
+      if (ifield == FIELD_TMP || !_cmpLimited[ii]) {
+        continue;
+      }
+      vals[nChecks] = planes[ifield];
+      minVals[nChecks] = _cmpMin[ii];
+      maxVals[nChecks] = _cmpMax[ii];
+      rejectVals[nChecks] = (ifield == FIELD_LDR) ? NAN : _missingDouble;
+      nChecks++;
+    }
+    _maskIntervals(nGates, nChecks, vals, minVals, maxVals, rejectVals,
+                   1u << ip, _eligible);
+  }
+
+}
+
+/////////////////////////////////////////////////////////
+// clear a bit in a mask where any value is outside its interval.
+// A value is outside if it is below the minimum or above the
+// maximum, so NaN is inside as in Particle::withinLimits().
+
+void NcarParticleId::_maskIntervals(int nGates,
+                                    int nChecks,
+                                    const double * const *vals,
+                                    const double *minVals,
+                                    const double *maxVals,
+                                    const double *rejectVals,
+                                    unsigned int bit,
+                                    unsigned int *mask)
+
+{
+
+  if (nChecks == 0) {
+    return;
+  }
+
+  int igate = 0;
+
+#ifdef __SSE2__
+  for (; igate < nGates - 1; igate += 2) {
+    __m128d reject = _mm_setzero_pd();
+    for (int ii = 0; ii < nChecks; ii++) {
+      __m128d vv = _mm_loadu_pd(vals[ii] + igate);
+      reject = _mm_or_pd(reject, _mm_cmplt_pd(vv, _mm_set1_pd(minVals[ii])));
+      reject = _mm_or_pd(reject, _mm_cmpgt_pd(vv, _mm_set1_pd(maxVals[ii])));
+      reject = _mm_or_pd(reject, _mm_cmpeq_pd(vv, _mm_set1_pd(rejectVals[ii])));
+    }
+    unsigned int bits = (unsigned int) _mm_movemask_pd(reject);
+    mask[igate] &= ~(bit & (0u - (bits & 1u)));
+    mask[igate + 1] &= ~(bit & (0u - (bits >> 1)));
+  }
+#endif
+
+  for (; igate < nGates; igate++) {
+    unsigned int reject = 0;
+    for (int ii = 0; ii < nChecks; ii++) {
+      double vv = vals[ii][igate];
+      reject |= ((vv < minVals[ii]) | (vv > maxVals[ii]) |
+                 (vv == rejectVals[ii]));
+    }
+    mask[igate] &= ~(bit & (0u - reject));
+  }
+
+}
+
+/////////////////////////////////////////////////////////
+// build the compiled particle table.
+//
+// For each particle type, each dbz lookup index and each variable,
+// the term of the interest sum is a map descriptor: a map, or zero
+// interest with a weight, as in PidImapManager::accumWeightedInterest().
+// The dbz indices are grouped into bands over which no term changes,
+// so the terms are stored by band.
+
+void NcarParticleId::_compileParticles()
+
+{
+
+  int nLut = PidImapManager::getNLut();
+  map<const PidInterestMap*, int> descs;
+  map<double, int> zeroDescs;
+
+  _cmpMaps.clear();
+  _cmpIndex.clear();
+  _cmpId.clear();
+  _cmpLimited.clear();
+  _cmpMin.clear();
+  _cmpMax.clear();
+
+  // terms of each particle type kept, by dbz index
+
+  vector<int> lutTerms;
+
+  for (int ii = 0; ii < (int) _particleList.size(); ii++) {
+
+    const Particle *part = _particleList[ii];
+    if (part->_imaps.empty()) {
+      // no weights read
+      continue;
+    }
+    const PidImapManager *imaps[N_FIELDS];
+    part->getImapsInSumOrder(imaps);
+
+    // terms, keeping the particle type only if one has an interest map
+
+    vector<int> terms(nLut * N_FIELDS);
+    bool hasMap = false;
+    for (int jj = 0; jj < nLut; jj++) {
+      for (int ifield = 0; ifield < N_FIELDS; ifield++) {
+        int desc = _compileTerm(imaps[ifield], jj, descs, zeroDescs);
+        terms[jj * N_FIELDS + ifield] = desc;
+        if (desc >= 0 && _cmpMaps[desc].weightedLut != NULL) {
+          hasMap = true;
+        }
+      }
+    }
+    if (!hasMap) {
+      continue;
+    }
+
+    _cmpIndex.push_back(ii);
+    _cmpId.push_back(part->id);
+    lutTerms.insert(lutTerms.end(), terms.begin(), terms.end());
+
+    double minVals[N_FIELDS] = { part->minZh, part->minTmp, part->minZdr,
+                                 part->minLdr, part->minKdp, part->minRhv,
+                                 part->minSdZdr, -1.0e99 };
+    double maxVals[N_FIELDS] = { part->maxZh, part->maxTmp, part->maxZdr,
+                                 part->maxLdr, part->maxKdp, part->maxRhv,
+                                 part->maxSdZdr, 1.0e99 };
+    for (int ifield = 0; ifield < N_FIELDS; ifield++) {
+      _cmpLimited.push_back(imaps[ifield]->getWeight() > 0);
+      _cmpMin.push_back(minVals[ifield]);
+      _cmpMax.push_back(maxVals[ifield]);
+    }
+
+  } // ii
+
+  _nCmp = (int) _cmpIndex.size();
+  _cmpGateInterest.assign(_nCmp, (double *) NULL);
+  _cmpInterest.assign(_nCmp, 0.0);
+
+  // group the dbz indices into bands with the same terms
+
+  _dbzBand.assign(nLut, 0);
+  _cmpTerms.clear();
+  _nBands = 0;
+  for (int jj = 0; jj < nLut; jj++) {
+    bool same = (jj > 0);
+    for (int ip = 0; same && ip < _nCmp; ip++) {
+      const int *terms = &lutTerms[(ip * nLut + jj) * N_FIELDS];
+      same = equal(terms, terms + N_FIELDS, terms - N_FIELDS);
+    }
+    if (!same) {
+      for (int ip = 0; ip < _nCmp; ip++) {
+        const int *terms = &lutTerms[(ip * nLut + jj) * N_FIELDS];
+        _cmpTerms.insert(_cmpTerms.end(), terms, terms + N_FIELDS);
+      }
+      _nBands++;
+    }
+    _dbzBand[jj] = _nBands - 1;
+  }
+  if (_nBands == 0) {
+    // no particle types, a single empty band
+    _nBands = 1;
+  }
+
+  // a row of temperature terms for each distinct temperature term
+
+  _tmpTermMaps.clear();
+  _cmpTmpRow.assign(_nBands * _nCmp, 0);
+  for (int ii = 0; ii < (int) _cmpTmpRow.size(); ii++) {
+    int desc = _cmpTerms[ii * N_FIELDS + FIELD_TMP];
+    vector<int>::iterator it =
+      find(_tmpTermMaps.begin(), _tmpTermMaps.end(), desc);
+    _cmpTmpRow[ii] = (int) (it - _tmpTermMaps.begin());
+    if (it == _tmpTermMaps.end()) {
+      _tmpTermMaps.push_back(desc);
+    }
+  }
+
+  // the temperature terms need computing again
+
+  _tmpTermsNGates = 0;
+
+}
+
+/////////////////////////////////////////////////////////
+// get the map descriptor for a term, adding it if it is new.
+// Returns -1 if the term adds nothing.
+
+int NcarParticleId::_compileTerm(const PidImapManager *imap, int dbzIndex,
+                                 map<const PidInterestMap*, int> &descs,
+                                 map<double, int> &zeroDescs)
+
+{
+
+  double weight = imap->getWeight();
+  if (fabs(weight) < 0.0001) {
+    return -1;
+  }
+
+  const PidInterestMap *imp = imap->getMap(dbzIndex);
+  if (imp == NULL) {
+    // zero interest, with the weight
+    map<double, int>::iterator it = zeroDescs.find(weight);
+    if (it != zeroDescs.end()) {
+      return it->second;
+    }
+    map_desc_t md;
+    md.weightedLut = NULL;
+    md.minVal = 0.0;
+    md.dVal = 0.0;
+    md.weight = weight;
+    md.missingVal = 0.0;
+    md.nLut = 0;
+    _cmpMaps.push_back(md);
+    zeroDescs[weight] = (int) _cmpMaps.size() - 1;
+    return (int) _cmpMaps.size() - 1;
+  }
+
+  if (!imp->isLoaded() || fabs(imp->getWeight()) < 0.001) {
+    return -1;
+  }
+
+  map<const PidInterestMap*, int>::iterator it = descs.find(imp);
+  if (it != descs.end()) {
+    return it->second;
+  }
+  map_desc_t md;
+  md.weightedLut = imp->getWeightedLut();
+  md.minVal = imp->getMinVal();
+  md.dVal = imp->getDVal();
+  md.weight = imp->getWeight();
+  md.missingVal = imp->getMissingDouble();
+  md.nLut = PidInterestMap::getNLut();
+  _cmpMaps.push_back(md);
+  descs[imp] = (int) _cmpMaps.size() - 1;
+  return (int) _cmpMaps.size() - 1;
+
+}
+
+/////////////////////////////////////////////////////////
+// reset the eligibility counts
+
+void NcarParticleId::resetEligibleCounts()
+
+{
+  _eligibleCounts.assign(_particleList.size(), 0);
+}
+
 /////////////////////////
 // allocate local arrays
 
@@ -618,6 +1149,8 @@ void NcarParticleId::_allocArrays(int nGates)
   
   _snr = _snr_.alloc(nGates);
   _dbz = _dbz_.alloc(nGates);
+  _dbzIndex = _dbzIndex_.alloc(nGates);
+  _eligible = _eligible_.alloc(nGates);
   _zdr = _zdr_.alloc(nGates);
   _kdp = _kdp_.alloc(nGates);
   _ldr = _ldr_.alloc(nGates);
@@ -712,45 +1245,86 @@ int NcarParticleId::_setTempProfile(const char *line)
 
 /////////////////////////////////////////////////////
 // compute temperature/ht lookup 
+//
+// The profile points, rounded to the meter, are the breakpoints
+// of a table of segments, each with its base temperature and
+// gradient per meter. Points which do not ascend are skipped.
 
 void NcarParticleId::_computeTempHtLookup()
   
 {
 
-  _tmpMinHtMeters =
-    (int) (_tmpProfile[0].htKm * 1000.0 + 0.5);
-  _tmpMaxHtMeters =
-    (int) (_tmpProfile[_tmpProfile.size()-1].htKm * 1000.0 + 0.5);
+  _tmpSegHtMeters.clear();
+  _tmpSegBaseC.clear();
+  _tmpSegSlope.clear();
 
-  _tmpBottomC = _tmpProfile[0].tmpC;
-  _tmpTopC = _tmpProfile[_tmpProfile.size()-1].tmpC;
+  if (_tmpProfile.size() == 0) {
+    _tmpMinHtMeters = 0;
+    _tmpMaxHtMeters = 0;
+    _tmpBottomC = 0;
+    _tmpTopC = 0;
+    _computeTempBins();
+    return;
+  }
 
-  // fill out temp array, every meter
+  _tmpSegHtMeters.push_back((int) (_tmpProfile[0].htKm * 1000.0 + 0.5));
+  _tmpSegBaseC.push_back(_tmpProfile[0].tmpC);
 
-  int nHt = (_tmpMaxHtMeters - _tmpMinHtMeters) + 1;
-  _tmpHtArray_.free();
-  _tmpHtArray = _tmpHtArray_.alloc(nHt);
-  
   for (int ii = 1; ii < (int) _tmpProfile.size(); ii++) {
 
-    int minHtMeters = (int) (_tmpProfile[ii-1].htKm * 1000.0 + 0.5);
-    double minTmp = _tmpProfile[ii-1].tmpC;
+    int minHtMeters = _tmpSegHtMeters.back();
+    double minTmp = _tmpSegBaseC.back();
 
     int maxHtMeters = (int) (_tmpProfile[ii].htKm * 1000.0 + 0.5);
     double maxTmp = _tmpProfile[ii].tmpC;
+    if (maxHtMeters <= minHtMeters) {
+      continue;
+    }
 
     double deltaMeters = maxHtMeters - minHtMeters;
     double deltaTmp = maxTmp - minTmp;
-    double gradient = deltaTmp / deltaMeters;
-    double tmp = minTmp;
-    int kk = minHtMeters - _tmpMinHtMeters;
-    
-    for (int jj = minHtMeters; jj <= maxHtMeters; jj++, kk++, tmp += gradient) {
-      if (kk >= 0 && kk < nHt) {
-	_tmpHtArray[kk] = tmp;
-      }
-    }
+    _tmpSegSlope.push_back(deltaTmp / deltaMeters);
+
+    _tmpSegHtMeters.push_back(maxHtMeters);
+    _tmpSegBaseC.push_back(maxTmp);
+
+  }
+
+  // the last breakpoint is the top of the profile
+
+  _tmpSegSlope.push_back(0.0);
+
+  _tmpMinHtMeters = _tmpSegHtMeters.front();
+  _tmpMaxHtMeters = _tmpSegHtMeters.back();
+  _tmpBottomC = _tmpSegBaseC.front();
+  _tmpTopC = _tmpSegBaseC.back();
+
+  _computeTempBins();
+
+}
+
+/////////////////////////////////////////////////////
+// compute the segment at the base of each uniform bin
+
+void NcarParticleId::_computeTempBins()
+  
+{
 
+  _tmpBinSeg.clear();
+  if (!_tmpUseBins || _tmpSegHtMeters.size() < 2) {
+    return;
+  }
+
+  int nBins = (_tmpMaxHtMeters - _tmpMinHtMeters) / TMP_BIN_METERS + 1;
+  _tmpBinSeg.resize(nBins);
+  int seg = 0;
+  int lastSeg = (int) _tmpSegHtMeters.size() - 2;
+  for (int ii = 0; ii < nBins; ii++) {
+    int htMeters = _tmpMinHtMeters + ii * TMP_BIN_METERS;
+    while (seg < lastSeg && _tmpSegHtMeters[seg + 1] <= htMeters) {
+      seg++;
+    }
+    _tmpBinSeg[ii] = seg;
   }
 
 }
@@ -1011,11 +1585,13 @@ void NcarParticleId::fillTempArray(double radarHtKm,
   if (setPseudoRadiusRatio) {
     beamHt.setPseudoRadiusRatio(pseudoRadiusRatio);
   }
+  TaArray<double> htKm_;
+  double *htKm = htKm_.alloc(nGates);
   double rangeKm = startRangeKm;
   for (int ii = 0; ii < nGates; ii++, rangeKm += gateSpacingKm) {
-    double htKm = beamHt.computeHtKm(elevDeg, rangeKm);
-    tempC[ii] = getTmpC(htKm);
+    htKm[ii] = beamHt.computeHtKm(elevDeg, rangeKm);
   }
+  getTmpC(htKm, nGates, tempC);
 
 }
     
@@ -1083,6 +1659,8 @@ NcarParticleId::Particle::Particle(const string &lbl, const string desc,
   sumWeights = 0.0;
   meanWeightedInterest = 0.0;
 
+  gateInterest = NULL;
+
 }
 
 /////////////////////////////////////////////////////////
@@ -1205,80 +1783,134 @@ void NcarParticleId::Particle::computeInterest(double dbz,
 
   // check limits
 
-  if (_imapZh->getWeight() > 0) {
-    if (dbz == _missingDouble) {
-      return;
-    } else if (dbz < minZh || dbz > maxZh) {
-      return;
-    }
+  if (!tmpAllowed(tempC) ||
+      !withinLimits(dbz, zdr, kdp, ldr, rhohv, sdzdr, sdphidp)) {
+    return;
   }
-  
+
+  // all the maps are selected with the same dbz index
+
+  int dbzIndex = PidImapManager::getIndex(dbz);
+      
+  _imapZh->accumWeightedInterestIndex(dbzIndex, dbz, sumWeightedInterest, sumWeights);
+  _imapTmp->accumWeightedInterestIndex(dbzIndex, tempC, sumWeightedInterest, sumWeights);
+  _imapZdr->accumWeightedInterestIndex(dbzIndex, zdr, sumWeightedInterest, sumWeights);
+  _imapLdr->accumWeightedInterestIndex(dbzIndex, ldr, sumWeightedInterest, sumWeights);
+  _imapKdp->accumWeightedInterestIndex(dbzIndex, kdp, sumWeightedInterest, sumWeights);
+  _imapRhohv->accumWeightedInterestIndex(dbzIndex, rhohv, sumWeightedInterest, sumWeights);
+  _imapSdZdr->accumWeightedInterestIndex(dbzIndex, sdzdr, sumWeightedInterest, sumWeights);
+  _imapSdPhidp->accumWeightedInterestIndex(dbzIndex, sdphidp, sumWeightedInterest, sumWeights);
+  if (sumWeights > 0) {
+    meanWeightedInterest = sumWeightedInterest / sumWeights;
+  }
+
+}
+
+/////////////////////////////////////////////////////////
+// check temperature limit
+
+bool NcarParticleId::Particle::tmpAllowed(double tempC) const
+
+{
+
   if (_imapTmp->getWeight() > 0) {
     if (tempC == _missingDouble) {
-      return;
+      return false;
     } else if (tempC < minTmp || tempC > maxTmp) {
-      return;
+      return false;
     }
   }
 
+  return true;
+
+}
+
+/////////////////////////////////////////////////////////
+// check limits of the other variables
+
+bool NcarParticleId::Particle::withinLimits(double dbz,
+					    double zdr,
+					    double kdp,
+					    double ldr,
+					    double rhohv,
+					    double sdzdr,
+					    double sdphidp) const
+
+{
+
+  if (_imapZh->getWeight() > 0) {
+    if (dbz == _missingDouble) {
+      return false;
+    } else if (dbz < minZh || dbz > maxZh) {
+      return false;
+    }
+  }
+  
   if (_imapZdr->getWeight() > 0) {
     if (zdr == _missingDouble) {
-      return;
+      return false;
     } else if (zdr < minZdr || zdr > maxZdr) {
-      return;
+      return false;
     }
   }
 
   if (_imapLdr->getWeight() > 0) {
     if (ldr < minLdr || ldr > maxLdr) {
-      return;
+      return false;
     }
   }
 
   if (_imapKdp->getWeight() > 0) {
     if (kdp == _missingDouble) {
-      return;
+      return false;
     }
     if (kdp < minKdp || kdp > maxKdp) {
-      return;
+      return false;
     }
   }
 
   if (_imapRhohv->getWeight() > 0) {
     if (rhohv == _missingDouble) {
-      return;
+      return false;
     }
     if (rhohv < minRhv || rhohv > maxRhv) {
-      return;
+      return false;
     }
   }
   
   if (_imapSdZdr->getWeight() > 0) {
     if (sdzdr == _missingDouble) {
-      return;
+      return false;
     } else if (sdzdr < minSdZdr || sdzdr > maxSdZdr) {
-      return;
+      return false;
     }
   }
 
   if (_imapSdPhidp->getWeight() > 0) {
     if (sdphidp == _missingDouble) {
-      return;
+      return false;
     }
   }
-      
-  _imapZh->accumWeightedInterest(dbz, dbz, sumWeightedInterest, sumWeights);
-  _imapTmp->accumWeightedInterest(dbz, tempC, sumWeightedInterest, sumWeights);
-  _imapZdr->accumWeightedInterest(dbz, zdr, sumWeightedInterest, sumWeights);
-  _imapLdr->accumWeightedInterest(dbz, ldr, sumWeightedInterest, sumWeights);
-  _imapKdp->accumWeightedInterest(dbz, kdp, sumWeightedInterest, sumWeights);
-  _imapRhohv->accumWeightedInterest(dbz, rhohv, sumWeightedInterest, sumWeights);
-  _imapSdZdr->accumWeightedInterest(dbz, sdzdr, sumWeightedInterest, sumWeights);
-  _imapSdPhidp->accumWeightedInterest(dbz, sdphidp, sumWeightedInterest, sumWeights);
-  if (sumWeights > 0) {
-    meanWeightedInterest = sumWeightedInterest / sumWeights;
-  }
 
+  return true;
+
+}
+
+/////////////////////////////////////////////////////////
+// get the interest map managers in the order in which
+// computeInterest() sums the terms
+
+void NcarParticleId::Particle::getImapsInSumOrder(const PidImapManager *imaps[8]) const
+
+{
+  imaps[0] = _imapZh;
+  imaps[1] = _imapTmp;
+  imaps[2] = _imapZdr;
+  imaps[3] = _imapLdr;
+  imaps[4] = _imapKdp;
+  imaps[5] = _imapRhohv;
+  imaps[6] = _imapSdZdr;
+  imaps[7] = _imapSdPhidp;
 }
 
 /////////////////////////////////////////////////////////
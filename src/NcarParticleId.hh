@@ -42,6 +42,7 @@
 
 #include <string>
 #include <vector>
+#include <map>
 #include "TaArray.hh"
 #include "PidImapManager.hh"
 using namespace std;
@@ -171,6 +172,26 @@ public:
 			 double sdzdr,
 			 double sdphidp);
 
+    /**
+     * Check a temperature against the limits for this particle type
+     * @param[in] tempC The temperature
+     * @return true if the temperature does not exclude this particle type
+     */
+    bool tmpAllowed(double tempC) const;
+
+    /**
+     * Check the other radar variables against the limits for this
+     * particle type
+     * @return true if the values do not exclude this particle type
+     */
+    bool withinLimits(double dbz,
+		      double zdr,
+		      double kdp,
+		      double ldr,
+		      double rhohv,
+		      double sdzdr,
+		      double sdphidp) const;
+
     /**
      * Print the thresholds and interest maps for this particle type
      * @param[out] out The stream to print to
@@ -230,6 +251,14 @@ public:
     TaArray<double> gateInterest_; /**< Array for storing interest value at each gate */
     double *gateInterest;          /**< Pointer to the gate interest array */
 
+    /**
+     * Get the interest map managers in the order in which their
+     * interest is summed
+     * @param[out] imaps The managers for zh, tmp, zdr, ldr, kdp, rhv,
+     *   sdzdr and sphi
+     */
+    void getImapsInSumOrder(const PidImapManager *imaps[8]) const;
+
   };
 
   //////////////////////////
@@ -321,6 +350,12 @@ public:
    */
   void setSnrThresholdDb(double val) { _snrThreshold = val; }
 
+  /**
+   * Get the SNR threshold for censoring
+   * @return The threshold in dB
+   */
+  double getSnrThresholdDb() const { return _snrThreshold; }
+
   /**
    * Set the upper SNR threshold for flagging
    * @param[in] dB - the threshold in Db, gates above this are flagged
@@ -396,6 +431,12 @@ public:
     _ngatesSdev = ngates;
   }
 
+  /**
+   * Get number of gates for computing standard deviation
+   * @return Number of gates for computing standard deviation
+   */
+  int getNgatesSdev() const { return _ngatesSdev; }
+
   /**
    * Set minimum valid interest value
    * If interest value is below this threshold, the pid value is
@@ -428,6 +469,23 @@ public:
    */
   double getTmpC(double htKm);
 
+  /**
+   * Get temperatures for an array of heights. Fastest when the
+   * heights increase, as along a radar beam.
+   * @param[in] htKm The heights (in km)
+   * @param[in] nHts The number of heights
+   * @param[out] tmpC The temperatures (C)
+   */
+  void getTmpC(const double *htKm, int nHts, double *tmpC);
+
+  /**
+   * Set whether to find the profile segment for a height with
+   * uniform bins of TMP_BIN_METERS, instead of a binary search of
+   * the profile points. Worthwhile for profiles with many points.
+   * @param[in] state true to use the bins
+   */
+  void setTempLookupBins(bool state);
+
   /**
    * Initialize the object arrays for later use.
    * Do this if you need access to the arrays, but have not yet called
@@ -451,6 +509,11 @@ public:
    * @param[in] rhohv Correlation coeff array
    * @param[in] phidp Phase difference array
    * @param[in] tempC Temperature at each gate, in deg C
+   * @param[in] sdzdr Optional precomputed std. dev. of zdr, for example
+   *   from a 2-D texture computed over the scan. If NULL, it is
+   *   computed in range from zdr over _ngatesSdev gates.
+   * @param[in] sdphidp Optional precomputed std. dev. of phidp. If NULL,
+   *   it is computed in range from phidp over _ngatesSdev gates.
    */ 
   void computePidBeam(int nGates,
                       const double *snr,
@@ -460,7 +523,9 @@ public:
                       const double *ldr,
                       const double *rhohv,
                       const double *phidp,
-                      const double *tempC);
+                      const double *tempC,
+                      const double *sdzdr = NULL,
+                      const double *sdphidp = NULL);
   
   /**
    * Compute PID for a single gate, and related interest value.
@@ -633,6 +698,20 @@ public:
   const Particle *getParticleMisc1() const { return _misc1; }
   const Particle *getParticleMisc2() const { return _misc2; }
   
+  /**
+   * Get the number of gates at which each particle type was eligible,
+   * i.e. within all of its limits so that its interest was evaluated,
+   * accumulated by computePidBeam() since the last call to
+   * resetEligibleCounts()
+   * @return The counts, in the order of getParticleList()
+   */
+  const vector<long> &getEligibleCounts() const { return _eligibleCounts; }
+
+  /**
+   * Reset the eligibility counts to zero
+   */
+  void resetEligibleCounts();
+
   /**
    * Print status 
    * @param[out] out The stream to print to
@@ -662,6 +741,7 @@ public:
                      double *tempC);
 
   const static double pseudoEarthDiamKm; /**< pseudo earth diameter - for computing radar beam heights */
+  const static int TMP_BIN_METERS = 10; /**< bin size for the temperature lookup (m) */
 
 protected:
 private:
@@ -694,10 +774,84 @@ private:
 
   vector<Particle*> _particleList;  /**< A vector of pointers to Particle objects, one for each possible particle type */
 
+  // compiled particle table, built from _particleList by
+  // _compileParticles() once the thresholds have been read, and used by
+  // computePidBeam(). Particle types without any interest map, or with
+  // zero weights, always have zero interest and are left out. Arrays
+  // by particle are indexed by position in the table, p below.
+
+  /**
+   * @struct map_desc_t
+   *   A term of the interest sum: an interest map, or zero interest
+   *   with a weight, for dbz values without a map
+   */
+  typedef struct {
+    const double *weightedLut; /**< Weighted interest lookup table, NULL for zero interest */
+    double minVal;             /**< Value of the first table entry */
+    double dVal;               /**< Value resolution of the table */
+    double weight;             /**< Weight added with the interest */
+    double missingVal;         /**< Value for missing data, which adds nothing */
+    int nLut;                  /**< Number of table entries */
+  } map_desc_t;
+
+  /**
+   * The radar variables, in the order in which interest is summed
+   */
+  typedef enum {
+    FIELD_ZH,
+    FIELD_TMP,
+    FIELD_ZDR,
+    FIELD_LDR,
+    FIELD_KDP,
+    FIELD_RHV,
+    FIELD_SDZDR,
+    FIELD_SPHI,
+    N_FIELDS
+  } field_t;
+
+  int _nCmp;                      /**< Number of particle types in the table */
+  vector<int> _cmpIndex;          /**< [p] index in _particleList */
+  vector<int> _cmpId;             /**< [p] particle id */
+  vector<bool> _cmpLimited;       /**< [p][field] limits apply, when the field weight is positive */
+  vector<double> _cmpMin;         /**< [p][field] minimum allowed value */
+  vector<double> _cmpMax;         /**< [p][field] maximum allowed value */
+  vector<map_desc_t> _cmpMaps;    /**< Map descriptors of the terms */
+  vector<int> _dbzBand;           /**< Band of each dbz lookup index. The maps
+                                       of all particle types are the same across a band */
+  int _nBands;                    /**< Number of dbz bands */
+  vector<int> _cmpTerms;          /**< [band][p][field] map descriptor of each term, -1 for none */
+  vector<int> _tmpTermMaps;       /**< Map descriptor of each temperature term row, -1 for none */
+  vector<int> _cmpTmpRow;         /**< [band][p] temperature term row */
+  vector<double*> _cmpGateInterest; /**< [p] gate interest array of the particle type */
+  vector<double> _cmpInterest;    /**< [p] interest at the current gate */
+
+  // temperature terms of the interest, computed once for each
+  // temperature array, normally once per scan
+
+  int _tmpTermsNGates;            /**< Number of gates of the temperature terms, 0 if not computed */
+  TaArray<double> _tmpTermsC_;    /**< Temperatures the terms were computed for */
+  double *_tmpTermsC;             /**< Pointer to the temperatures the terms were computed for */
+  TaArray<unsigned int> _tmpMask_; /**< Particle types allowed by the temperature at each gate, bit p */
+  unsigned int *_tmpMask;         /**< Pointer to the array of allowed particle types */
+  TaArray<double> _tmpRowInterest_; /**< [row][gate] weighted temperature interest */
+  double *_tmpRowInterest;        /**< Pointer to the weighted temperature interest */
+  TaArray<double> _tmpRowWeight_; /**< [row][gate] temperature weight */
+  double *_tmpRowWeight;          /**< Pointer to the temperature weights */
+
+  // eligibility of each particle type at each gate of a beam, within the
+  // limits of all the variables, bit p
+
+  TaArray<unsigned int> _eligible_; /**< Array of eligible particle types */
+  unsigned int *_eligible;          /**< Pointer to the array of eligible particle types */
+  vector<long> _eligibleCounts;     /**< Number of eligible gates of each particle type */
+
   // temperature profile
   vector<TmpPoint> _tmpProfile; /**< Temperature profile */
-  TaArray<double> _tmpHtArray_; /**< Array of temperature profile heights */
-  double *_tmpHtArray;          /**< Pointer to the array of temperature profile heights */
+  vector<int> _tmpSegHtMeters;  /**< Breakpoint heights of the temperature segments (m) */
+  vector<double> _tmpSegBaseC;  /**< Temperature at each breakpoint */
+  vector<double> _tmpSegSlope;  /**< Temperature gradient above each breakpoint (C/m) */
+  bool _tmpUseBins;             /**< Find segments with uniform bins */
+  vector<int> _tmpBinSeg;       /**< Segment at the base of each uniform bin */
 
   int _tmpMinHtMeters;          /**< Mimimum height of the temperature profile (m) */
   int _tmpMaxHtMeters;          /**< Maximum height of the temperature profile (m) */
@@ -722,6 +876,9 @@ private:
   
   TaArray<double> _dbz_;   /**< Array of censored, filtered dbz values */
   double *_dbz;            /**< Pointer to the array of censored, filtered dbz values */
+
+  TaArray<int> _dbzIndex_; /**< Array of interest map lookup table indices of the dbz values */
+  int *_dbzIndex;          /**< Pointer to the array of dbz lookup table indices */
   
   TaArray<double> _zdr_;   /**< Array of censored, filtered zdr values */
   double *_zdr;            /**< Pointer to the array of censored, filtered zdr values */
@@ -811,6 +968,117 @@ private:
 
   void _allocArrays(int nGates);
 
+  /**
+   * Build the compiled particle table from the particle types
+   */
+  void _compileParticles();
+
+  /**
+   * Get the map descriptor for a term of the interest sum
+   * @param[in] imap The interest map manager
+   * @param[in] dbzIndex The dbz lookup index
+   * @param[in,out] descs The descriptors of maps already used
+   * @param[in,out] zeroDescs The descriptors of zero interest already used,
+   *   by weight
+   * @return the descriptor, or -1 if the term adds nothing
+   */
+  int _compileTerm(const PidImapManager *imap, int dbzIndex,
+                   map<const PidInterestMap*, int> &descs,
+                   map<double, int> &zeroDescs);
+
+  /**
+   * Add a term of the interest sum
+   * @param[in] desc The map descriptor, or -1 for none
+   * @param[in] val The value of the radar variable
+   * @param[in,out] sumWtInterest The accumulated weighted interest
+   * @param[in,out] sumWt The accumulated weights
+   */
+  inline void _accumTerm(int desc, double val,
+                         double &sumWtInterest, double &sumWt) const {
+    if (desc < 0) {
+      return;
+    }
+    const map_desc_t &md = _cmpMaps[desc];
+    if (md.weightedLut == NULL) {
+      sumWtInterest += 0.0;
+      sumWt += md.weight;
+      return;
+    }
+    if (val == md.missingVal) {
+      return;
+    }
+    int index = (int) floor((val - md.minVal) / md.dVal + 0.5);
+    if (index < 0) {
+      index = 0;
+    } else if (index > md.nLut - 1) {
+      index = md.nLut - 1;
+    }
+    sumWtInterest += md.weightedLut[index];
+    sumWt += md.weight;
+  }
+
+  /**
+   * Clear a bit in a mask at each gate where any of a set of values
+   * is outside its interval, or equal to a rejected value. The
+   * comparisons are made two gates at a time with SSE2 where it
+   * is available, without branches.
+   * @param[in] nGates The number of gates
+   * @param[in] nChecks The number of intervals
+   * @param[in] vals The values for each interval, at each gate
+   * @param[in] minVals The minimum value of each interval
+   * @param[in] maxVals The maximum value of each interval
+   * @param[in] rejectVals A value rejected for each interval, NaN for none
+   * @param[in] bit The bit to clear
+   * @param[in,out] mask The mask at each gate
+   */
+  static void _maskIntervals(int nGates,
+                             int nChecks,
+                             const double * const *vals,
+                             const double *minVals,
+                             const double *maxVals,
+                             const double *rejectVals,
+                             unsigned int bit,
+                             unsigned int *mask);
+
+  /**
+   * Compute the temperature terms for the temperatures in _tempC,
+   * unless they were computed for the same temperatures
+   * @param[in] nGates The number of gates
+   */
+  void _computeTmpTerms(int nGates);
+
+  /**
+   * Compute the eligible particle types at each gate, from the
+   * temperature mask and the limits of the other variables
+   * @param[in] nGates The number of gates
+   */
+  void _computeEligibility(int nGates);
+
+  /**
+   * Find the primary and secondary particle ids from the interest
+   * computed for each particle type
+   * @param[in] nTypes The number of particle types
+   * @param[in] typeInterest The interest of each particle type
+   * @param[in] typeId The id of each particle type
+   * @param[in] skipType A particle type to leave out, -1 for none
+   * @param[in] snr The snr at the gate
+   * @param[out] pid The primary particle id
+   * @param[out] interest The interest level of the primary particle
+   * @param[out] pid2 The secondary particle id
+   * @param[out] interest2 The interest level of the secondary particle
+   * @param[out] confidence The confidence of the identification
+   */
+  void _selectPid(int nTypes,
+                  const double *typeInterest,
+                  const int *typeId,
+                  int skipType,
+                  double snr,
+                  int &pid,
+                  double &interest,
+                  int &pid2,
+                  double &interest2,
+                  double &confidence);
+
   /**
    * Set the particle ID from a line in the thresholds file 
    * @param[out] part The particle whose ID will be set
@@ -827,10 +1095,22 @@ private:
   int _setTempProfile(const char *line);
 
   /**
-   * Compute membership lookup table for temperature 
+   * Compute the segment table for the temperature lookup
    */
   void _computeTempHtLookup();
 
+  /**
+   * Compute the segment at the base of each uniform height bin
+   */
+  void _computeTempBins();
+
+  /**
+   * Find the temperature segment for a height within the profile
+   * @param[in] htMeters The height (m)
+   * @return the index of the segment
+   */
+  int _findTmpSeg(int htMeters) const;
+
   /**
    * Set the weight of each radar variable from a line in the thresholds file 
    * @param[in] line The thresholds file line to parse for the radar variable weights
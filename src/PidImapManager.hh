@@ -113,13 +113,29 @@ public:
 				    double val,
 				    double &sumWtInterest,
 				    double &sumWt) const {
+    accumWeightedInterestIndex(getIndex(dbz), val, sumWtInterest, sumWt);
+  }
+
+  /**
+   * Accumulate weighted interest based on value, for a dbz value
+   * already converted with getIndex(). All managers share the same
+   * lookup table layout, so the index of a gate can be computed once
+   * and used for all of them.
+   * @param[in] dbzIndex The index of the dbz value, from getIndex()
+   * @param[in] val The value of the radar variable beind analyzed
+   * @param[in][out] sumWtInterest The accumulated weighted interest values
+   * @param[in][out] sumWt The accumulated total weights
+   */
+  inline void accumWeightedInterestIndex(int dbzIndex,
+					 double val,
+					 double &sumWtInterest,
+					 double &sumWt) const {
     
     if (fabs(_weight) < 0.0001) {
       return;
     }
     
-    int index = getIndex(dbz);
-    const PidInterestMap *map = _mapLut[index];
+    const PidInterestMap *map = _mapLut[dbzIndex];
     if (map == NULL) {
       sumWtInterest += 0.0;
       sumWt += _weight;
@@ -130,13 +146,28 @@ public:
     
   }
  
+  /**
+   * Get the interest map used for a dbz value
+   * @param[in] dbzIndex The index of the dbz value, from getIndex()
+   * @return The map, or NULL if there is no map for the dbz value
+   */
+  inline const PidInterestMap *getMap(int dbzIndex) const {
+    return _mapLut[dbzIndex];
+  }
+
+  /**
+   * Get the size of the lookup table pointer array
+   */
+  static inline int getNLut() { return _nLut; }
+
   /** 
-   * Compute index into the lookup table pointer array from dbz
+   * Compute index into the lookup table pointer array from dbz.
+   * The lookup table layout is the same for all managers.
    * @param[in] dbz The dbz value to use
    * @return The index into the lookup table array. This index can be
    *         used to access the lookup table for the given dbz value
    */
-  inline int getIndex(double dbz) const {
+  static inline int getIndex(double dbz) {
     int index = (int) (dbz * 10.0 + _lutOffset);
     if (index < 0) {
       return 0;
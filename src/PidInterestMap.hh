@@ -131,6 +131,41 @@ public:
    */
   inline double getMaxDbz() const { return _maxDbz; }
 
+  /**
+   * Has the lookup table been generated?
+   */
+  inline bool isLoaded() const { return _mapLoaded; }
+
+  /**
+   * Get the weight of this map
+   */
+  inline double getWeight() const { return _weight; }
+
+  /**
+   * Get the value used for missing data
+   */
+  inline double getMissingDouble() const { return _missingDouble; }
+
+  /**
+   * Get the value of the first lookup table entry
+   */
+  inline double getMinVal() const { return _minVal; }
+
+  /**
+   * Get the value resolution of the lookup table
+   */
+  inline double getDVal() const { return _dVal; }
+
+  /**
+   * Get the weighted lookup table, of getNLut() entries
+   */
+  inline const double *getWeightedLut() const { return _weightedLut; }
+
+  /**
+   * Get the number of entries in the lookup table
+   */
+  static inline int getNLut() { return _nLut; }
+
   /**
    * Get interest for a given val
    * @param[in] val The value to find interest for
@@ -0,0 +1,253 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// ScanGeomCache.cc
+//
+// Cache of per-bin arrays which only depend on scan geometry.
+//
+/////////////////////////////////////////////////////////////
+
+#include <cmath>
+#include "ScanGeomCache.hh"
+#include "BeamHeight.hh"
+
+// noise at 100 km assumed by the SNR estimate, dBZ
+
+#define SNR_NOISE_DBZ_AT_100KM 0.0
+
+#define RAD_TO_DEG (180.0/M_PI)
+#define DEG_TO_RAD (M_PI/180.0)
+
+// mean earth radius, for the great circle distances to grid points
+
+#define EARTH_RADIUS_KM 6371.0
+
+// 4/3 earth radius, as BeamHeight uses for the beam height
+
+#define PSEUDO_EARTH_RADIUS_KM (6375.636 * 4.0 / 3.0)
+
+////////////////////////////////////////////////////
+// Key ordering, for the index
+
+bool ScanGeomCache::Key::operator<(const Key &other) const
+
+{
+  if (elevDeg != other.elevDeg) return elevDeg < other.elevDeg;
+  if (startRangeKm != other.startRangeKm) return startRangeKm < other.startRangeKm;
+  if (gateSpacingKm != other.gateSpacingKm) return gateSpacingKm < other.gateSpacingKm;
+  if (nGates != other.nGates) return nGates < other.nGates;
+  if (radarHtKm != other.radarHtKm) return radarHtKm < other.radarHtKm;
+  if (profileId != other.profileId) return profileId < other.profileId;
+  if (gridId != other.gridId) return gridId < other.gridId;
+  if (nRays != other.nRays) return nRays < other.nRays;
+  if (radarLatDeg != other.radarLatDeg) return radarLatDeg < other.radarLatDeg;
+  if (radarLonDeg != other.radarLonDeg) return radarLonDeg < other.radarLonDeg;
+  if (firstAzDeg != other.firstAzDeg) return firstAzDeg < other.firstAzDeg;
+  return dAzDeg < other.dAzDeg;
+}
+
+////////////////////////////////////////////////////
+// Memory used by an entry
+
+size_t ScanGeomCache::Entry::bytes() const
+
+{
+  return sizeof(Entry) +
+    (htKm.capacity() + tempC.capacity() + snrRangeDb.capacity()) * sizeof(double) +
+    (gridCell.capacity() + gridLevel.capacity()) * sizeof(int) +
+    (gridWx.capacity() + gridWy.capacity() + gridWz.capacity()) * sizeof(float);
+}
+
+////////////////////////////////////////////////////
+// Constructor
+
+ScanGeomCache::ScanGeomCache()
+
+{
+  _maxBytes = 96 * 1024 * 1024;
+  _nBytes = 0;
+  _nHits = 0;
+  _nMisses = 0;
+}
+
+////////////////////////////////////////////////////
+// Destructor
+
+ScanGeomCache::~ScanGeomCache()
+
+{
+  clear();
+}
+
+/////////////////////////////////////
+// set the memory limit
+
+void ScanGeomCache::setMaxBytes(size_t maxBytes)
+
+{
+  _maxBytes = maxBytes;
+  _evict();
+}
+
+/////////////////////////////////////
+// get the entry for a scan geometry
+
+const ScanGeomCache::Entry &ScanGeomCache::get(const Key &key,
+                                               NcarParticleId &pid,
+                                               const TempGrid *grid)
+
+{
+
+  map<Key, EntryList::iterator>::iterator found = _index.find(key);
+  if (found != _index.end()) {
+    // move to the front of the list
+    _nHits++;
+    _lru.splice(_lru.begin(), _lru, found->second);
+    return *_lru.front();
+  }
+
+  _nMisses++;
+  Entry *entry = new Entry;
+  entry->key = key;
+  _fill(*entry, pid, grid);
+  _lru.push_front(entry);
+  _index[key] = _lru.begin();
+  _nBytes += entry->bytes();
+  _evict();
+
+  return *entry;
+
+}
+
+/////////////////////////////////////
+// remove all the entries
+
+void ScanGeomCache::clear()
+
+{
+  for (EntryList::iterator it = _lru.begin(); it != _lru.end(); ++it) {
+    delete *it;
+  }
+  _lru.clear();
+  _index.clear();
+  _nBytes = 0;
+}
+
+/////////////////////////////////////
+// compute the arrays for an entry
+
+void ScanGeomCache::_fill(Entry &entry, NcarParticleId &pid,
+                          const TempGrid *grid)
+
+{
+
+  const Key &key = entry.key;
+  int nGates = key.nGates;
+
+  // beam height at the centre of each bin, and the temperature there,
+  // in the same way as NcarParticleId::fillTempArray()
+
+  entry.htKm.resize(nGates);
+  BeamHeight beamHt;
+  beamHt.setInstrumentHtKm(key.radarHtKm);
+  double rangeKm = key.startRangeKm + 0.5 * key.gateSpacingKm;
+  for (int ii = 0; ii < nGates; ii++, rangeKm += key.gateSpacingKm) {
+    entry.htKm[ii] = beamHt.computeHtKm(key.elevDeg, rangeKm);
+  }
+  if (key.profileId != 0) {
+    entry.tempC.resize(nGates);
+    pid.getTmpC(&entry.htKm[0], nGates, &entry.tempC[0]);
+  }
+
+  // noise for the SNR estimate, increasing with range from its
+  // value at 100 km, at the start of each bin
+
+  entry.snrRangeDb.resize(nGates);
+  for (int ii = 0; ii < nGates; ii++) {
+    double range = key.startRangeKm + (ii * key.gateSpacingKm);
+    entry.snrRangeDb[ii] =
+      SNR_NOISE_DBZ_AT_100KM + 20.0 * (log10(range) - log10(100.0));
+  }
+
+  if (key.gridId == 0 || grid == NULL) {
+    return;
+  }
+
+  // location of each gate in the temperature grid: the level
+  // from the beam height, and the cell from the azimuth and
+  // great circle distance along the ground from the radar
+
+  entry.gridLevel.resize(nGates);
+  entry.gridWz.resize(nGates);
+  // BeamHeight::computeHtKm() does not set the ground range, so it is
+  // computed here for the same 4/3 earth model
+
+  vector<double> sinDist(nGates), cosDist(nGates);
+  double cosEl = cos(key.elevDeg * DEG_TO_RAD);
+  rangeKm = key.startRangeKm + 0.5 * key.gateSpacingKm;
+  for (int ii = 0; ii < nGates; ii++, rangeKm += key.gateSpacingKm) {
+    grid->locateHt(entry.htKm[ii], entry.gridLevel[ii], entry.gridWz[ii]);
+    double htAboveKm = entry.htKm[ii] - key.radarHtKm;
+    double gndRangeKm = PSEUDO_EARTH_RADIUS_KM *
+      asin(rangeKm * cosEl / (PSEUDO_EARTH_RADIUS_KM + htAboveKm));
+    double dist = gndRangeKm / EARTH_RADIUS_KM;
+    sinDist[ii] = sin(dist);
+    cosDist[ii] = cos(dist);
+  }
+
+  size_t nPts = (size_t) key.nRays * nGates;
+  entry.gridCell.resize(nPts);
+  entry.gridWx.resize(nPts);
+  entry.gridWy.resize(nPts);
+  double lat0 = key.radarLatDeg * DEG_TO_RAD;
+  double lon0 = key.radarLonDeg * DEG_TO_RAD;
+  double sinLat0 = sin(lat0);
+  double cosLat0 = cos(lat0);
+  for (int iray = 0; iray < key.nRays; iray++) {
+    double az = (key.firstAzDeg + iray * key.dAzDeg) * DEG_TO_RAD;
+    double sinAz = sin(az);
+    double cosAz = cos(az);
+    size_t offset = (size_t) iray * nGates;
+    for (int ii = 0; ii < nGates; ii++) {
+      double sinLat = sinLat0 * cosDist[ii] + cosLat0 * sinDist[ii] * cosAz;
+      double lat = asin(sinLat);
+      double lon = lon0 + atan2(sinAz * sinDist[ii] * cosLat0,
+                                cosDist[ii] - sinLat0 * sinLat);
+      grid->locate(lat * RAD_TO_DEG, lon * RAD_TO_DEG,
+                   entry.gridCell[offset + ii],
+                   entry.gridWx[offset + ii], entry.gridWy[offset + ii]);
+    }
+  }
+
+}
+
+/////////////////////////////////////
+// evict entries down to the limit, keeping the most recent
+
+void ScanGeomCache::_evict()
+
+{
+  while (_nBytes > _maxBytes && _lru.size() > 1) {
+    Entry *entry = _lru.back();
+    _lru.pop_back();
+    _index.erase(entry->key);
+    _nBytes -= entry->bytes();
+    delete entry;
+  }
+}
@@ -0,0 +1,179 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// ScanGeomCache.hh
+//
+// Cache of the per-bin arrays which only depend on the geometry
+// of a scan, and on the temperature profile: beam height,
+// temperature and the range term of the SNR estimate. With a
+// model temperature grid, also the location of each gate of
+// the scan in the grid.
+//
+// Radars repeat the same scan strategy from volume to volume,
+// so the arrays are kept, keyed on the elevation, rstart, rscale,
+// number of bins, radar height and profile id, and for a grid
+// the number and azimuths of the rays, radar location and grid
+// geometry. Entries are evicted least recently used first, once
+// the cache holds more than its memory limit.
+//
+/////////////////////////////////////////////////////////////
+
+/**
+ * @file ScanGeomCache.hh
+ * @class ScanGeomCache
+ * @brief LRU cache of per-bin beam height, temperature, SNR range term and grid locations
+ */
+
+#ifndef ScanGeomCache_hh
+#define ScanGeomCache_hh
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <vector>
+#include "NcarParticleId.hh"
+#include "TempGrid.hh"
+
+using namespace std;
+
+////////////////////////
+// This class
+
+class ScanGeomCache {
+
+public:
+
+  /**
+   * Geometry of a scan, and the profile its temperatures come from
+   */
+  class Key {
+  public:
+    double elevDeg;       /**< Elevation angle (deg) */
+    double startRangeKm;  /**< Range to the start of the first bin (km) */
+    double gateSpacingKm; /**< Bin spacing (km), 0 if not known */
+    int nGates;           /**< Number of bins */
+    double radarHtKm;     /**< Radar height (km MSL) */
+    int profileId;        /**< Temperature profile id, 0 for none */
+    int gridId;           /**< Temperature grid geometry id, 0 for none */
+    int nRays;            /**< Number of rays, with a grid */
+    double radarLatDeg;   /**< Radar latitude, with a grid */
+    double radarLonDeg;   /**< Radar longitude, with a grid */
+    double firstAzDeg;    /**< Azimuth of the first ray, with a grid */
+    double dAzDeg;        /**< Azimuth step between rays, with a grid */
+    bool operator<(const Key &other) const;
+  };
+
+  /**
+   * The per-bin arrays for a scan geometry
+   */
+  class Entry {
+  public:
+    Key key;
+    vector<double> htKm;        /**< Beam height at the centre of each bin */
+    vector<double> tempC;       /**< Temperature at htKm, empty without a profile */
+    vector<double> snrRangeDb;  /**< Range term of the SNR estimate */
+    vector<int> gridCell;       /**< Grid cell of each gate, nRays * nGates */
+    vector<float> gridWx;       /**< East weight of each gate */
+    vector<float> gridWy;       /**< North weight of each gate */
+    vector<int> gridLevel;      /**< Grid level of each bin */
+    vector<float> gridWz;       /**< Upper weight of each bin */
+    size_t bytes() const;
+  };
+
+  /**
+   * Constructor
+   */
+  ScanGeomCache();
+
+  /**
+   * Destructor
+   */
+  ~ScanGeomCache();
+
+  /**
+   * Set the most memory the entries may use. The most recently used
+   * entry is always kept, so 0 keeps only that one. Default 96 MB,
+   * enough for a volume of 20 scans of 360 x 1000 gates with a
+   * temperature grid, at about 12 bytes per gate; without a grid an
+   * entry is only a few tens of bytes per bin.
+   * @param[in] maxBytes The memory limit
+   */
+  void setMaxBytes(size_t maxBytes);
+
+  /**
+   * Get the arrays for a scan geometry, computing them if they are
+   * not cached. With a profile id other than 0, the temperatures are
+   * computed with pid, which must hold the lookup for that profile.
+   * With a grid id other than 0, the gates are located in grid, which
+   * must have that geometry id. The rays are taken to be spread
+   * evenly, dAzDeg apart from firstAzDeg, so the azimuth of ray i is
+   * firstAzDeg + i * dAzDeg.
+   * The entry remains valid until the next call to get() or clear().
+   * @param[in] key The scan geometry and profile id
+   * @param[in] pid The PID object, for the temperature lookup
+   * @param[in] grid The temperature grid, for the gate locations
+   * @return the entry
+   */
+  const Entry &get(const Key &key, NcarParticleId &pid,
+                   const TempGrid *grid = NULL);
+
+  /**
+   * Remove all the entries
+   */
+  void clear();
+
+  /**
+   * Get the number of entries, the memory they use, and the numbers
+   * of lookups found in and missing from the cache
+   */
+  int getNEntries() const { return (int) _lru.size(); }
+  size_t getNBytes() const { return _nBytes; }
+  long getNHits() const { return _nHits; }
+  long getNMisses() const { return _nMisses; }
+
+protected:
+
+private:
+
+  typedef list<Entry *> EntryList;
+
+  EntryList _lru;                         /**< most recently used first */
+  map<Key, EntryList::iterator> _index;
+  size_t _maxBytes;
+  size_t _nBytes;
+  long _nHits;
+  long _nMisses;
+
+  /// compute the arrays for a new entry
+
+  static void _fill(Entry &entry, NcarParticleId &pid,
+                    const TempGrid *grid);
+
+  /// evict entries, least recently used first, down to the limit
+
+  void _evict();
+
+  // copy constructor and assignment are private, the cache owns its entries
+
+  ScanGeomCache(const ScanGeomCache &);
+  ScanGeomCache &operator=(const ScanGeomCache &);
+
+};
+
+#endif
@@ -0,0 +1,578 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// SoundingStore.cc
+//
+// Local archive of soundings, for TempProfile.
+//
+/////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <cerrno>
+#include <iostream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "SoundingStore.hh"
+
+static const char *DATA_MAGIC = "NCARBSD1";
+static const char *INDEX_MAGIC = "NCARBSX1";
+static const int MAGIC_LEN = 8;
+static const int INDEX_HEADER_LEN = 16;
+
+// header of each record in the data file
+
+typedef struct {
+  int recordBytes;
+  int nPoints;
+  char station[SoundingStore::STATION_LEN];
+  long long time;
+} record_hdr_t;
+
+////////////////////////////////////////////////////
+// Constructor
+
+SoundingStore::SoundingStore()
+
+{
+  _dataFd = -1;
+  _map = NULL;
+  _mapBytes = 0;
+  _entries = NULL;
+  _nEntries = 0;
+  _indexIno = 0;
+  _indexMtime = 0;
+}
+
+////////////////////////////////////////////////////
+// Destructor
+
+SoundingStore::~SoundingStore()
+
+{
+  close();
+}
+
+/////////////////////////////////////
+// open an archive
+// returns 0 on success, -1 on failure
+
+int SoundingStore::open(const string &path, bool create)
+
+{
+
+  close();
+
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0 && errno == ENOENT && create) {
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0) {
+      bool ok = (write(fd, DATA_MAGIC, MAGIC_LEN) == MAGIC_LEN);
+      ::close(fd);
+      fd = ok ? ::open(path.c_str(), O_RDONLY) : -1;
+    }
+  }
+  if (fd < 0) {
+    int errNum = errno;
+    cerr << "ERROR - SoundingStore::open()" << endl;
+    cerr << "  Cannot open sounding archive: " << path << endl;
+    cerr << "  " << strerror(errNum) << endl;
+    return -1;
+  }
+
+  char magic[MAGIC_LEN];
+  if (pread(fd, magic, MAGIC_LEN, 0) != MAGIC_LEN ||
+      memcmp(magic, DATA_MAGIC, MAGIC_LEN) != 0) {
+    cerr << "ERROR - SoundingStore::open()" << endl;
+    cerr << "  Not a sounding archive: " << path << endl;
+    ::close(fd);
+    return -1;
+  }
+
+  _dataFd = fd;
+  _path = path;
+  _indexPath = path + ".idx";
+
+  // without an index, rebuild it, but only write it out if the
+  // archive may be changed, otherwise search it in memory
+
+  if (_mapIndex()) {
+    vector<entry_t> entries;
+    _rebuildIndex(entries);
+    if (create || _dirWritable()) {
+      if (_writeIndex(entries) || _mapIndex()) {
+        close();
+        return -1;
+      }
+    } else {
+      _memEntries.swap(entries);
+      _entries = _memEntries.empty() ? NULL : &_memEntries[0];
+      _nEntries = (int) _memEntries.size();
+    }
+  }
+
+  return 0;
+
+}
+
+/////////////////////////////////////
+// close the archive
+
+void SoundingStore::close()
+
+{
+  _unmapIndex();
+  if (_dataFd >= 0) {
+    ::close(_dataFd);
+    _dataFd = -1;
+  }
+  _path.clear();
+  _indexPath.clear();
+}
+
+/////////////////////////////////////
+// append a sounding
+// returns 0 on success, -1 on failure
+
+int SoundingStore::append(const string &station, time_t soundingTime,
+                          const vector<NcarParticleId::TmpPoint> &profile)
+
+{
+  return append(vector<Sounding>(1, Sounding(station, soundingTime, profile)));
+}
+
+/////////////////////////////////////
+// append several soundings, writing the index once
+// returns 0 on success, -1 on failure
+
+int SoundingStore::append(const vector<Sounding> &soundings)
+
+{
+
+  if (!isOpen()) {
+    return -1;
+  }
+  if (soundings.empty()) {
+    return 0;
+  }
+
+  // the records, one after the other, with their index entries.
+  // Offsets are from the start of the records until the data file
+  // size is known.
+
+  vector<char> recs;
+  vector<entry_t> newEntries;
+  for (size_t isnd = 0; isnd < soundings.size(); isnd++) {
+
+    const vector<NcarParticleId::TmpPoint> &profile = soundings[isnd].profile;
+    int nPoints = (int) profile.size();
+    record_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.recordBytes = (int) (sizeof(hdr) + nPoints * 3 * sizeof(double));
+    hdr.nPoints = nPoints;
+    _stationKey(soundings[isnd].station, hdr.station);
+    hdr.time = soundings[isnd].soundingTime;
+
+    size_t start = recs.size();
+    recs.resize(start + hdr.recordBytes);
+    memcpy(&recs[start], &hdr, sizeof(hdr));
+    double *pt = (double *) (&recs[start] + sizeof(hdr));
+    for (int ii = 0; ii < nPoints; ii++) {
+      *pt++ = profile[ii].pressHpa;
+      *pt++ = profile[ii].htKm * 1000.0;
+      *pt++ = profile[ii].tmpC;
+    }
+
+    entry_t entry;
+    memcpy(entry.station, hdr.station, STATION_LEN);
+    entry.time = hdr.time;
+    entry.offset = start;
+    newEntries.push_back(entry);
+
+  }
+
+  int fd = ::open(_path.c_str(), O_WRONLY | O_APPEND);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) ||
+      write(fd, &recs[0], recs.size()) != (ssize_t) recs.size()) {
+    int errNum = errno;
+    cerr << "ERROR - SoundingStore::append()" << endl;
+    cerr << "  Cannot append to sounding archive: " << _path << endl;
+    cerr << "  " << strerror(errNum) << endl;
+    if (fd >= 0) ::close(fd);
+    return -1;
+  }
+  ::close(fd);
+
+  // the index, with the new entries in place, in the order appended
+
+  if (_indexChanged()) {
+    _unmapIndex();
+    _mapIndex();
+  }
+  vector<entry_t> entries(_entries, _entries + _nEntries);
+  for (size_t ii = 0; ii < newEntries.size(); ii++) {
+    newEntries[ii].offset += st.st_size;
+    _insertEntry(entries, newEntries[ii]);
+  }
+
+  if (_writeIndex(entries)) {
+    return -1;
+  }
+  _unmapIndex();
+  return _mapIndex();
+
+}
+
+/////////////////////////////////////
+// find the last sounding at or before a time
+
+int SoundingStore::findClosestBefore(const string &station,
+                                     time_t searchTime,
+                                     time_t earliestTime)
+
+{
+
+  if (!isOpen()) {
+    return -1;
+  }
+  if (_indexChanged()) {
+    _unmapIndex();
+    if (_mapIndex()) {
+      return -1;
+    }
+  }
+
+  char key[STATION_LEN];
+  _stationKey(station, key);
+
+  // first entry after (station, searchTime)
+
+  int lo = 0, hi = _nEntries;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (_compare(_entries[mid], key, searchTime) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  int entry = lo - 1;
+  if (entry < 0 ||
+      memcmp(_entries[entry].station, key, STATION_LEN) != 0 ||
+      _entries[entry].time < earliestTime) {
+    return -1;
+  }
+  return entry;
+
+}
+
+/////////////////////////////////////
+// find the previous sounding for the same station
+
+int SoundingStore::findPrevious(int entry, time_t earliestTime) const
+
+{
+  if (entry < 1 || entry >= _nEntries) {
+    return -1;
+  }
+  const entry_t &prev = _entries[entry - 1];
+  if (memcmp(prev.station, _entries[entry].station, STATION_LEN) != 0 ||
+      prev.time < earliestTime) {
+    return -1;
+  }
+  return entry - 1;
+}
+
+/////////////////////////////////////
+// read the sounding of an index entry
+// returns 0 on success, -1 on failure
+
+int SoundingStore::readProfile(int entry, time_t &soundingTime,
+                               vector<NcarParticleId::TmpPoint> &profile) const
+
+{
+
+  profile.clear();
+  if (entry < 0 || entry >= _nEntries) {
+    return -1;
+  }
+
+  off_t offset = (off_t) _entries[entry].offset;
+  record_hdr_t hdr;
+  if (pread(_dataFd, &hdr, sizeof(hdr), offset) != (ssize_t) sizeof(hdr) ||
+      hdr.nPoints < 0 ||
+      hdr.recordBytes != (int) (sizeof(hdr) + hdr.nPoints * 3 * sizeof(double))) {
+    cerr << "ERROR - SoundingStore::readProfile()" << endl;
+    cerr << "  Bad record in sounding archive: " << _path << endl;
+    return -1;
+  }
+
+  vector<double> pts(hdr.nPoints * 3);
+  ssize_t nBytes = pts.size() * sizeof(double);
+  if (nBytes > 0 &&
+      pread(_dataFd, &pts[0], nBytes, offset + sizeof(hdr)) != nBytes) {
+    cerr << "ERROR - SoundingStore::readProfile()" << endl;
+    cerr << "  Short record in sounding archive: " << _path << endl;
+    return -1;
+  }
+
+  soundingTime = (time_t) hdr.time;
+  for (int ii = 0; ii < hdr.nPoints; ii++) {
+    NcarParticleId::TmpPoint tmpPt(pts[ii * 3], pts[ii * 3 + 1] / 1000.0,
+                                   pts[ii * 3 + 2]);
+    profile.push_back(tmpPt);
+  }
+
+  return 0;
+
+}
+
+/////////////////////////////////////
+// map the index file into memory
+// returns 0 on success, -1 on failure
+
+int SoundingStore::_mapIndex()
+
+{
+
+  int fd = ::open(_indexPath.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) || st.st_size < INDEX_HEADER_LEN) {
+    ::close(fd);
+    return -1;
+  }
+
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED) {
+    return -1;
+  }
+
+  const char *buf = (const char *) map;
+  int nEntries;
+  memcpy(&nEntries, buf + MAGIC_LEN, sizeof(int));
+  if (memcmp(buf, INDEX_MAGIC, MAGIC_LEN) != 0 || nEntries < 0 ||
+      (size_t) st.st_size !=
+      INDEX_HEADER_LEN + (size_t) nEntries * sizeof(entry_t)) {
+    cerr << "ERROR - SoundingStore::_mapIndex()" << endl;
+    cerr << "  Bad index file: " << _indexPath << endl;
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  _map = map;
+  _mapBytes = st.st_size;
+  _entries = (const entry_t *) (buf + INDEX_HEADER_LEN);
+  _nEntries = nEntries;
+  _indexIno = st.st_ino;
+  _indexMtime = st.st_mtime;
+
+  return 0;
+
+}
+
+/////////////////////////////////////
+// release the mapped index
+
+void SoundingStore::_unmapIndex()
+
+{
+  if (_map != NULL) {
+    munmap(_map, _mapBytes);
+  }
+  _memEntries.clear();
+  _map = NULL;
+  _mapBytes = 0;
+  _entries = NULL;
+  _nEntries = 0;
+  _indexIno = 0;
+  _indexMtime = 0;
+}
+
+/////////////////////////////////////
+// has the index file been replaced since it was mapped?
+
+bool SoundingStore::_indexChanged() const
+
+{
+  struct stat st;
+  if (stat(_indexPath.c_str(), &st)) {
+    return _map != NULL;
+  }
+  return (_map == NULL || st.st_ino != _indexIno ||
+          st.st_mtime != _indexMtime);
+}
+
+/////////////////////////////////////
+// rebuild the index entries from the data file
+
+void SoundingStore::_rebuildIndex(vector<entry_t> &sorted)
+
+{
+
+  vector<entry_t> entries;
+  off_t offset = MAGIC_LEN;
+  record_hdr_t hdr;
+  while (pread(_dataFd, &hdr, sizeof(hdr), offset) == (ssize_t) sizeof(hdr)) {
+    if (hdr.nPoints < 0 ||
+        hdr.recordBytes != (int) (sizeof(hdr) + hdr.nPoints * 3 * sizeof(double))) {
+      break;
+    }
+    entry_t entry;
+    memcpy(entry.station, hdr.station, STATION_LEN);
+    entry.time = hdr.time;
+    entry.offset = offset;
+    entries.push_back(entry);
+    offset += hdr.recordBytes;
+  }
+
+  // sort by station and time, keeping the last appended of any
+  // with the same station and time
+
+  sorted.clear();
+  for (size_t ii = 0; ii < entries.size(); ii++) {
+    _insertEntry(sorted, entries[ii]);
+  }
+
+}
+
+/////////////////////////////////////
+// may the index be written next to the data file?
+
+bool SoundingStore::_dirWritable() const
+
+{
+  size_t slash = _path.find_last_of('/');
+  string dir;
+  if (slash == string::npos) {
+    dir = ".";
+  } else if (slash == 0) {
+    dir = "/";
+  } else {
+    dir = _path.substr(0, slash);
+  }
+  return (access(dir.c_str(), W_OK) == 0);
+}
+
+/////////////////////////////////////
+// write the index to a temporary file and rename it into place
+// returns 0 on success, -1 on failure
+
+int SoundingStore::_writeIndex(const vector<entry_t> &entries)
+
+{
+
+  char suffix[32];
+  snprintf(suffix, sizeof(suffix), ".tmp.%d", (int) getpid());
+  string tmpPath = _indexPath + suffix;
+
+  FILE *out = fopen(tmpPath.c_str(), "wb");
+  if (out == NULL) {
+    int errNum = errno;
+    cerr << "ERROR - SoundingStore::_writeIndex()" << endl;
+    cerr << "  Cannot open file: " << tmpPath << endl;
+    cerr << "  " << strerror(errNum) << endl;
+    return -1;
+  }
+
+  int header[2];
+  header[0] = (int) entries.size();
+  header[1] = 0;
+  bool ok = (fwrite(INDEX_MAGIC, 1, MAGIC_LEN, out) == (size_t) MAGIC_LEN &&
+             fwrite(header, sizeof(int), 2, out) == 2);
+  if (ok && entries.size() > 0) {
+    ok = (fwrite(&entries[0], sizeof(entry_t), entries.size(), out) ==
+          entries.size());
+  }
+  if (fclose(out) != 0) {
+    ok = false;
+  }
+
+  if (!ok || rename(tmpPath.c_str(), _indexPath.c_str())) {
+    int errNum = errno;
+    cerr << "ERROR - SoundingStore::_writeIndex()" << endl;
+    cerr << "  Cannot write index: " << _indexPath << endl;
+    cerr << "  " << strerror(errNum) << endl;
+    unlink(tmpPath.c_str());
+    return -1;
+  }
+
+  return 0;
+
+}
+
+/////////////////////////////////////
+// insert an entry in sorted order, replacing any with the same
+// station and time
+
+void SoundingStore::_insertEntry(vector<entry_t> &entries,
+                                 const entry_t &entry)
+
+{
+  size_t lo = 0, hi = entries.size();
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    if (_compare(entries[mid], entry.station, entry.time) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo < entries.size() &&
+      _compare(entries[lo], entry.station, entry.time) == 0) {
+    entries[lo] = entry;
+  } else {
+    entries.insert(entries.begin() + lo, entry);
+  }
+}
+
+/////////////////////////////////////
+// station name as a fixed length key
+
+void SoundingStore::_stationKey(const string &station, char *key)
+
+{
+  memset(key, 0, STATION_LEN);
+  memcpy(key, station.data(), min(station.size(), (size_t) STATION_LEN));
+}
+
+/////////////////////////////////////
+// order of an entry relative to a station and time
+
+int SoundingStore::_compare(const entry_t &entry, const char *station,
+                            long long time)
+
+{
+  int cmp = memcmp(entry.station, station, STATION_LEN);
+  if (cmp != 0) {
+    return cmp;
+  }
+  if (entry.time < time) {
+    return -1;
+  }
+  return (entry.time > time) ? 1 : 0;
+}
@@ -0,0 +1,241 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// SoundingStore.hh
+//
+// Local archive of soundings, for TempProfile.
+//
+// Soundings are appended to a data file, and found through an
+// index file of (station, time, offset) entries sorted by station
+// and time. Readers map the index into memory, so a search is a
+// binary search without parsing any text, and map it again when
+// a writer has replaced it. A writer appends the sounding to the
+// data file, then writes the new index to a temporary file and
+// renames it over the old one, so readers always see a complete
+// index. Only one process should append at a time.
+//
+// Data file <path>, in native byte order:
+//
+//   char    magic[8]             "NCARBSD1"
+//
+// followed by one record per sounding:
+//
+//   int32   recordBytes          size of the record, this word included
+//   int32   nPoints
+//   char    station[8]           null-padded
+//   int64   time                 seconds since the epoch
+//   float64 point[nPoints][3]    pressure (hPa), height (m MSL),
+//                                temperature (C)
+//
+// Index file <path>.idx:
+//
+//   char    magic[8]             "NCARBSX1"
+//   int32   nEntries, spare
+//   entry[nEntries]              char station[8], int64 time,
+//                                int64 offset of the record
+//
+// If the index is missing, it is rebuilt from the data file. It is
+// written out if the archive is opened to create it or its directory
+// is writable, otherwise it is only kept in memory.
+//
+/////////////////////////////////////////////////////////////
+
+/**
+ * @file SoundingStore.hh
+ * @class SoundingStore
+ * @brief Local sounding archive with a memory-mapped index
+ */
+
+#ifndef SoundingStore_hh
+#define SoundingStore_hh
+
+#include <string>
+#include <vector>
+#include <ctime>
+#include <sys/types.h>
+#include "NcarParticleId.hh"
+
+using namespace std;
+
+////////////////////////
+// This class
+
+class SoundingStore {
+
+public:
+
+  /**
+   * Length of a station name, longer names are truncated
+   */
+  static const int STATION_LEN = 8;
+
+  /**
+   * Constructor
+   */
+  SoundingStore();
+
+  /**
+   * Destructor
+   */
+  ~SoundingStore();
+
+  /**
+   * Open an archive. Closes any archive already open. A missing
+   * index is rebuilt, and only written out if create is set or the
+   * directory is writable.
+   * @param[in] path The data file path
+   * @param[in] create Whether to create the archive if it doesn't exist
+   * @return 0 on success, -1 on failure
+   */
+  int open(const string &path, bool create = false);
+
+  /**
+   * Close the archive
+   */
+  void close();
+
+  /**
+   * Is an archive open?
+   */
+  bool isOpen() const { return _dataFd >= 0; }
+
+  /**
+   * Get the path of the open archive
+   */
+  const string &getPath() const { return _path; }
+
+  /**
+   * A sounding to append
+   */
+  class Sounding {
+  public:
+    Sounding(const string &stationName, time_t launchTime,
+             const vector<NcarParticleId::TmpPoint> &points) :
+      station(stationName), soundingTime(launchTime), profile(points) {}
+    string station;
+    time_t soundingTime;
+    vector<NcarParticleId::TmpPoint> profile;
+  };
+
+  /**
+   * Append a sounding to the archive, replacing any earlier one for
+   * the same station and time in the index.
+   * Each call rewrites the whole index, so appending n soundings one
+   * at a time costs O(n^2); use the bulk append to load many.
+   * @param[in] station The station name
+   * @param[in] soundingTime The launch time
+   * @param[in] profile The points, with pressure, height and temperature
+   * @return 0 on success, -1 on failure
+   */
+  int append(const string &station, time_t soundingTime,
+             const vector<NcarParticleId::TmpPoint> &profile);
+
+  /**
+   * Append several soundings to the archive, with one write to the
+   * data file and one rewrite of the index. A later sounding for the
+   * same station and time replaces an earlier one, as if they were
+   * appended one at a time.
+   * @param[in] soundings The soundings, in the order to append them
+   * @return 0 on success, -1 on failure
+   */
+  int append(const vector<Sounding> &soundings);
+
+  /**
+   * Find the last sounding for a station at or before a time, and
+   * not before an earliest time. Re-reads the index if it has been
+   * replaced since it was last read.
+   * @param[in] station The station name
+   * @param[in] searchTime The latest time
+   * @param[in] earliestTime The earliest time
+   * @return the index entry, or -1 if there is none
+   */
+  int findClosestBefore(const string &station, time_t searchTime,
+                        time_t earliestTime);
+
+  /**
+   * Find the sounding for the same station before an entry,
+   * and not before an earliest time
+   * @param[in] entry An entry from findClosestBefore()
+   * @param[in] earliestTime The earliest time
+   * @return the index entry, or -1 if there is none
+   */
+  int findPrevious(int entry, time_t earliestTime) const;
+
+  /**
+   * Read the sounding of an index entry
+   * @param[in] entry The index entry
+   * @param[out] soundingTime The launch time
+   * @param[out] profile The points, heights in km
+   * @return 0 on success, -1 on failure
+   */
+  int readProfile(int entry, time_t &soundingTime,
+                  vector<NcarParticleId::TmpPoint> &profile) const;
+
+  /**
+   * Get the number of soundings in the index
+   */
+  int getNSoundings() const { return _nEntries; }
+
+protected:
+
+private:
+
+  // index entry, as in the file
+
+  typedef struct {
+    char station[STATION_LEN];
+    long long time;
+    long long offset;
+  } entry_t;
+
+  string _path;
+  string _indexPath;
+  int _dataFd;
+
+  // mapped index, or the index rebuilt in memory when it can't be
+  // written
+
+  void *_map;
+  size_t _mapBytes;
+  vector<entry_t> _memEntries;
+  const entry_t *_entries;
+  int _nEntries;
+  ino_t _indexIno;
+  time_t _indexMtime;
+
+  int _mapIndex();
+  void _unmapIndex();
+  bool _indexChanged() const;
+  void _rebuildIndex(vector<entry_t> &sorted);
+  bool _dirWritable() const;
+  int _writeIndex(const vector<entry_t> &entries);
+
+  static void _insertEntry(vector<entry_t> &entries, const entry_t &entry);
+  static void _stationKey(const string &station, char *key);
+  static int _compare(const entry_t &entry, const char *station,
+                      long long time);
+
+  // copy constructor and assignment are private, the store owns its files
+
+  SoundingStore(const SoundingStore &);
+  SoundingStore &operator=(const SoundingStore &);
+
+};
+
+#endif
@@ -0,0 +1,258 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// TempGrid.cc
+//
+// 3-D model temperature field on a regular lat/lon grid.
+//
+/////////////////////////////////////////////////////////////
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <algorithm>
+#include "TempGrid.hh"
+
+static const char *GRID_MAGIC = "NCARBTG1";
+
+int TempGrid::_lastGeomId = 0;
+
+////////////////////////////////////////////////////
+// Constructor
+
+TempGrid::TempGrid()
+
+{
+  _geomId = 0;
+  clear();
+}
+
+////////////////////////////////////////////////////
+// Destructor
+
+TempGrid::~TempGrid()
+
+{
+}
+
+/////////////////////////////////////
+// remove the grid
+
+void TempGrid::clear()
+
+{
+  _nx = _ny = _nz = 0;
+  _lon0Deg = _lat0Deg = 0.0;
+  _dLonDeg = _dLatDeg = 0.0;
+  _htKm.clear();
+  _tempC.clear();
+  _geomId = 0;
+}
+
+/////////////////////////////////////
+// read a grid from a file
+// returns 0 on success, -1 on failure
+
+int TempGrid::read(const string &path)
+
+{
+
+  FILE *in = fopen(path.c_str(), "rb");
+  if (in == NULL) {
+    int errNum = errno;
+    cerr << "ERROR - TempGrid::read()" << endl;
+    cerr << "  Cannot open file: " << path << endl;
+    cerr << "  " << strerror(errNum) << endl;
+    clear();
+    return -1;
+  }
+
+  char magic[8];
+  int dims[4];
+  double hdr[4];
+  bool ok = (fread(magic, 1, 8, in) == 8 &&
+             memcmp(magic, GRID_MAGIC, 8) == 0 &&
+             fread(dims, sizeof(int), 4, in) == 4 &&
+             fread(hdr, sizeof(double), 4, in) == 4);
+
+  int nx = 0, ny = 0, nz = 0;
+  if (ok) {
+    nx = dims[0];
+    ny = dims[1];
+    nz = dims[2];
+    ok = (nx > 0 && ny > 0 && nz > 0 &&
+          (nx == 1 || hdr[2] != 0.0) && (ny == 1 || hdr[3] != 0.0));
+  }
+
+  vector<double> htKm;
+  if (ok) {
+    htKm.resize(nz);
+    ok = ((int) fread(&htKm[0], sizeof(double), nz, in) == nz);
+    for (int kk = 0; ok && kk < nz; kk++) {
+      htKm[kk] *= 0.001;
+      if (kk > 0 && htKm[kk] <= htKm[kk-1]) {
+        ok = false;
+      }
+    }
+  }
+
+  vector<float> tempC;
+  if (ok) {
+    size_t nPts = (size_t) nx * ny * nz;
+    tempC.resize(nPts);
+    ok = (fread(&tempC[0], sizeof(float), nPts, in) == nPts);
+  }
+
+  fclose(in);
+
+  if (!ok) {
+    cerr << "ERROR - TempGrid::read()" << endl;
+    cerr << "  Not a valid temperature grid file: " << path << endl;
+    clear();
+    return -1;
+  }
+
+  // keep the geometry id if only the temperatures have changed
+
+  if (!_sameGeom(nx, ny, nz, hdr, htKm)) {
+    _geomId = ++_lastGeomId;
+  }
+
+  _nx = nx;
+  _ny = ny;
+  _nz = nz;
+  _lon0Deg = hdr[0];
+  _lat0Deg = hdr[1];
+  _dLonDeg = hdr[2];
+  _dLatDeg = hdr[3];
+  _htKm.swap(htKm);
+  _tempC.swap(tempC);
+
+  return 0;
+
+}
+
+/////////////////////////////////////
+// locate a point horizontally
+
+void TempGrid::locate(double latDeg, double lonDeg,
+                      int &cell, float &wx, float &wy) const
+
+{
+
+  int ix = 0, iy = 0;
+  wx = wy = 0.0;
+
+  if (_nx > 1) {
+    double fx = (lonDeg - _lon0Deg) / _dLonDeg;
+    if (fx <= 0.0) {
+      ix = 0;
+    } else if (fx >= _nx - 1) {
+      ix = _nx - 2;
+      wx = 1.0;
+    } else {
+      ix = (int) fx;
+      wx = (float) (fx - ix);
+    }
+  }
+
+  if (_ny > 1) {
+    double fy = (latDeg - _lat0Deg) / _dLatDeg;
+    if (fy <= 0.0) {
+      iy = 0;
+    } else if (fy >= _ny - 1) {
+      iy = _ny - 2;
+      wy = 1.0;
+    } else {
+      iy = (int) fy;
+      wy = (float) (fy - iy);
+    }
+  }
+
+  cell = iy * _nx + ix;
+
+}
+
+/////////////////////////////////////
+// locate a height in the levels
+
+void TempGrid::locateHt(double htKm, int &level, float &wz) const
+
+{
+
+  level = 0;
+  wz = 0.0;
+  if (_nz < 2 || htKm <= _htKm[0]) {
+    return;
+  }
+  if (htKm >= _htKm[_nz-1]) {
+    level = _nz - 2;
+    wz = 1.0;
+    return;
+  }
+
+  level = (int) (upper_bound(_htKm.begin(), _htKm.end(), htKm) -
+                 _htKm.begin()) - 1;
+  wz = (float) ((htKm - _htKm[level]) / (_htKm[level+1] - _htKm[level]));
+
+}
+
+/////////////////////////////////////
+// interpolate the temperatures along a ray
+
+void TempGrid::gather(int nGates, const int *cell, const float *wx,
+                      const float *wy, const int *level, const float *wz,
+                      double *tempC) const
+
+{
+
+  // offsets to the neighbouring points, 0 along a single point
+
+  int nxy = _nx * _ny;
+  int dx = (_nx > 1) ? 1 : 0;
+  int dy = (_ny > 1) ? _nx : 0;
+  int dz = (_nz > 1) ? nxy : 0;
+
+  for (int ii = 0; ii < nGates; ii++) {
+    const float *tt = &_tempC[(size_t) level[ii] * nxy + cell[ii]];
+    double xx = wx[ii];
+    double yy = wy[ii];
+    double lower = ((1.0 - yy) * ((1.0 - xx) * tt[0] + xx * tt[dx]) +
+                    yy * ((1.0 - xx) * tt[dy] + xx * tt[dy + dx]));
+    tt += dz;
+    double upper = ((1.0 - yy) * ((1.0 - xx) * tt[0] + xx * tt[dx]) +
+                    yy * ((1.0 - xx) * tt[dy] + xx * tt[dy + dx]));
+    tempC[ii] = lower + wz[ii] * (upper - lower);
+  }
+
+}
+
+/////////////////////////////////////
+// is a geometry the same as that of the current grid?
+
+bool TempGrid::_sameGeom(int nx, int ny, int nz, const double *hdr,
+                         const vector<double> &htKm) const
+
+{
+  return (_geomId != 0 && nx == _nx && ny == _ny && nz == _nz &&
+          hdr[0] == _lon0Deg && hdr[1] == _lat0Deg &&
+          hdr[2] == _dLonDeg && hdr[3] == _dLatDeg &&
+          htKm == _htKm);
+}
@@ -0,0 +1,151 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/////////////////////////////////////////////////////////////
+// TempGrid.hh
+//
+// 3-D model temperature field on a regular lat/lon grid,
+// at fixed heights above MSL.
+//
+// The gates of a scan are located in the grid once per scan
+// geometry, as the cell and level indices with interpolation
+// weights (see ScanGeomCache), so that each new model cycle
+// only needs a trilinear gather per gate. Gates outside the
+// grid take the values at its edges.
+//
+// File layout, in native byte order:
+//
+//   char    magic[8]             "NCARBTG1"
+//   int32   nx, ny, nz, spare
+//   float64 lon0Deg, lat0Deg     centre of the first cell
+//   float64 dLonDeg, dLatDeg     cell spacing
+//   float64 htM[nz]              level heights, m MSL, ascending
+//   float32 tempC[nz][ny][nx]
+//
+// Lib/temp_grid.py writes these files.
+//
+/////////////////////////////////////////////////////////////
+
+/**
+ * @file TempGrid.hh
+ * @class TempGrid
+ * @brief Model temperature grid, interpolated to radar gates
+ */
+
+#ifndef TempGrid_hh
+#define TempGrid_hh
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+////////////////////////
+// This class
+
+class TempGrid {
+
+public:
+
+  /**
+   * Constructor
+   */
+  TempGrid();
+
+  /**
+   * Destructor
+   */
+  ~TempGrid();
+
+  /**
+   * Read a grid from a file, replacing any grid already read
+   * @param[in] path The file path
+   * @return 0 on success, -1 on failure, leaving the object empty
+   */
+  int read(const string &path);
+
+  /**
+   * Remove the grid
+   */
+  void clear();
+
+  /**
+   * Has a grid been read?
+   */
+  bool isSet() const { return _nx > 0; }
+
+  /**
+   * Get the id of the grid geometry. Grids read with the same
+   * geometry, for example successive model cycles, have the same
+   * id, so gate locations computed for one hold for the other.
+   * @return the id, 0 if no grid has been read
+   */
+  int getGeomId() const { return _geomId; }
+
+  /**
+   * Locate a point horizontally in the grid
+   * @param[in] latDeg The latitude
+   * @param[in] lonDeg The longitude
+   * @param[out] cell Index of the cell at the lower left of the point
+   * @param[out] wx Weight of the cell to the east
+   * @param[out] wy Weight of the cell to the north
+   */
+  void locate(double latDeg, double lonDeg,
+              int &cell, float &wx, float &wy) const;
+
+  /**
+   * Locate a height in the grid levels
+   * @param[in] htKm The height (km MSL)
+   * @param[out] level Index of the level below the height
+   * @param[out] wz Weight of the level above
+   */
+  void locateHt(double htKm, int &level, float &wz) const;
+
+  /**
+   * Interpolate the temperatures along a ray
+   * @param[in] nGates The number of gates
+   * @param[in] cell The cell of each gate, from locate()
+   * @param[in] wx The east weight of each gate
+   * @param[in] wy The north weight of each gate
+   * @param[in] level The level of each gate, from locateHt()
+   * @param[in] wz The upper weight of each gate
+   * @param[out] tempC The temperatures (C)
+   */
+  void gather(int nGates, const int *cell, const float *wx,
+              const float *wy, const int *level, const float *wz,
+              double *tempC) const;
+
+protected:
+
+private:
+
+  int _nx, _ny, _nz;
+  double _lon0Deg, _lat0Deg;
+  double _dLonDeg, _dLatDeg;
+  vector<double> _htKm;
+  vector<float> _tempC;
+
+  int _geomId;
+  static int _lastGeomId;
+
+  bool _sameGeom(int nx, int ny, int nz, const double *hdr,
+                 const vector<double> &htKm) const;
+
+};
+
+#endif
@@ -35,13 +35,6 @@
 ////////////////////////////////////////////////////////////////
 
 #include "TempProfile.hh"
-#if 0
-#include <toolsa/DateTime.hh>
-#include <Spdb/DsSpdb.hh>
-#include <Spdb/SoundingGet.hh>
-#include <rapformats/Sndg.hh>
-#include <physics/thermo.h>
-#endif
 #include <iostream>
 using namespace std;
 
@@ -72,6 +65,7 @@ TempProfile::TempProfile()
   _checkPressureMonotonicallyDecreasing = false;
   _useWetBulbTemp = false;
 
+  _soundingTime = 0;
   _tmpProfile.clear();
 
 }
@@ -86,6 +80,7 @@ TempProfile::~TempProfile()
 
 ////////////////////////////////////////////////////////////////////////
 // Get a valid temperature profile
+// The url is the path of a local sounding archive, see SoundingStore.
 // returns 0 on success, -1 on failure
 // on failure, tmpProfile will be empty
 
@@ -95,64 +90,58 @@ int TempProfile::getTempProfile(const string &url,
                                 vector<NcarParticleId::TmpPoint> &tmpProfile)
 
 {
-#if 0
+
   _tmpProfile.clear();
-  _soundingSpdbUrl = url;
+
+  if (!_store.isOpen() || url != _soundingSpdbUrl) {
+    _soundingSpdbUrl = url;
+    if (_store.open(url)) {
+      tmpProfile = _tmpProfile;
+      return -1;
+    }
+  }
+
   time_t earliestTime = dataTime - _soundingSearchTimeMarginSecs;
-  time_t searchTime = dataTime;
 
   if (_debug) {
-    cerr << "Searching for sounding, dataTime: "
-	 << DateTime::strm(dataTime) << endl;
+    cerr << "Searching for sounding, dataTime: " << dataTime << endl;
   }
 
-  while (searchTime >= earliestTime) {
+  int entry = _store.findClosestBefore(_soundingLocationName,
+                                       dataTime, earliestTime);
+  while (entry >= 0) {
 
-    // get a temperature profile
-    if (_getTempProfile(searchTime)) {
-      // failed - move back in time and try again
-      searchTime -= 3600;
-      if (_debug) {
-        cerr << "TempProfile::getTempProfile, url: " << url << endl;
-        cerr << "ERROR - could not retrieve sounding" << endl;
-        cerr << "  Moving back to search time: "
-             << DateTime::strm(searchTime) << endl;
-      }
-      continue;
-    }
-    
-    // check temp profile for QC
+    // get a temperature profile, and check it for QC
+
+    if (_getTempProfile(entry) == 0 && _checkTempProfile() == 0) {
+
+      // accept the current profile
+
+      soundingTime = _soundingTime;
+      tmpProfile = _tmpProfile;
 
-    if (_checkTempProfile()) {
-      // failed - move back in time and try again
-      searchTime -= 3600;
       if (_debug) {
         cerr << "TempProfile::getTempProfile, url: " << url << endl;
-        cerr << "ERROR - check failed" << endl;
-        cerr << "  Moving back to search time: "
-             << DateTime::strm(searchTime) << endl;
+        cerr << "  Got profile at time: " << _soundingTime << endl;
       }
-      continue;
-    }
 
-    // accept the current profile
+      _computeFreezingLevel();
 
-    soundingTime = _soundingTime;
-    tmpProfile = _tmpProfile;
+      return 0;
+
+    }
+
+    // failed - move back to the previous sounding and try again
 
     if (_debug) {
       cerr << "TempProfile::getTempProfile, url: " << url << endl;
-      cerr << "  Got profile at time: "
-           << DateTime::strm(_soundingTime) << endl;
+      cerr << "ERROR - sounding at time " << _soundingTime
+           << " could not be read or failed check" << endl;
     }
-    
-    _computeFreezingLevel();
+    entry = _store.findPrevious(entry, earliestTime);
 
-    return 0;
-  
   } // while
-#endif
-  
+
   _tmpProfile.clear();
   tmpProfile = _tmpProfile;
   return -1;
@@ -160,144 +149,43 @@ int TempProfile::getTempProfile(const string &url,
 }
 
 ////////////////////////////////////////////////////////////////////////
-// get temp profile from first sounding before given time.
+// get temp profile from an entry of the sounding archive.
 // returns 0 on success, -1 on failure
 
-int TempProfile::_getTempProfile(time_t searchTime)
+int TempProfile::_getTempProfile(int entry)
 
 {
-  return -1;
-#if 0
-  // read in sounding
 
-  int dataType = 0;
-  if (_soundingLocationName.size() > 0) {
-    dataType = Spdb::hash4CharsToInt32(_soundingLocationName.c_str());
-  }
+  _tmpProfile.clear();
+  _soundingTime = 0;
 
-  DsSpdb spdb;
-  if (spdb.getClosest(_soundingSpdbUrl,
-                      searchTime, _soundingSearchTimeMarginSecs,
-                      dataType, 0)) {
-    cerr << "ERROR - getTempProfile()" << endl;
-    cerr << "  Calling getFirstBefore for url: "
-         << _soundingSpdbUrl << endl;
-    cerr << "  Search time: " << DateTime::strm(searchTime) << endl;
-    cerr << "  margin (secs): " << _soundingSearchTimeMarginSecs << endl;
-    cerr << spdb.getErrStr() << endl;
+  vector<NcarParticleId::TmpPoint> sounding;
+  if (_store.readProfile(entry, _soundingTime, sounding)) {
     return -1;
   }
-  
+
   if (_debug) {
-    cerr << "=======>> Got spdb sounding" << endl;
-    cerr << "  Search time: " << DateTime::strm(searchTime) << endl;
-    cerr << "  margin (secs): " << _soundingSearchTimeMarginSecs << endl;
+    cerr << "INFO - overriding temp profile with sounding:" << endl;
     cerr << "  url: " << _soundingSpdbUrl << endl;
-    cerr << "  Prod label: " << spdb.getProdLabel() << endl;
-    cerr << "  Prod id:    " << spdb.getProdId() << endl;
-    cerr << "  N Chunks:   " << spdb.getNChunks() << endl;
-  }
-  
-  const vector<Spdb::chunk_t> &chunks = spdb.getChunks();
-  int nChunks = (int) chunks.size();
-  if (nChunks < 1) {
-    cerr << "ERROR - getTempProfile()" << endl;
-    cerr << "  Bad sounding" << endl;
-    return -1;
+    cerr << "  launchTime: " << _soundingTime << endl;
+    cerr << "  nPoints: " << sounding.size() << endl;
+    cerr << "  site: " << _soundingLocationName << endl;
   }
 
-  _tmpProfile.clear();
-  int prodId = spdb.getProdId();
-  _soundingTime = 0;
-  
-  if (prodId == SPDB_SNDG_ID) {
-
-    // older type sounding
-    
-    SNDG_spdb_product_t *sounding = (SNDG_spdb_product_t *) chunks[0].data;
-    SNDG_spdb_product_from_BE(sounding);
-    if (_debug) {
-      cerr << "INFO - overriding temp profile with sounding:" << endl;
-      cerr << "  url: " << _soundingSpdbUrl << endl;
-      cerr << "  launchTime: " << DateTime::strm(sounding->launchTime) << endl; 
-      cerr << "  nPoints: " << sounding->nPoints << endl;
-      cerr << "  site: " << sounding->siteName << endl;
-    }
-    
-    _soundingTime = sounding->launchTime;
-    
-    int dataOffset =
-      sizeof(SNDG_spdb_product_t) - sizeof(SNDG_spdb_point_t);
-    SNDG_spdb_point_t *dataPtr = 
-      (SNDG_spdb_point_t *) ((char *) sounding + dataOffset);
-    for(int ipoint = 0; ipoint < sounding->nPoints; ipoint++ ) {
-      if (dataPtr->pressure > -999 &&
-          dataPtr->altitude > -999 &&
-          dataPtr->temp > -999) {
-        double pressHpa = dataPtr->pressure;
-        double htKm = dataPtr->altitude / 1000.0 + _heightCorrectionKm;
-        double tempC = dataPtr->temp;
-        double rh = dataPtr->rh;
-        if (_useWetBulbTemp && rh >= 0) {
-          double dewptC = PHYrhdp(tempC, rh);
-          double tWet = PHYtwet(pressHpa, tempC, dewptC);
-          NcarParticleId::TmpPoint tmpPt(pressHpa, htKm, tWet);
-          _tmpProfile.push_back(tmpPt);
-        } else {
-          NcarParticleId::TmpPoint tmpPt(pressHpa, htKm, tempC);
-          _tmpProfile.push_back(tmpPt);
-        }
-      }
-      dataPtr++;
-    }
-    
-  } else if (prodId == SPDB_SNDG_PLUS_ID) {
-    
-    Sndg sounding;
-    if (sounding.disassemble(chunks[0].data, chunks[0].len)) {
-      cerr << "ERROR - getTempProfile" << endl;
-      cerr << "  Cannot disassemble chunk" << endl;
-      cerr << "url: " << _soundingSpdbUrl << endl;
-      return -1;
+  for (size_t ipoint = 0; ipoint < sounding.size(); ipoint++) {
+    const NcarParticleId::TmpPoint &pt = sounding[ipoint];
+    if (pt.pressHpa > -999 &&
+        pt.htKm * 1000.0 > -999 &&
+        pt.tmpC > -999) {
+      NcarParticleId::TmpPoint tmpPt(pt.pressHpa,
+                                     pt.htKm + _heightCorrectionKm,
+                                     pt.tmpC);
+      _tmpProfile.push_back(tmpPt);
     }
-    
-    if (_debug) {
-      const Sndg::header_t &hdr = sounding.getHeader();
-      cerr << "INFO - overriding temp profile with sounding:" << endl;
-      cerr << "  url: " << _soundingSpdbUrl << endl;
-      cerr << "  launchTime: " << DateTime::strm(hdr.launchTime) << endl; 
-      cerr << "  nPoints: " << hdr.nPoints << endl;
-      cerr << "  site: " << hdr.siteName << endl;
-    } 
-
-    _soundingTime = sounding.getHeader().launchTime;
-
-    const vector<Sndg::point_t> &pts = sounding.getPoints();
-    for (size_t ii = 0; ii < pts.size(); ii++) {
-      const Sndg::point_t &pt = pts[ii];
-      if (pt.pressure > -9999 &&
-          pt.altitude > -999 &&
-          pt.temp > -999) {
-        double pressHpa = pt.pressure;
-        double htKm = pt.altitude / 1000.0;
-        double tempC = pt.temp;
-        double dewptC = pt.dewpt;
-        if (_useWetBulbTemp && dewptC > -999) {
-          double tWet = PHYtwet(pressHpa, tempC, dewptC);
-          NcarParticleId::TmpPoint tmpPt(pressHpa, htKm, tWet);
-          _tmpProfile.push_back(tmpPt);
-        } else {
-          NcarParticleId::TmpPoint tmpPt(pressHpa, htKm, tempC);
-          _tmpProfile.push_back(tmpPt);
-        }
-      }
-    }
-
   }
 
   return 0;
   
-#endif
 }
 
 ////////////////////////////////////////////////////////////////////////
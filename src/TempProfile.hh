@@ -39,6 +39,7 @@
 
 #include <string>
 #include "NcarParticleId.hh"
+#include "SoundingStore.hh"
 
 using namespace std;
 
@@ -54,7 +55,10 @@ public:
   
   ~TempProfile();
 
-  // get a valid temperature profile
+  // get a valid temperature profile, from the local sounding
+  // archive at url (see SoundingStore): the latest sounding for
+  // the location name, at or before dataTime, within the search
+  // margin, which passes the checks.
   // returns 0 on success, -1 on failure
   // on failure, tmpProfile will be empty
 
@@ -120,6 +124,7 @@ public:
   }
 
   // set to use wet-bulb temp instead of dry bulb
+  // not applied to the local sounding archive, which holds no humidity
 
   void setUseWetBulbTemp(bool val) {
     _useWetBulbTemp = val;
@@ -211,9 +216,11 @@ private:
 
   double _heightCorrectionKm; /* correction made to sounding heights
                                * as they are read in */
+
+  SoundingStore _store; /* local sounding archive, if opened */
   // methods
 
-  int _getTempProfile(time_t searchTime);
+  int _getTempProfile(int entry);
   int _checkTempProfile();
   void _computeFreezingLevel();
 
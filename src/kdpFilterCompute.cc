@@ -1,51 +1,490 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
 
+This file is an add-on to RAVE.
 
-int kdpFilterCompute(PolarScan_t *scan) {
-  PolarScanParam_t *SNR = NULL;
-  PolarScanParam_t *DBZH = NULL;
-  PolarScanParam_t *ZDR = NULL;
-  PolarScanParam_t *RHOHV = NULL;
-  PolarScanParam_t *PHIDP = NULL;
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
 
-  RaveAttribute_t *attr = NULL;
-  double **darrvalue = NULL;
-  long **larrvalue = NULL;
-  
-  time_t timeSecs;          /* what is this? */
-  double timeFractionSecs;  /* what is this? */
-  double elevDeg;
-  double azDeg;
-  double wavelengthCm;
-  int nGates;
-  double startRangeKm;
-  double gateSpacingKm;
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/**
+ * Interface to NCAR's KDP derivation, coded by Mike Dixon. Each ray is
+ * processed independently, so rays are shared between threads, each thread
+ * with its own KdpFilt workspace.
+ * @file
+ * @author Daniel Michelson, Environment and Climate Change Canada
+ * @date 2019-11-25
+ */
+
+#include "ncar_kdp.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#ifdef PTHREAD_SUPPORTED
+#include <pthread.h>
+#endif
+
+#define RAD_TO_DEG (180.0/M_PI)
+
+static double missing = -9999.0;
+static int kdp_nthreads = 1;
+static int kdp_psob = 0;
+static int kdp_atten_corr = 0;
+static double kdp_max_range_km = 0.0;
+static int kdp_composite = 0;
+static KdpFilt::fir_filter_len_t kdp_fir_len = KdpFilt::FIR_LENGTH_20;
+static int kdp_n_iter_unfolded = 2;
+static int kdp_n_iter_cond = 4;
+static int kdp_iterative = 0;
+static double kdp_iter_tolerance = -1.0;
+
+/* Diagnostics file, shared by all the KdpFilt workspaces */
+static KdpDiagSink kdp_diag;
+
+/* Persistent KdpFilt workspaces, one per thread, re-used from scan to scan
+   so that their arrays are only reallocated when the rays get longer. */
+static KdpFilt *kdp_pool[KDP_MAX_THREADS] = { NULL };
+
+
+/* Begin internal working functions */
+
+/**
+ * Arguments for processing a subset of the rays of a scan. Inputs are 
+ * nrays*nbins planes, set to NULL if not available. Outputs are written
+ * to the same positions in their planes.
+ */
+typedef struct {
+  KdpFilt *filt;
+  int first_ray;
+  int ray_stride;
+  int nrays;
+  int nbins;
+  KdpScanInfo_t info;
   const double *snr;
   const double *dbz;
   const double *zdr;
   const double *rhohv;
   const double *phidp;
-  double missingValue;  /* undetect or nodata for KDP? */
+  double *kdp;
+  double *psob;
+  double *dbz_atten_corr;
+  double *zdr_atten_corr;
+  long iter_sum;   /* conditioned phidp filter iterations, over rays ... */
+  int iter_max;    /* ... and the most for one ray */
+  int iter_nrays;  /* ... for the rays with valid PHIDP */
+} KdpRays_t;
 
-  if (PolarScan_hasParameter(scan, "SNR")) {
-    SNR = PolarScan_getParameter("SNR");
+
+/**
+ * Returns the KdpFilt workspace for a given thread, creating it on first use.
+ * @param[in] int - thread index
+ * @returns KdpFilt* object, owned by the pool
+ */
+KdpFilt* getKdpFilt(int thread) {
+  if (kdp_pool[thread] == NULL) {
+    kdp_pool[thread] = new KdpFilt();
   }
-  if (PolarScan_hasParameter(scan, "DBZH")) {
-    DBZH = PolarScan_getParameter("DBZH");
+  return kdp_pool[thread];
+}
+
+
+/**
+ * Extracts a whole parameter as an nrays*nbins array of doubles, converted
+ * to physical values. Both nodata and undetect are set to "missing".
+ * This object needs to be released following use.
+ * @param[in] scan - input polar scan
+ * @param[in] string - the parameter's quantity identifier
+ * @param[in] int - number of bins in each ray
+ * @param[in] int - number of rays
+ * @returns double* array, or NULL if the scan doesn't contain the parameter
+ */
+double* getPlane(PolarScan_t *scan, const char* paramname, int nbins, int nrays) {
+  if (!PolarScan_hasParameter(scan, paramname)) return NULL;
+  PolarScanParam_t *param = PolarScan_getParameter(scan, paramname);
+  double* PLANE = (double*)RAVE_MALLOC(nrays * nbins * sizeof(double));
+  RaveValueType vtype;
+  double value;
+
+  for (int ray = 0; ray < nrays; ray++) {
+    double *RAY = PLANE + ray * nbins;
+    for (int bin = 0; bin < nbins; bin++) {
+      vtype = PolarScanParam_getConvertedValue(param, bin, ray, &value);
+      RAY[bin] = (vtype == RaveValueType_DATA) ? value : missing;
+    }
   }
-  if (PolarScan_hasParameter(scan, "ZDR")) {
-    ZDR  = PolarScan_getParameter("ZDR");
+  RAVE_OBJECT_RELEASE(param);
+  return PLANE;
+}
+
+
+/**
+ * Reads the scan's nominal start time, if available, for KdpFilt's debug
+ * output.
+ * @param[in] scan - input polar scan
+ * @returns time_t seconds since the epoch, 0 if not known
+ */
+time_t getScanTime(PolarScan_t *scan) {
+  const char *date = PolarScan_getStartDate(scan);
+  const char *hms = PolarScan_getStartTime(scan);
+  struct tm tms;
+  if ( (date == NULL) || (hms == NULL) ) return 0;
+  memset(&tms, 0, sizeof(tms));
+  if (sscanf(date, "%4d%2d%2d", &tms.tm_year, &tms.tm_mon, &tms.tm_mday) != 3) return 0;
+  if (sscanf(hms, "%2d%2d%2d", &tms.tm_hour, &tms.tm_min, &tms.tm_sec) != 3) return 0;
+  tms.tm_year -= 1900;
+  tms.tm_mon -= 1;
+  return timegm(&tms);
+}
+
+
+/**
+ * Derives KDP for a subset of rays, first_ray, first_ray + ray_stride, ...
+ * @param[in] void* - pointer to a KdpRays_t object
+ * @returns NULL
+ */
+void* computeKdpRays(void *args) {
+  KdpRays_t *kr = (KdpRays_t*)args;
+  KdpFilt *filt = kr->filt;
+  int nbins = kr->nbins;
+
+  for (int ray = kr->first_ray; ray < kr->nrays; ray += kr->ray_stride) {
+    int offset = ray * nbins;
+    double az_deg = kdpRayAzimuth(&kr->info, ray);
+
+    filt->compute(kr->info.time_secs, 0.0, kr->info.elev_deg, az_deg,
+		  kr->info.wavelength_cm, nbins,
+		  kr->info.start_range_km, kr->info.gate_spacing_km,
+		  (kr->snr) ? kr->snr + offset : NULL,
+		  (kr->dbz) ? kr->dbz + offset : NULL,
+		  (kr->zdr) ? kr->zdr + offset : NULL,
+		  (kr->rhohv) ? kr->rhohv + offset : NULL,
+		  kr->phidp + offset,
+		  missing);
+
+    memcpy(kr->kdp + offset, filt->getKdp(), nbins * sizeof(double));
+    if (kr->psob) {
+      memcpy(kr->psob + offset, filt->getPsob(), nbins * sizeof(double));
+    }
+    if (kr->dbz_atten_corr) {
+      memcpy(kr->dbz_atten_corr + offset, filt->getDbzAttenCorr(), nbins * sizeof(double));
+      memcpy(kr->zdr_atten_corr + offset, filt->getZdrAttenCorr(), nbins * sizeof(double));
+    }
+    int niter = filt->getNFiltIterCondUsed();
+    if (niter > 0) {
+      kr->iter_sum += niter;
+      if (niter > kr->iter_max) kr->iter_max = niter;
+      kr->iter_nrays++;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Adds the numbers of filter iterations used on the conditioned PHIDP to
+ * the KDP parameter: the mean over the rays with valid PHIDP as 
+ * how/kdp_cond_iterations, and the most for one ray as
+ * how/kdp_cond_iterations_max.
+ * @param[in] param - the KDP parameter
+ * @param[in] KdpRays_t* - the threads' arguments, holding their counts
+ * @param[in] int - number of threads
+ */
+void addIterationCounts(PolarScanParam_t *param, KdpRays_t *args, int nthreads) {
+  long sum = 0;
+  int nrays = 0, most = 0;
+  for (int ithread = 0; ithread < nthreads; ithread++) {
+    sum += args[ithread].iter_sum;
+    nrays += args[ithread].iter_nrays;
+    if (args[ithread].iter_max > most) most = args[ithread].iter_max;
   }
-  if (PolarScan_hasParameter(scan, "RHOHV")) {
-    RHOHV  = PolarScan_getParameter("RHOHV");
+  RaveAttribute_t *attr = (RaveAttribute_t*)RAVE_OBJECT_NEW(&RaveAttribute_TYPE);
+  RaveAttribute_setName(attr, "how/kdp_cond_iterations");
+  RaveAttribute_setDouble(attr, (nrays > 0) ? (double)sum / nrays : 0.0);
+  PolarScanParam_addAttribute(param, attr);
+  RAVE_OBJECT_RELEASE(attr);
+  attr = (RaveAttribute_t*)RAVE_OBJECT_NEW(&RaveAttribute_TYPE);
+  RaveAttribute_setName(attr, "how/kdp_cond_iterations_max");
+  RaveAttribute_setLong(attr, (long)most);
+  PolarScanParam_addAttribute(param, attr);
+  RAVE_OBJECT_RELEASE(attr);
+}
+
+/* End internal working functions */
+/* Begin interface */
+
+
+void setKdpOptions(int nthreads, int psob, int atten_corr, double max_range_km,
+		   int composite) {
+  if (nthreads < 1) nthreads = 1;
+  if (nthreads > KDP_MAX_THREADS) nthreads = KDP_MAX_THREADS;
+  kdp_nthreads = nthreads;
+  kdp_psob = psob;
+  kdp_atten_corr = atten_corr;
+  kdp_max_range_km = max_range_km;
+  kdp_composite = composite;
+}
+
+
+int setKdpFirFilter(int fir_len, int n_iter_unfolded, int n_iter_cond) {
+  KdpFilt::fir_filter_len_t len;
+  switch (fir_len) {
+  case 125: len = KdpFilt::FIR_LENGTH_125; break;
+  case 60: len = KdpFilt::FIR_LENGTH_60; break;
+  case 40: len = KdpFilt::FIR_LENGTH_40; break;
+  case 30: len = KdpFilt::FIR_LENGTH_30; break;
+  case 20: len = KdpFilt::FIR_LENGTH_20; break;
+  case 10: len = KdpFilt::FIR_LENGTH_10; break;
+  default: return 0;
   }
-  if (PolarScan_hasParameter(scan, "PHIDP")) {
-    PHIDP  = PolarScan_getParameter("PHIDP");
+  if ( (n_iter_unfolded < 1) || (n_iter_cond < 1) ) return 0;
+  kdp_fir_len = len;
+  kdp_n_iter_unfolded = n_iter_unfolded;
+  kdp_n_iter_cond = n_iter_cond;
+  return 1;
+}
+
+
+void setKdpIterativeFiltering(int iterative, double tolerance) {
+  kdp_iterative = iterative;
+  kdp_iter_tolerance = tolerance;
+}
+
+
+int setKdpDiagnostics(const char *path, double min_elev, double max_elev,
+		      double min_az, double max_az) {
+  if ( (path == NULL) || (*path == '\0') ) {
+    kdp_diag.close();
+    return 1;
   }
+  kdp_diag.setElevationLimits(min_elev, max_elev);
+  kdp_diag.setAzimuthLimits(min_az, max_az);
+  return (kdp_diag.open(path) == 0) ? 1 : 0;
+}
+
+
+int kdpFilterCompute(PolarScan_t *scan) {
+  PolarScanParam_t *param = NULL;
+  KdpRays_t args[KDP_MAX_THREADS];
+  KdpScanInfo_t info;
+  int nrays, nbins, nthreads, ithread;
 
-  nGates = (int)PolarScan_getNrays(scan);
+  if (!PolarScan_hasParameter(scan, "PHIDP")) {
+    /* alert: required parameter missing */
+    return 0;
+  }
+  nrays = (int)PolarScan_getNrays(scan);
   nbins = (int)PolarScan_getNbins(scan);
-  gateSpacingKm = PolarScan.getRscale(scan) / 1000.0;
-  elevDeg = polarScan_getElangle(scan) * RAD_TO_DEG;
+  if ( (nrays < 1) || (nbins < 1) ) return 0;
+
+  /* Read out moments in the calling thread. SNRH is used if present,
+     but not estimated here. */
+  double *snr = getPlane(scan, "SNRH", nbins, nrays);
+  double *dbz = getPlane(scan, "DBZH", nbins, nrays);
+  double *zdr = getPlane(scan, "ZDR", nbins, nrays);
+  double *rhohv = getPlane(scan, "RHOHV", nbins, nrays);
+  double *phidp = getPlane(scan, "PHIDP", nbins, nrays);
+
+  size_t planesize = (size_t)nrays * nbins * sizeof(double);
+  double *kdp = (double*)RAVE_MALLOC(planesize);
+  double *psob = (kdp_psob) ? (double*)RAVE_MALLOC(planesize) : NULL;
+  double *dbz_atten_corr = (kdp_atten_corr) ? (double*)RAVE_MALLOC(planesize) : NULL;
+  double *zdr_atten_corr = (kdp_atten_corr) ? (double*)RAVE_MALLOC(planesize) : NULL;
+
+#ifdef PTHREAD_SUPPORTED
+  nthreads = (kdp_nthreads < nrays) ? kdp_nthreads : nrays;
+#else
+  nthreads = 1;
+#endif
+
+  for (ithread = 0; ithread < nthreads; ithread++) {
+    KdpRays_t *kr = &args[ithread];
+    kr->filt = getKdpFilt(ithread);
+    kdpSetupScan(scan, kr->filt, kdp_atten_corr, kdp_max_range_km, &info);
+    kr->filt->setUseIterativeFiltering(kdp_iterative != 0);
+    kr->filt->setFIRFilterLen(kdp_fir_len);
+    kr->filt->setNFiltIterUnfolded(kdp_n_iter_unfolded);
+    kr->filt->setNFiltIterCond(kdp_n_iter_cond);
+    kr->filt->setUseCompositeFilter(kdp_composite != 0);
+    kr->filt->setIterCondConvergence(kdp_iter_tolerance >= 0.0, kdp_iter_tolerance);
+    kr->first_ray = ithread;
+    kr->ray_stride = nthreads;
+    kr->nrays = nrays;
+    kr->nbins = nbins;
+    kr->info = info;
+    kr->snr = snr;
+    kr->dbz = dbz;
+    kr->zdr = zdr;
+    kr->rhohv = rhohv;
+    kr->phidp = phidp;
+    kr->kdp = kdp;
+    kr->psob = psob;
+    kr->dbz_atten_corr = dbz_atten_corr;
+    kr->zdr_atten_corr = zdr_atten_corr;
+    kr->iter_sum = 0;
+    kr->iter_max = 0;
+    kr->iter_nrays = 0;
+  }
+
+#ifdef PTHREAD_SUPPORTED
+  pthread_t threads[KDP_MAX_THREADS];
+  int started = 0;
+  for (ithread = 1; ithread < nthreads; ithread++) {
+    if (pthread_create(&threads[ithread], NULL, computeKdpRays, &args[ithread])) break;
+    started = ithread;
+  }
+  computeKdpRays(&args[0]);
+  /* Any rays of threads which could not be started are done here */
+  for (ithread = started + 1; ithread < nthreads; ithread++) {
+    computeKdpRays(&args[ithread]);
+  }
+  for (ithread = 1; ithread <= started; ithread++) {
+    pthread_join(threads[ithread], NULL);
+  }
+#else
+  computeKdpRays(&args[0]);
+#endif
+
+  /* Add results to the scan, replacing any existing parameters */
+  param = planeParam("KDP", kdp, nbins, nrays);
+  if (kdp_iterative) {
+    addIterationCounts(param, args, nthreads);
+  }
+  PolarScan_addParameter(scan, param);
+  RAVE_OBJECT_RELEASE(param);
+  if (psob) {
+    param = planeParam("PSOB", psob, nbins, nrays);
+    PolarScan_addParameter(scan, param);
+    RAVE_OBJECT_RELEASE(param);
+  }
+  if (dbz_atten_corr) {
+    param = planeParam("PIA", dbz_atten_corr, nbins, nrays);
+    PolarScan_addParameter(scan, param);
+    RAVE_OBJECT_RELEASE(param);
+    param = planeParam("PIDA", zdr_atten_corr, nbins, nrays);
+    PolarScan_addParameter(scan, param);
+    RAVE_OBJECT_RELEASE(param);
+  }
+
+  if (snr) RAVE_FREE(snr);
+  if (dbz) RAVE_FREE(dbz);
+  if (zdr) RAVE_FREE(zdr);
+  if (rhohv) RAVE_FREE(rhohv);
+  RAVE_FREE(phidp);
+  RAVE_FREE(kdp);
+  if (psob) RAVE_FREE(psob);
+  if (dbz_atten_corr) RAVE_FREE(dbz_atten_corr);
+  if (zdr_atten_corr) RAVE_FREE(zdr_atten_corr);
+  return 1;
+}
+
+
+void kdpSetupScan(PolarScan_t *scan, KdpFilt *filt, int atten_corr,
+		  double max_range_km, KdpScanInfo_t *info) {
+  RaveAttribute_t *attr = NULL;
+  PolarScanParam_t *param = NULL;
+
+  /* ODIM how/wavelength is in cm */
+  info->wavelength_cm = KDP_DEFAULT_WAVELENGTH;
+  if (PolarScan_hasAttribute(scan, "how/wavelength")) {
+    attr = PolarScan_getAttribute(scan, "how/wavelength");
+    RaveAttribute_getDouble(attr, &info->wavelength_cm);
+    RAVE_OBJECT_RELEASE(attr);
+  }
+
+  /* For 8 and 16-bit PHIDP, let KdpFilt tabulate sin and cos per level */
+  int phidp_levels = 0;
+  param = PolarScan_getParameter(scan, "PHIDP");
+  double phidp_gain = PolarScanParam_getGain(param);
+  double phidp_offset = PolarScanParam_getOffset(param);
+  switch (PolarScanParam_getDataType(param)) {
+  case RaveDataType_UCHAR:
+    phidp_levels = 256;
+    break;
+  case RaveDataType_USHORT:
+    phidp_levels = 65536;
+    break;
+  default:
+    break;
+  }
+  RAVE_OBJECT_RELEASE(param);
+
+  info->time_secs = getScanTime(scan);
+  info->elev_deg = PolarScan_getElangle(scan) * RAD_TO_DEG;
+  info->gate_spacing_km = PolarScan_getRscale(scan) * 0.001;
+  info->start_range_km = PolarScan_getRstart(scan) + 0.5 * info->gate_spacing_km; /* centre of first bin */
+  getRayAzimuths(scan, &info->first_az_deg, &info->az_spacing_deg);
+
+  filt->setComputeAttenCorr(atten_corr != 0);
+  filt->setMaxRangeKm(max_range_km > 0.0, max_range_km);
+  filt->setPhidpQuantisation(phidp_gain, phidp_offset, phidp_levels);
+  filt->setDiagSink((kdp_diag.isOpen()) ? &kdp_diag : NULL);
+}
+
+
+void getRayAzimuths(PolarScan_t *scan, double *az0_deg, double *daz_deg) {
+  int nrays = (int)PolarScan_getNrays(scan);
+  RaveAttribute_t *attr = NULL;
+  double *startaz = NULL;
+  int n_startaz = 0;
+  double az0 = 0.0;
+  double daz = (nrays > 0) ? 360.0 / nrays : 360.0;
+
+  if (PolarScan_hasAttribute(scan, "how/startazA")) {
+    attr = PolarScan_getAttribute(scan, "how/startazA");
+    if ( (RaveAttribute_getDoubleArray(attr, &startaz, &n_startaz)) &&
+	 (n_startaz == nrays) && (nrays > 1) ) {
+      /* mean step from ray to ray, each step taken the short way round */
+      double sum = 0.0;
+      for (int ray = 1; ray < nrays; ray++) {
+	sum += remainder(startaz[ray] - startaz[ray-1], 360.0);
+      }
+      daz = sum / (nrays - 1);
+      az0 = startaz[0] + 0.5 * daz;
+    }
+    RAVE_OBJECT_RELEASE(attr);
+  } else if (PolarScan_hasAttribute(scan, "how/astart")) {
+    attr = PolarScan_getAttribute(scan, "how/astart");
+    RaveAttribute_getDouble(attr, &az0);
+    RAVE_OBJECT_RELEASE(attr);
+  }
+
+  az0 = fmod(az0, 360.0);
+  if (az0 < 0.0) az0 += 360.0;
+  *az0_deg = rint(az0 * 100.0) / 100.0;
+  if (nrays * fabs(daz) > 360.0 - 0.5 * fabs(daz)) {
+    *daz_deg = (daz < 0.0) ? -360.0 / nrays : 360.0 / nrays;
+  } else {
+    *daz_deg = rint(daz * 100.0) / 100.0;
+  }
+}
+
+
+double kdpRayAzimuth(const KdpScanInfo_t *info, int ray) {
+  double az = fmod(info->first_az_deg + ray * info->az_spacing_deg, 360.0);
+  return (az < 0.0) ? az + 360.0 : az;
+}
 
 
+PolarScanParam_t* planeParam(const char* name, double *data, int nbins, int nrays) {
+  PolarScanParam_t *param = (PolarScanParam_t*)RAVE_OBJECT_NEW(&PolarScanParam_TYPE);
+  PolarScanParam_setGain(param, KDP_GAIN);
+  PolarScanParam_setOffset(param, KDP_OFFSET);
+  PolarScanParam_setNodata(param, missing);
+  PolarScanParam_setUndetect(param, missing);
+  PolarScanParam_setQuantity(param, name);
+  PolarScanParam_setData(param, (long)nbins, (long)nrays, (void*)data, RaveDataType_DOUBLE);
+  RaveAttribute_t *ph = (RaveAttribute_t*)RAVE_OBJECT_NEW(&RaveAttribute_TYPE);
+  RaveAttribute_setName(ph, "how/task");
+  RaveAttribute_setString(ph, (const char*)KDP_HOW);
+  PolarScanParam_addAttribute(param, ph);
+  RAVE_OBJECT_RELEASE(ph);
+  return param;
 }
@@ -25,21 +25,175 @@ along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
 #ifndef NCAR_KDP_H
 #define NCAR_KDP_H
 #include <math.h>
+#include <time.h>
 
 extern "C" {
 #include "rave_object.h"
 #include "rave_attribute.h"
 #include "polarscan.h"
 #include "polarscanparam.h"
+#include "rave_alloc.h"
 }
 #include "KdpFilt.hh"
+#include "KdpDiagSink.hh"
+
+#define KDP_GAIN 1.0
+#define KDP_OFFSET 0.0
+#define KDP_MAX_THREADS 64
+#define KDP_DEFAULT_WAVELENGTH 10.0  /* cm, S band */
+#define KDP_HOW "us.ncar.kdp"
+
+/**
+ * Time, geometry and wavelength of a scan, as needed to derive KDP along
+ * its rays.
+ */
+typedef struct {
+  time_t time_secs;
+  double elev_deg;        /* degrees */
+  double wavelength_cm;
+  double start_range_km;  /* centre of the first bin */
+  double gate_spacing_km;
+  double first_az_deg;    /* centre of the first ray, see getRayAzimuths */
+  double az_spacing_deg;  /* negative if the antenna turns counter-clockwise */
+} KdpScanInfo_t;
+
+/**
+ * Set the options used by kdpFilterCompute.
+ * @param[in] int - number of threads over which to share the rays. Only has 
+ * an effect when built with pthread support, otherwise rays are processed 
+ * sequentially.
+ * @param[in] int - boolean whether to add phase shift on backscatter (PSOB, 
+ * degrees) to the scan (1) or not (0)
+ * @param[in] int - boolean whether to compute attenuation corrections from 
+ * KDP and add them to the scan (1) or not (0). The corrections are added as 
+ * path-integrated attenuation PIA (dB) for DBZH and PIDA (dB) for ZDR.
+ * @param[in] double - maximum range (km) to which KDP is derived, e.g. to 
+ * leave out a test pulse. Gates beyond it are not processed: KDP is 0 there 
+ * and the attenuation corrections keep their value at this range. 0 or less 
+ * means no limit.
+ * @param[in] int - boolean whether to apply the repeated FIR filter passes 
+ * as one composite filter (1) or to iterate them (0). KDP agrees with the 
+ * iterated filter to rounding precision. The composite filter is only used 
+ * where it is cheaper, i.e. for long filters with many passes on long rays 
+ * (see setKdpFirFilter), and not for iterative filtering of the conditioned 
+ * PHIDP.
+ */
+void setKdpOptions(int nthreads, int psob, int atten_corr, double max_range_km,
+		   int composite);
+
+/**
+ * Set the FIR filter used by kdpFilterCompute on PHIDP.
+ * @param[in] int - filter length (gates): 125, 60, 40, 30, 20 (default) or 10
+ * @param[in] int - number of passes of the filter over the unfolded PHIDP, 
+ * default 2
+ * @param[in] int - number of passes of the filter over the conditioned 
+ * PHIDP, default 4. For iterative filtering, the most iterations.
+ * @returns 1 upon success, 0 if the length is not one of those listed or 
+ * a number of passes is less than 1
+ */
+int setKdpFirFilter(int fir_len, int n_iter_unfolded, int n_iter_cond);
+
+/**
+ * Set the filtering used by kdpFilterCompute on the conditioned PHIDP.
+ * @param[in] int - boolean whether to use iterative filtering (1) or the 
+ * conditional filtering method (0, default)
+ * @param[in] double - for iterative filtering, stop iterating once the max 
+ * change in PHIDP over an iteration is no more than this tolerance 
+ * (degrees). 0 stops only at a fixed point, giving the same result as 
+ * running all the iterations. Negative values always run all the 
+ * iterations (default).
+ * With iterative filtering, the mean and max numbers of iterations used 
+ * per ray are added to KDP as how/kdp_cond_iterations and 
+ * how/kdp_cond_iterations_max.
+ */
+void setKdpIterativeFiltering(int iterative, double tolerance);
+
+/**
+ * Write the intermediate arrays of the KDP derivation for selected rays 
+ * to a binary diagnostics file, e.g. unfolded, filtered and conditioned 
+ * PHIDP, PSOB, KDP and the validity flags of each bin. Rays are written by 
+ * a background thread, so processing does not wait for the disk. Applies 
+ * to kdpFilterCompute and to KDP derived for PID. Read the file with 
+ * Lib/kdp_diag.py.
+ * @param[in] string - path of the file, replacing any existing file. NULL 
+ * or empty closes the file being written, ending the diagnostics.
+ * @param[in] double - minimum elevation angle (degrees) of the rays written
+ * @param[in] double - maximum elevation angle (degrees) of the rays written
+ * @param[in] double - minimum azimuth (degrees) of the rays written
+ * @param[in] double - maximum azimuth (degrees) of the rays written. If less 
+ * than the minimum, the sector includes north. The azimuth of a ray is that 
+ * of its centre, from getRayAzimuths.
+ * @returns 1 upon success, otherwise 0
+ */
+int setKdpDiagnostics(const char *path, double min_elev, double max_elev,
+		      double min_az, double max_az);
 
 /**
  * For an input polar scan (or possibly RHI), derive KDP using NCAR's 
  * algorithm and code. This approach has been developed for S band.
+ * PHIDP is required. DBZH, ZDR, RHOHV and SNRH are used if available.
+ * The wavelength is read from how/wavelength (cm), otherwise S band is 
+ * assumed. KDP is added to the scan as double data, replacing any existing 
+ * KDP parameter, together with PSOB and attenuation corrections if requested 
+ * using setKdpOptions.
  * @param[in] scan - input polar scan
  * @returns 1 upon success, otherwise 0
  */
 int kdpFilterCompute(PolarScan_t *scan);
+
+/**
+ * Prepares a KdpFilt object for the rays of a scan, in the same way as 
+ * kdpFilterCompute does: sets the attenuation correction option, the 
+ * maximum range, the PHIDP quantisation and the diagnostics file, and 
+ * reads the scan's time, geometry, including the ray azimuths, and 
+ * wavelength.
+ * @param[in] scan - input polar scan, containing PHIDP
+ * @param[in] KdpFilt* - the object to prepare
+ * @param[in] int - boolean whether to compute attenuation corrections (1) 
+ * or not (0)
+ * @param[in] double - maximum range (km) to process, 0 or less for no limit
+ * @param[out] KdpScanInfo_t* - the scan's time, geometry and wavelength
+ */
+void kdpSetupScan(PolarScan_t *scan, KdpFilt *filt, int atten_corr,
+		  double max_range_km, KdpScanInfo_t *info);
+
+/**
+ * Gets the azimuths of the rays of a scan, as the azimuth of the first ray 
+ * and the spacing between rays, which is negative if the antenna turns 
+ * counter-clockwise and 0 for an RHI. They are taken from how/startazA if 
+ * the scan has one start azimuth per ray. Otherwise the rays are taken to 
+ * cover the full circle evenly, in the same way as RAVE looks rays up by 
+ * azimuth, with the first ray at how/astart, or at north without it. So 
+ * that small differences in the antenna positions from volume to volume 
+ * don't matter, the azimuth is rounded to 0.01 degrees, and so is the 
+ * spacing, unless the rays cover the full circle to within half a ray, in 
+ * which case it is exactly 360 degrees over the number of rays.
+ * @param[in] scan - input polar scan
+ * @param[out] double* - azimuth of the centre of the first ray, degrees
+ * @param[out] double* - spacing between the rays, degrees
+ */
+void getRayAzimuths(PolarScan_t *scan, double *az0_deg, double *daz_deg);
+
+/**
+ * Azimuth of the centre of a ray, as passed to KdpFilt, e.g. to select the 
+ * rays written to the diagnostics file.
+ * @param[in] KdpScanInfo_t* - the scan's geometry, from kdpSetupScan
+ * @param[in] int - the ray
+ * @returns the azimuth, degrees in [0, 360)
+ */
+double kdpRayAzimuth(const KdpScanInfo_t *info, int ray);
+
+/**
+ * Creates a parameter of double data from an nrays*nbins array. Both nodata
+ * and undetect are set to the missing value used by KdpFilt. Gain and offset
+ * values give no scaling. The data are copied.
+ * This object needs to be released following use.
+ * @param[in] string - the parameter's quantity identifier
+ * @param[in] double* - the data
+ * @param[in] int - number of bins in each ray
+ * @param[in] int - number of rays
+ * @returns PolarScanParam_t* object
+ */
+PolarScanParam_t* planeParam(const char* name, double *data, int nbins, int nrays);
   
 #endif
@@ -26,11 +26,34 @@ along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
  */
 
 #include "ncar_pid.h"
+#include "ncar_kdp.h"
+#include <string.h>
+
+#define RAD_TO_DEG (180.0/M_PI)
+
 static double missing = -9999.0;
+static int texture_nrays = 0;   /* 0 or 1 means texture along range only */
+static int texture_ngates = 9;
+static int pid_compute_kdp = 0; /* derive KDP along each ray before PID */
+static int pid_keep_kdp = 0;    /* add the derived KDP to the scan */
+static int pid_atten_corr = 0;  /* correct DBZH and ZDR for attenuation before PID */
+static int pid_kdp_texture = 0; /* take the texture from the KDP stats */
+static int pid_native_tempc = 0; /* temperature from pid_profile, not how/tempc */
+static int pid_per_ray_tempc = 0; /* native temperature from how/elangles */
+static int pid_profile_loaded = 0; /* pid holds the lookup for pid_profile */
+static int pid_profile_id = 0;     /* identifies pid_profile in pid_geom */
+static vector<NcarParticleId::TmpPoint> pid_profile;
+static TempGrid pid_grid;           /* model temperatures, used if set */
+static TempProfile pid_soundings;   /* finds profiles in a sounding archive */
 
 /* Global declaration of our PID object. For continuous re-use.
    Needs to be released at exit. */
   NcarParticleId       pid; 
+/* KDP workspace for deriving KDP ray by ray, when requested */
+  static KdpFilt       pidkdp;
+/* Per-bin arrays which only depend on scan geometry, re-used from volume to
+   volume */
+  static ScanGeomCache pid_geom;
 /* Other stuff that's here for completeness even if not used */
   //pid.setDebug(true);
   //pid.setVerbose(false);
@@ -248,10 +271,10 @@ int createDR(PolarScan_t *scan, double zdr_offset, double zdr_scale) {
 }
 
 
-int createSNR(PolarScan_t *scan) {
+int createSNR(PolarScan_t *scan, const double *noise_dbz) {
   /* Don't have SNR? Estimate it. Original formulation assuming 
      noise_dbz_at_100km = 0.0, but could use real noise estimates instead if
-     available in metadata.
+     available in metadata. The noise at each bin is from ScanGeomCache.
      FIXME: If SNRH actually exists, it should be represented in normalized 
      form and therefore not scaled according to what this code expects. */
   int nrays = (int)PolarScan_getNrays(scan);
@@ -266,19 +289,12 @@ int createSNR(PolarScan_t *scan) {
   PolarScanParam_t *DBZH = PolarScan_getParameter(scan, "DBZH");
   RaveValueType vtype;
   double value;
-  double rscale = PolarScan_getRscale(scan);
-  if (!rscale) rscale = RSCALE;  /* Failsafe in cases where rscale == 0.0 */
-  double rscale_km = rscale * 0.001;
-  double rstart = PolarScan_getRstart(scan);
 
-  const double noise_dbz_at_100km = 0.0;
   for (int ray = 0; ray < nrays; ++ray) {
     for (int bin = 0; bin < nbins; ++bin) {
       vtype = PolarScanParam_getConvertedValue(DBZH, bin, ray, &value);
       if (vtype == RaveValueType_DATA) {
-	double range = rstart + (bin * rscale_km);
-	double noiseDbz = noise_dbz_at_100km + 20.0 * (log10(range) - log10(100.0));
-	PolarScanParam_setValue(SNRH, bin, ray, value-noiseDbz);
+	PolarScanParam_setValue(SNRH, bin, ray, value-noise_dbz[bin]);
       } else {
 	PolarScanParam_setValue(SNRH, bin, ray, -20.0);
       }
@@ -290,6 +306,154 @@ int createSNR(PolarScan_t *scan) {
   return 1;
 }
 
+/**
+ * Checks whether the rays of a scan cover the full circle, so that kernels 
+ * over azimuth can wrap from the last ray to the first. Sector scans and 
+ * RHIs don't.
+ * @param[in] scan - input polar scan
+ * @returns 1 if the rays cover the full circle, otherwise 0
+ */
+int scanIsFullCircle(PolarScan_t *scan) {
+  int nrays = (int)PolarScan_getNrays(scan);
+  double az0, daz;
+  getRayAzimuths(scan, &az0, &daz);
+  return (fabs(daz) * nrays > 359.99);
+}
+
+/**
+ * Returns the per-bin arrays for the geometry of a scan from the cache, 
+ * computing them if they are not there. Temperatures are included if a 
+ * profile has been set with setTempProfile, in which case the PID object 
+ * must hold its lookup. With a grid set with setTempGrid, the locations of 
+ * the gates in the grid are included instead.
+ * @param[in] scan - input polar scan
+ * @returns the cache entry, valid until the cache is next used
+ */
+const ScanGeomCache::Entry& getScanGeometry(PolarScan_t *scan) {
+  ScanGeomCache::Key key;
+  double rscale = PolarScan_getRscale(scan);
+  if (!rscale) rscale = RSCALE;  /* Failsafe in cases where rscale == 0.0 */
+  key.elevDeg = PolarScan_getElangle(scan) * RAD_TO_DEG;
+  key.startRangeKm = PolarScan_getRstart(scan);
+  key.gateSpacingKm = rscale * 0.001;
+  key.nGates = (int)PolarScan_getNbins(scan);
+  key.radarHtKm = PolarScan_getHeight(scan) * 0.001;
+  key.profileId = 0;
+  key.gridId = 0;
+  key.nRays = 0;
+  key.radarLatDeg = 0.0;
+  key.radarLonDeg = 0.0;
+  key.firstAzDeg = 0.0;
+  key.dAzDeg = 0.0;
+  if (pid_grid.isSet()) {
+    key.gridId = pid_grid.getGeomId();
+    key.nRays = (int)PolarScan_getNrays(scan);
+    key.radarLatDeg = PolarScan_getLatitude(scan) * RAD_TO_DEG;
+    key.radarLonDeg = PolarScan_getLongitude(scan) * RAD_TO_DEG;
+    getRayAzimuths(scan, &key.firstAzDeg, &key.dAzDeg);
+  } else if (pid_native_tempc) {
+    key.profileId = pid_profile_id;
+  }
+  return pid_geom.get(key, pid, &pid_grid);
+}
+
+/**
+ * Returns the temperatures along a ray at a given elevation, computed from 
+ * the profile set with setTempProfile. Rays at the scan's elevation take the 
+ * cached temperatures, and those at other elevations are computed once per 
+ * elevation and kept in ray_tempc for the rest of the scan.
+ * @param[in] double - the ray's elevation angle in degrees
+ * @param[in] geom - the cached arrays for the scan's geometry
+ * @param[in,out] ray_tempc - temperatures by elevation, for this scan
+ * @returns the temperatures, valid until ray_tempc or the cache is changed
+ */
+const double* getRayTempc(double elev_deg,
+			  const ScanGeomCache::Entry &geom,
+			  map<double, vector<double> > &ray_tempc) {
+  if (elev_deg == geom.key.elevDeg) return &geom.tempC[0];
+  vector<double> &tempc = ray_tempc[elev_deg];
+  if (tempc.empty()) {
+    const ScanGeomCache::Key &key = geom.key;
+    tempc.resize(key.nGates);
+    pid.fillTempArray(key.radarHtKm, false, 0.0, elev_deg, key.nGates,
+		      key.startRangeKm + 0.5 * key.gateSpacingKm,
+		      key.gateSpacingKm, &tempc[0]);
+  }
+  return &tempc[0];
+}
+
+/**
+ * Computes the texture fields, standard deviations of ZDR and PHIDP, for the
+ * whole scan over a box of texture_nrays by texture_ngates. The moments are 
+ * censored on SNR in the same way as in the PID object before the texture 
+ * is computed. Each output array contains nrays*nbins values and needs to be 
+ * released following use.
+ * @param[in] scan - input polar scan containing SNRH, ZDR and PHIDP
+ * @param[in] int - number of bins in each ray
+ * @param[in] double - ZDR offset value to apply as a bias correction
+ * @param[out] double** - standard deviation of ZDR
+ * @param[out] double** - standard deviation of PHIDP
+ */
+void computeTexture2D(PolarScan_t *scan, int nbins, double zdr_offset,
+		      double **sdzdr, double **sdphidp) {
+  int nrays = (int)PolarScan_getNrays(scan);
+  int npts = nrays * nbins;
+  double snr_threshold = pid.getSnrThresholdDb();
+  double *zdr_plane = (double*)RAVE_MALLOC(npts * sizeof(double));
+  double *phidp_plane = (double*)RAVE_MALLOC(npts * sizeof(double));
+
+  for (int ray = 0; ray < nrays; ++ray) {
+    double *snr = getRay(scan, "SNRH", ray, 0.0);
+    double *zdr = getRay(scan, "ZDR", ray, zdr_offset);
+    double *phidp = getRay(scan, "PHIDP", ray, 0.0);
+    for (int bin = 0; bin < nbins; ++bin) {
+      int idx = ray * nbins + bin;
+      if ( (snr[bin] == missing) || (snr[bin] < snr_threshold) ) {
+	zdr_plane[idx] = missing;
+	phidp_plane[idx] = missing;
+      } else {
+	zdr_plane[idx] = zdr[bin];
+	phidp_plane[idx] = phidp[bin];
+      }
+    }
+    RAVE_FREE(snr);
+    RAVE_FREE(zdr);
+    RAVE_FREE(phidp);
+  }
+
+  /* The kernel wraps from the last ray to the first only if the sweep 
+     covers the full circle */
+  bool wrap = (scanIsFullCircle(scan) != 0);
+  *sdzdr = (double*)RAVE_MALLOC(npts * sizeof(double));
+  *sdphidp = (double*)RAVE_MALLOC(npts * sizeof(double));
+  FilterUtils::computeSdevInBox(zdr_plane, *sdzdr, nrays, nbins,
+				texture_nrays, texture_ngates, wrap, missing);
+  FilterUtils::computeSdevInBox(phidp_plane, *sdphidp, nrays, nbins,
+				texture_nrays, texture_ngates, wrap, missing);
+  RAVE_FREE(zdr_plane);
+  RAVE_FREE(phidp_plane);
+}
+
+
+/**
+ * Replaces pid_profile with a new temperature profile. An unchanged 
+ * profile keeps its id, so the scan geometries cached for it are still 
+ * found, and pid keeps its lookup.
+ * @param[in] vector<NcarParticleId::TmpPoint> - the new profile
+ */
+void replaceTempProfile(const vector<NcarParticleId::TmpPoint> &profile) {
+  bool same = (profile.size() == pid_profile.size());
+  for (size_t level = 0; (same) && (level < profile.size()); level++) {
+    same = ( (profile[level].pressHpa == pid_profile[level].pressHpa) &&
+	     (profile[level].htKm == pid_profile[level].htKm) &&
+	     (profile[level].tmpC == pid_profile[level].tmpC) );
+  }
+  if (same) return;
+  pid_profile = profile;
+  pid_profile_loaded = 0;
+  pid_profile_id++;
+}
+
 /* End internal working functions */
 /* Begin interface */
 
@@ -302,6 +466,8 @@ int readThresholdsFromFile(const char *thresholds_file) {
   pid.setMissingDouble(missing);
 
   ret = pid.readThresholdsFromFile(thresholds_file);
+  /* The thresholds file replaces any profile set with setTempProfile */
+  pid_profile_loaded = 0;
 
   //  pid.setDebug(false);
   //  pid.setVerbose(false);
@@ -309,6 +475,86 @@ int readThresholdsFromFile(const char *thresholds_file) {
 }
 
 
+void setTextureKernel(int nrays, int ngates) {
+  texture_nrays = nrays;
+  texture_ngates = ngates;
+}
+
+
+int setTempProfile(const double *height, const double *tempc, int nlevels) {
+  vector<NcarParticleId::TmpPoint> profile;
+  pid_native_tempc = 0;
+  for (int level = 0; level < nlevels; level++) {
+    if ( (level > 0) && (height[level] <= height[level-1]) ) {
+      /* alert: heights must be ascending */
+      replaceTempProfile(vector<NcarParticleId::TmpPoint>());
+      return 0;
+    }
+    profile.push_back(NcarParticleId::TmpPoint(height[level] * 0.001, tempc[level]));
+  }
+  replaceTempProfile(profile);
+  pid_native_tempc = (nlevels > 0);
+  return 1;
+}
+
+
+int appendSounding(const char *path, const char *station, long sounding_time,
+		   const double *pressure, const double *height,
+		   const double *tempc, int nlevels) {
+  SoundingStore store;
+  vector<NcarParticleId::TmpPoint> sounding;
+  for (int level = 0; level < nlevels; level++) {
+    sounding.push_back(NcarParticleId::TmpPoint(pressure[level], height[level] * 0.001, tempc[level]));
+  }
+  if (store.open(path, true)) return 0;
+  return (store.append(station, (time_t)sounding_time, sounding) == 0);
+}
+
+
+long setTempProfileFromArchive(const char *path, const char *station,
+			       long data_time, int margin_secs) {
+  time_t sounding_time = 0;
+  vector<NcarParticleId::TmpPoint> profile;
+  pid_native_tempc = 0;
+  pid_soundings.setSoundingLocationName(station);
+  pid_soundings.setSoundingSearchTimeMarginSecs(margin_secs);
+  if (pid_soundings.getTempProfile(path, (time_t)data_time, sounding_time, profile)) {
+    replaceTempProfile(vector<NcarParticleId::TmpPoint>());
+    return -1;
+  }
+  replaceTempProfile(profile);
+  pid_native_tempc = 1;
+  return (long)sounding_time;
+}
+
+
+int setTempGrid(const char *path) {
+  if (path == NULL) {
+    pid_grid.clear();
+    return 1;
+  }
+  return (pid_grid.read(path) == 0);
+}
+
+
+void setPerRayTempc(int per_ray) {
+  pid_per_ray_tempc = per_ray;
+}
+
+
+void setGeometryCacheLimit(long max_bytes) {
+  pid_geom.setMaxBytes((max_bytes > 0) ? (size_t)max_bytes : 0);
+}
+
+
+void setPidKdp(int compute_kdp, int keep_kdp, int atten_corr, int kdp_texture) {
+  pid_compute_kdp = (compute_kdp || atten_corr || kdp_texture);
+  pid_keep_kdp = keep_kdp;
+  pid_atten_corr = atten_corr;
+  pid_kdp_texture = kdp_texture;
+}
+
+
 int generateNcar_pid(PolarScan_t *scan, int median_filter_len, double zdr_offset, int derive_dr, double zdr_scale) {
   int nrays, nbins, ray, bin;
   PolarScanParam_t *CLASS = NULL;
@@ -317,7 +563,17 @@ int generateNcar_pid(PolarScan_t *scan, int median_filter_len, double zdr_offset
   RaveField_t *CONF2 = NULL;
   RaveAttribute_t *tempc_attr = NULL;
   double *tempc = NULL;
+  double *grid_tempc = NULL;
+  RaveAttribute_t *elangles_attr = NULL;
+  double *elangles = NULL;
+  int n_elangles = 0;
+  map<double, vector<double> > ray_tempc;
   double *ldr = NULL;
+  double *sdzdr = NULL;
+  double *sdphidp = NULL;
+  double *kdp_plane = NULL;
+  int kdp_texture = 0;
+  KdpScanInfo_t kdp_info;
   //  NcarParticleId       pid; 
   //  pid.setDebug(true);
   //  pid.setVerbose(true);
@@ -325,10 +581,47 @@ int generateNcar_pid(PolarScan_t *scan, int median_filter_len, double zdr_offset
   pid.setMinValidInterest(-10.0);  /* Is this reflectivity? */
   pid.setApplyMedianFilterToPid(median_filter_len);
   pid.setReplaceMissingLdr();
+  pid.setNgatesSdev(texture_ngates);
+  pid.resetEligibleCounts();
   //  pid.readThresholdsFromFile(thresholds_file);
 
   nrays = (int)PolarScan_getNrays(scan);
   nbins = (int)PolarScan_getNbins(scan);
+
+  if ( (nrays < 1) || (nbins < 1) ) return 0;
+
+  /* Beam height, temperature and SNR noise along the ray, re-used for all 
+     rays of the sweep, and cached for the same geometry in later volumes */
+  if ( (pid_native_tempc) && (!pid_profile_loaded) && (!pid_grid.isSet()) ) {
+    pid.setTempProfile(pid_profile);
+    pid_profile_loaded = 1;
+  }
+  const ScanGeomCache::Entry &geom = getScanGeometry(scan);
+
+  /* Temperature along the ray. Either interpolated ray by ray from the grid 
+     set with setTempGrid, computed from the profile set with setTempProfile, 
+     at the beam height of each bin, or read from how/tempc. */
+  if (pid_grid.isSet()) {
+    grid_tempc = (double*)RAVE_MALLOC(nbins * sizeof(double));
+    tempc = grid_tempc;
+  } else if (pid_native_tempc) {
+    tempc = (double*)&geom.tempC[0];
+    /* Optionally from each ray's own elevation */
+    if ( (pid_per_ray_tempc) && (PolarScan_hasAttribute(scan, "how/elangles")) ) {
+      elangles_attr = PolarScan_getAttribute(scan, "how/elangles");
+      if ( (!RaveAttribute_getDoubleArray(elangles_attr, &elangles, &n_elangles)) ||
+	   (n_elangles != nrays) ) {
+	elangles = NULL;  /* alert: not one elevation per ray, use elangle */
+      }
+    }
+  } else {
+    if (!PolarScan_hasAttribute(scan, "how/tempc")) {
+      /* alert: no temperature profile */
+      return 0;
+    }
+    tempc_attr = PolarScan_getAttribute(scan, "how/tempc");
+    RaveAttribute_getDoubleArray(tempc_attr, &tempc, &nbins);
+  }
   
   /* Use LDR if available. Otherwise choose to use depolarization ratio as a 
      proxy, or not. Generate it if it isn't there. Optionally, "bend" DR by 
@@ -341,11 +634,23 @@ int generateNcar_pid(PolarScan_t *scan, int median_filter_len, double zdr_offset
     }
   }
 
-  if (!PolarScan_hasParameter(scan, "SNRH")) createSNR(scan);
+  if (!PolarScan_hasParameter(scan, "SNRH")) createSNR(scan, &geom.snrRangeDb[0]);
 
-  /* Get temperature data along the ray. Re-use for all rays of the sweep. */
-  tempc_attr = PolarScan_getAttribute(scan, "how/tempc");
-  RaveAttribute_getDoubleArray(tempc_attr, &tempc, &nbins);
+  /* Texture over azimuth and range, for the whole scan, if requested */
+  if (texture_nrays > 1) {
+    computeTexture2D(scan, nbins, zdr_offset, &sdzdr, &sdphidp);
+  }
+
+  /* KDP derived along each ray, optionally kept as a parameter */
+  if (pid_compute_kdp) {
+    kdpSetupScan(scan, &pidkdp, pid_atten_corr, 0.0, &kdp_info);
+    /* Texture from the KDP stats, unless it's 2-D over the scan */
+    kdp_texture = (pid_kdp_texture && !sdzdr);
+    pidkdp.setComputePhidpCircSdev(kdp_texture != 0);
+    if (pid_keep_kdp) {
+      kdp_plane = (double*)RAVE_MALLOC((size_t)nrays * nbins * sizeof(double));
+    }
+  }
 
   /* Create empty parameters to store classification results for winner and
      runner-up, each with their corresponding interest fields. */
@@ -362,7 +667,7 @@ int generateNcar_pid(PolarScan_t *scan, int median_filter_len, double zdr_offset
     double *snr = getRay(scan, "SNRH", ray, 0.0);
     double *dbz = getRay(scan, "DBZH", ray, 0.0);
     double *zdr = getRay(scan, "ZDR", ray, zdr_offset);
-    double *kdp = getRay(scan, "KDP", ray, 0.0);
+    double *kdp = NULL;
     double *rhohv = getRay(scan, "RHOHV", ray, 0.0);
     double *phidp = getRay(scan, "PHIDP", ray, 0.0);
     if (PolarScan_hasParameter(scan, "LDR")) {
@@ -371,19 +676,61 @@ int generateNcar_pid(PolarScan_t *scan, int median_filter_len, double zdr_offset
       ldr = getRay(scan, "DR", ray, 0.0);
     }
 
+    if (elangles) {
+      tempc = (double*)getRayTempc(elangles[ray], geom, ray_tempc);
+    } else if (grid_tempc) {
+      size_t offset = (size_t)ray * nbins;
+      pid_grid.gather(nbins, &geom.gridCell[offset], &geom.gridWx[offset],
+		      &geom.gridWy[offset], &geom.gridLevel[0], &geom.gridWz[0],
+		      grid_tempc);
+    }
+
+    /* Either derive KDP from this ray's moments, or read it from the scan */
+    const double *pidkdp_ray = NULL;
+    if (pid_compute_kdp) {
+      pidkdp.compute(kdp_info.time_secs, 0.0, kdp_info.elev_deg,
+		     kdpRayAzimuth(&kdp_info, ray), kdp_info.wavelength_cm, nbins,
+		     kdp_info.start_range_km, kdp_info.gate_spacing_km,
+		     (const double*)snr, (const double*)dbz,
+		     (const double*)zdr, (const double*)rhohv,
+		     (const double*)phidp, missing);
+      pidkdp_ray = pidkdp.getKdp();
+      if (kdp_plane) {
+	memcpy(kdp_plane + ray * nbins, pidkdp_ray, nbins * sizeof(double));
+      }
+
+      /* Add the cumulative attenuation corrections to the moments used 
+	 for PID. KdpFilt has its own copies of the uncorrected moments. */
+      if (pid_atten_corr) {
+	const double *dbz_corr = pidkdp.getDbzAttenCorr();
+	const double *zdr_corr = pidkdp.getZdrAttenCorr();
+	for (bin = 0; bin < nbins; bin++) {
+	  if (dbz[bin] != missing) dbz[bin] += dbz_corr[bin];
+	  if (zdr[bin] != missing) zdr[bin] += zdr_corr[bin];
+	}
+      }
+    } else {
+      kdp = getRay(scan, "KDP", ray, 0.0);
+      pidkdp_ray = (const double*)kdp;
+    }
+
     pid.computePidBeam(nbins,
 		       (const double*)snr,
 		       (const double*)dbz,
 		       (const double*)zdr,
-		       (const double*)kdp,
+		       pidkdp_ray,
 		       (const double*)ldr,
 		       (const double*)rhohv,
 		       (const double*)phidp,
-		       (const double*)tempc);
+		       (const double*)tempc,
+		       (sdzdr) ? (const double*)(sdzdr + ray * nbins) :
+		       (kdp_texture) ? pidkdp.getZdrSdev() : NULL,
+		       (sdphidp) ? (const double*)(sdphidp + ray * nbins) :
+		       (kdp_texture) ? pidkdp.getPhidpCircSdev() : NULL);
     RAVE_FREE(snr);
     RAVE_FREE(dbz);
     RAVE_FREE(zdr);
-    RAVE_FREE(kdp);
+    if (kdp) RAVE_FREE(kdp);
     RAVE_FREE(rhohv);
     RAVE_FREE(phidp);
     if ( (PolarScan_hasParameter(scan, "LDR")) || (derive_dr) ) {
@@ -422,14 +769,37 @@ int generateNcar_pid(PolarScan_t *scan, int median_filter_len, double zdr_offset
   /* Add PID results to scan. Remember SNRH has already been added. */
   PolarScan_addParameter(scan, CLASS);
   PolarScan_addParameter(scan, CLASS2);
+  if (kdp_plane) {
+    PolarScanParam_t *KDP = planeParam("KDP", kdp_plane, nbins, nrays);
+    PolarScan_addParameter(scan, KDP);
+    RAVE_OBJECT_RELEASE(KDP);
+    RAVE_FREE(kdp_plane);
+  }
 
   RAVE_OBJECT_RELEASE(CONF);
   RAVE_OBJECT_RELEASE(CONF2);
   RAVE_OBJECT_RELEASE(CLASS);
   RAVE_OBJECT_RELEASE(CLASS2);
   RAVE_OBJECT_RELEASE(tempc_attr);
+  RAVE_OBJECT_RELEASE(elangles_attr);
+  if (grid_tempc) RAVE_FREE(grid_tempc);
+  if (sdzdr) RAVE_FREE(sdzdr);
+  if (sdphidp) RAVE_FREE(sdphidp);
   if ( (!PolarScan_hasParameter(scan, "LDR")) && (!derive_dr) ) {
     RAVE_FREE(ldr);
   }
   return 1;
 }
+
+
+int getPidEligibleCounts(const char **labels, long *counts, int max_types) {
+  const vector<NcarParticleId::Particle*> particles = pid.getParticleList();
+  const vector<long> &eligible = pid.getEligibleCounts();
+  int ntypes = (int)particles.size();
+
+  for (int ii = 0; (ii < ntypes) && (ii < max_types); ii++) {
+    labels[ii] = particles[ii]->label.c_str();
+    counts[ii] = eligible[ii];
+  }
+  return ntypes;
+}
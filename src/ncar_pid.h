@@ -36,6 +36,9 @@ extern "C" {
 #define MY_MIN(a, b) ((a) < (b) ? (a) : (b))
 }
 #include "NcarParticleId.hh"
+#include "FilterUtils.hh"
+#include "ScanGeomCache.hh"
+#include "TempProfile.hh"
 
 #define PID_GAIN 1.0
 #define PID_INTEREST_GAIN 0.005
@@ -58,16 +61,165 @@ extern "C" {
  */
 int readThresholdsFromFile(const char *thresholds_file);
 
+/**
+ * Set the kernel used to compute the texture fields (standard deviations
+ * of ZDR and PHIDP) used in particle identification. By default the texture
+ * is computed along each ray only. If more than one ray is given, the
+ * texture is computed over an azimuth x range box for the whole scan. The 
+ * box wraps from the last ray to the first if the rays cover the full 
+ * circle, judged from how/startazA if the scan has it, but not for sector 
+ * scans and RHIs.
+ * @param[in] int - number of rays in the kernel, 0 or 1 means along range only
+ * @param[in] int - number of gates in the kernel, default 9
+ */
+void setTextureKernel(int nrays, int ngates);
+
+/**
+ * Choose whether temperatures are computed for each ray from its own 
+ * elevation angle, read from the scan's how/elangles (degrees, one per ray), 
+ * instead of once for the scan's elevation angle. This is needed for RHIs 
+ * and for scans whose elevation wanders from ray to ray. It applies to the 
+ * temperatures computed from a profile set with setTempProfile, and only to 
+ * scans which have how/elangles. The temperatures are computed once for 
+ * each distinct elevation, so PPIs at a constant elevation cost no more.
+ * @param[in] int - boolean whether to use each ray's elevation (1) or not 
+ * (0, default)
+ */
+void setPerRayTempc(int per_ray);
+
+/**
+ * Set the height-temperature profile used by generateNcar_pid. The 
+ * temperature of each bin is then computed from the profile at the bin's 
+ * beam height, from the scan's elevation angle, rstart, rscale and the 
+ * radar's height, assuming 4/3 earth radius propagation. The scan then 
+ * doesn't need a how/tempc attribute. The profile is kept for subsequent 
+ * scans, and also replaces the profile from any thresholds file read later.
+ * @param[in] double* - heights (m above sea level), ascending
+ * @param[in] double* - temperatures (C) at these heights
+ * @param[in] int - number of levels. 0 clears the profile, so that 
+ * generateNcar_pid reads the temperatures from how/tempc (default).
+ * @returns 1 upon success, or 0 if the heights are not ascending, in which 
+ * case the profile is cleared
+ */
+int setTempProfile(const double *height, const double *tempc, int nlevels);
+
+/**
+ * Append a sounding to a local sounding archive, see SoundingStore.hh, 
+ * creating the archive if it doesn't exist.
+ * @param[in] const char* - path of the archive's data file
+ * @param[in] const char* - station name, up to 8 characters
+ * @param[in] long - launch time, seconds since the epoch
+ * @param[in] double* - pressures (hPa)
+ * @param[in] double* - heights (m above sea level)
+ * @param[in] double* - temperatures (C)
+ * @param[in] int - number of levels
+ * @returns 1 upon success, or 0 if the archive can't be written
+ */
+int appendSounding(const char *path, const char *station, long sounding_time,
+		   const double *pressure, const double *height,
+		   const double *tempc, int nlevels);
+
+/**
+ * Set the temperature profile, as with setTempProfile, from the latest 
+ * sounding in a local sounding archive for a station, at or before a time 
+ * and within a search margin, which passes TempProfile's checks (at least 
+ * 20 points, covering 950 to 300 hPa and 500 to 15000 m). Finding the 
+ * sounding is a binary search of the archive's index, which is kept in 
+ * memory and only read again when a sounding has been appended.
+ * @param[in] const char* - path of the archive's data file
+ * @param[in] const char* - station name
+ * @param[in] long - data time, seconds since the epoch
+ * @param[in] int - search margin before the data time, in seconds
+ * @returns the launch time of the sounding, or -1 if there is none, in 
+ * which case the profile is cleared
+ */
+long setTempProfileFromArchive(const char *path, const char *station,
+			       long data_time, int margin_secs);
+
+/**
+ * Read a model temperature grid, see TempGrid.hh for the file format, from 
+ * which generateNcar_pid then interpolates the temperature of each gate. The 
+ * grid takes precedence over a profile set with setTempProfile and over 
+ * how/tempc. The gates' locations in the grid are cached with the other 
+ * per-bin arrays, and are re-used for a new grid with the same geometry, 
+ * such as the next model cycle. The rays are located from their azimuths in 
+ * how/startazA, or else taken to cover the full circle evenly from 
+ * how/astart, or from north without it. 
+ * @param[in] const char* - path of the grid file, or NULL to clear the grid
+ * @returns 1 upon success, or 0 if the file can't be read, in which case 
+ * the grid is cleared
+ */
+int setTempGrid(const char *path);
+
+/**
+ * Set the memory limit of the cache of per-bin beam heights, temperatures 
+ * and SNR noise used by generateNcar_pid. These only depend on the scan 
+ * geometry (elevation angle, rstart, rscale, number of bins, radar height) 
+ * and on the profile set with setTempProfile, so they are kept for the same 
+ * scans of later volumes. Setting the same profile again keeps them. With a 
+ * temperature grid, the location of each gate in the grid is also kept, 
+ * about 12 bytes per gate, or 4.3 MB for a scan of 360 x 1000 gates. The 
+ * default holds a volume of 20 such scans; larger volumes need a higher 
+ * limit. The least recently used are removed first once the limit is 
+ * exceeded, but the arrays for the latest scan are always kept.
+ * @param[in] long - the limit in bytes, default 96 MB
+ */
+void setGeometryCacheLimit(long max_bytes);
+
+/**
+ * Choose whether generateNcar_pid derives KDP itself. If so, KDP is derived 
+ * along each ray with KdpFilt, in the same way as kdpFilterCompute, from the 
+ * moments already read out for PID (ZDR with its offset applied), and handed 
+ * straight to the classifier. 
+ * The scan then doesn't need to contain KDP. By default, KDP is read from 
+ * the scan.
+ * @param[in] int - boolean whether to derive KDP (1) or read it from the 
+ * scan (0)
+ * @param[in] int - boolean whether to add the derived KDP to the scan (1), 
+ * replacing any existing KDP parameter, or not (0)
+ * @param[in] int - boolean whether to correct DBZH and ZDR for attenuation 
+ * (1) or not (0), before they are classified. The cumulative corrections 
+ * are derived from KDP along each ray, with the band-dependent coefficients 
+ * used by KdpFilt, so this implies deriving KDP. Intended for C and X band, 
+ * e.g. with the cband.shv and xband.shv thresholds. Depolarization ratio 
+ * derived from ZDR, and SNR estimated from DBZH, are not corrected.
+ * @param[in] int - boolean whether to take the ZDR and PHIDP texture fields 
+ * from the kernel stats computed while deriving KDP (1), rather than 
+ * computing them again in the classifier (0). This implies deriving KDP. 
+ * The PHIDP texture is then the circular standard deviation, which is not 
+ * affected by folding. The kernel is KdpFilt's, 9 gates, and the moments 
+ * are not censored on SNR before the texture is computed. A 2-D texture 
+ * set with setTextureKernel takes precedence.
+ */
+void setPidKdp(int compute_kdp, int keep_kdp, int atten_corr, int kdp_texture);
+
 /**
  * For an input polar scan (or possibly RHI), perform particle classification
- * using the NCAR implementation of the NEXRAD classes.
+ * using the NCAR implementation of the NEXRAD classes. Temperatures along 
+ * the ray are read from how/tempc, unless a profile has been set with 
+ * setTempProfile or a grid with setTempGrid.
  * @param[in] scan - input polar scan
  * @param[in] int - median filter length to apply on PID, must be an odd value 
  * or the filter will just return.  0 = no filter applied
  * @param[in] double - ZDR offset to apply as a bias correction
  * @param[in] int - boolean whether to derive depolarization ratio (1) or not (0)
  * @param[in] double - ZDR scaling factor to apply in the derivation of depolarization ratio
- * @returns 1 upon success, otherwise 0
+ * @returns 1 upon success, otherwise 0, e.g. if there are no temperatures
  */
 int generateNcar_pid(PolarScan_t *scan, int median_filter_len, double zdr_offset, int derive_dr, double zdr_scale);
+
+/**
+ * Get the number of gates at which each particle type was eligible in the 
+ * last call to generateNcar_pid, i.e. allowed by the temperature and within 
+ * the threshold limits of the other moments, so that its interest was 
+ * evaluated. Types that are rarely eligible contribute little to the cost 
+ * of classification.
+ * @param[out] const char** - the particle labels, as in the thresholds file, 
+ * valid until the thresholds are read again
+ * @param[out] long* - the number of eligible gates of each particle type
+ * @param[in] int - the length of the arrays
+ * @returns the number of particle types, which may exceed the length of the 
+ * arrays, in which case only that many are returned
+ */
+int getPidEligibleCounts(const char **labels, long *counts, int max_types);
 #endif
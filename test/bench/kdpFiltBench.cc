@@ -0,0 +1,553 @@
+/* --------------------------------------------------------------------
+Copyright (C) 2019 The Crown (i.e. Her Majesty the Queen in Right of Canada)
+
+This file is an add-on to RAVE.
+
+RAVE is free software: you can redistribute it and/or modify
+it under the terms of the GNU Lesser General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+RAVE is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU Lesser General Public License for more details.
+
+You should have received a copy of the GNU Lesser General Public License
+along with RAVE.  If not, see <http://www.gnu.org/licenses/>.
+------------------------------------------------------------------------*/
+/**
+ * Microbenchmarks for KdpFilt, on rays with fragmented PHIDP, i.e. many
+ * short runs of valid data separated by short gaps. Also checks the 2-D
+ * texture of FilterUtils::computeSdevInBox against a brute-force box.
+ * Usage: kdpFiltBench [nrays [ngates [seed]]]
+ * @file
+ * @author Daniel Michelson, Environment and Climate Change Canada
+ * @date 2019-12-10
+ */
+
+#include "KdpFilt.hh"
+#include "KdpFiltEnsemble.hh"
+#include "KdpDiagSink.hh"
+#include "FilterUtils.hh"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+#include <random>
+
+static const double missing = -9999.0;
+
+
+/**
+ * A ray of moments, with PHIDP broken up into runs.
+ */
+typedef struct {
+  std::vector<double> snr, dbz, zdr, rhohv, phidp;
+} BenchRay_t;
+
+
+/**
+ * Generates a ray with fragmented PHIDP. Runs of valid PHIDP, from
+ * min_run to max_run gates long, alternate with gaps of missing PHIDP,
+ * from min_gap to max_gap gates long. PHIDP increases slowly along
+ * the ray, with some noise, and is folded into [-180, 180).
+ * @param[in] int - number of gates
+ * @param[in] int, int - shortest and longest runs of valid PHIDP
+ * @param[in] int, int - shortest and longest gaps
+ * @param[in] std::mt19937& - random number generator
+ * @returns BenchRay_t
+ */
+BenchRay_t makeFragmentedRay(int ngates, int min_run, int max_run,
+			     int min_gap, int max_gap, std::mt19937 &rng) {
+  std::uniform_int_distribution<int> run_len(min_run, max_run);
+  std::uniform_int_distribution<int> gap_len(min_gap, max_gap);
+  std::normal_distribution<double> noise(0.0, 2.0);
+  BenchRay_t ray;
+  double phidp = -40.0;
+  int left = run_len(rng);
+  bool valid = true;
+
+  ray.snr.resize(ngates);
+  ray.dbz.resize(ngates);
+  ray.zdr.resize(ngates);
+  ray.rhohv.resize(ngates);
+  ray.phidp.resize(ngates);
+  for (int igate = 0; igate < ngates; igate++) {
+    if (left == 0) {
+      valid = !valid;
+      left = (valid) ? run_len(rng) : gap_len(rng);
+    }
+    left--;
+    phidp += 0.05;
+    ray.snr[igate] = 30.0;
+    ray.dbz[igate] = 35.0 + noise(rng);
+    ray.zdr[igate] = 1.0 + 0.1 * noise(rng);
+    ray.rhohv[igate] = 0.98;
+    if (valid) {
+      double val = phidp + noise(rng);
+      ray.phidp[igate] = fmod(val + 180.0 + 3600.0, 360.0) - 180.0;
+    } else {
+      ray.phidp[igate] = missing;
+    }
+  }
+  return ray;
+}
+
+
+/**
+ * Converts the valid gates of a ray into runs, in the same way as
+ * KdpFilt, keeping runs longer than min_len.
+ * @param[in] double* - PHIDP
+ * @param[in] int - number of gates
+ * @param[in] int - runs must be longer than this
+ * @param[out] std::vector<PhidpRun>& - the runs
+ */
+void findRuns(const double *phidp, int ngates, int min_len,
+	      std::vector<KdpFilt::PhidpRun> &runs) {
+  int ibegin = -1;
+  runs.clear();
+  for (int igate = 0; igate <= ngates; igate++) {
+    bool valid = (igate < ngates) && (phidp[igate] != missing);
+    if (valid && ibegin < 0) ibegin = igate;
+    if (!valid && ibegin >= 0) {
+      if (igate - ibegin > min_len) {
+	runs.push_back(KdpFilt::PhidpRun(ibegin, igate - 1));
+      }
+      ibegin = -1;
+    }
+  }
+}
+
+
+/**
+ * The previous way of combining runs, which started again from the
+ * first run after each pair was combined. Kept for comparison.
+ * @param[in] std::vector<PhidpRun>& - the runs
+ * @param[out] std::vector<PhidpRun>& - the combined runs
+ * @param[in] int - longest gap to close
+ */
+void legacyCombineRuns(const std::vector<KdpFilt::PhidpRun> &runs,
+		       std::vector<KdpFilt::PhidpRun> &combRuns,
+		       int max_gap) {
+  std::vector<KdpFilt::PhidpRun> allRuns = runs;
+  bool done = false;
+  while (!done) {
+    done = true;
+    combRuns.clear();
+    if (allRuns.size() < 2) {
+      combRuns = allRuns;
+      break;
+    }
+    for (size_t irun = 0; irun < allRuns.size() - 1; irun++) {
+      KdpFilt::PhidpRun thisRun = allRuns[irun];
+      KdpFilt::PhidpRun nextRun = allRuns[irun+1];
+      int gapLen = nextRun.ibegin - thisRun.iend - 1;
+      if (gapLen > max_gap) {
+	combRuns.push_back(thisRun);
+	if (irun == allRuns.size() - 2) {
+	  combRuns.push_back(nextRun);
+	}
+      } else {
+	thisRun.iend = nextRun.iend;
+	combRuns.push_back(thisRun);
+	for (size_t jrun = irun + 2; jrun < allRuns.size(); jrun++) {
+	  combRuns.push_back(allRuns[jrun]);
+	}
+	done = false;
+	allRuns = combRuns;
+	break;
+      }
+    }
+  }
+}
+
+
+/**
+ * Standard deviation over a box in azimuth and range, the long way round,
+ * to check FilterUtils::computeSdevInBox. Range limits are clipped. In 
+ * azimuth the box wraps from the last ray to the first, or is clipped,
+ * and a box wider than the scan takes each ray once.
+ * @param[in] double* - the plane, ray by ray
+ * @param[in] int, int - number of rays and gates
+ * @param[in] int, int - number of rays and gates in the kernel
+ * @param[in] bool - whether the box wraps in azimuth
+ * @param[in] int, int - the ray and gate
+ * @returns the standard deviation, or missing with fewer than 3 values
+ */
+double boxSdev(const double *field, int nrays, int ngates, int nrays_kernel,
+	       int ngates_kernel, bool wrap, int iray, int igate) {
+  int nrays_half = nrays_kernel / 2;
+  int ngates_half = ngates_kernel / 2;
+  if (wrap && 2 * nrays_half + 1 > nrays) nrays_half = (nrays - 1) / 2;
+  std::vector<double> vals;
+  for (int jray = iray - nrays_half; jray <= iray + nrays_half; jray++) {
+    int kray = jray;
+    if (wrap) {
+      kray = (jray + nrays) % nrays;
+    } else if (jray < 0 || jray >= nrays) {
+      continue;
+    }
+    for (int jgate = igate - ngates_half; jgate <= igate + ngates_half; jgate++) {
+      if (jgate < 0 || jgate >= ngates) continue;
+      double val = field[kray * ngates + jgate];
+      if (val != missing) vals.push_back(val);
+    }
+  }
+  if (vals.size() < 3) return missing;
+  double mean = 0.0, var = 0.0;
+  for (size_t ii = 0; ii < vals.size(); ii++) mean += vals[ii];
+  mean /= vals.size();
+  for (size_t ii = 0; ii < vals.size(); ii++) {
+    var += (vals[ii] - mean) * (vals[ii] - mean);
+  }
+  return sqrt(var / vals.size());
+}
+
+
+/**
+ * Checks FilterUtils::computeSdevInBox against boxSdev on a small plane
+ * with a large offset, like PHIDP, with scattered missing gates and a
+ * ray which is all missing, for kernels with and without wrapping, and
+ * one wider than the scan.
+ * @param[in] std::mt19937& - random number generator
+ * @returns the number of gates which differ
+ */
+int checkSdevInBox(std::mt19937 &rng) {
+  const int nrays = 12, ngates = 40;
+  std::normal_distribution<double> noise(0.0, 5.0);
+  std::uniform_real_distribution<double> uniform(0.0, 1.0);
+  std::vector<double> field(nrays * ngates), sdev(nrays * ngates);
+  for (int iray = 0; iray < nrays; iray++) {
+    for (int igate = 0; igate < ngates; igate++) {
+      bool valid = (iray != 7 && uniform(rng) > 0.2);
+      field[iray * ngates + igate] =
+	(valid) ? 150.0 + 10.0 * iray + noise(rng) : missing;
+    }
+  }
+
+  const int NKERNELS = 4;
+  int kernels[NKERNELS][3] = { { 5, 9, 1 }, { 5, 9, 0 }, { 15, 5, 1 }, { 3, 1, 1 } };
+  int nDiff = 0;
+  for (int ik = 0; ik < NKERNELS; ik++) {
+    int nraysKernel = kernels[ik][0], ngatesKernel = kernels[ik][1];
+    bool wrap = (kernels[ik][2] != 0);
+    FilterUtils::computeSdevInBox(&field[0], &sdev[0], nrays, ngates,
+				  nraysKernel, ngatesKernel, wrap, missing);
+    int nKernelDiff = 0, nValid = 0;
+    for (int iray = 0; iray < nrays; iray++) {
+      for (int igate = 0; igate < ngates; igate++) {
+	double ref = boxSdev(&field[0], nrays, ngates, nraysKernel,
+			     ngatesKernel, wrap, iray, igate);
+	double val = sdev[iray * ngates + igate];
+	if (ref == missing || val == missing) {
+	  if (ref != val) nKernelDiff++;
+	  continue;
+	}
+	nValid++;
+	if (fabs(val - ref) > 1.0e-9 * (1.0 + ref)) nKernelDiff++;
+      }
+    }
+    printf("  %2d x %d rays x gates, %s: %d gates with sdev, %d differ\n",
+	   nraysKernel, ngatesKernel, (wrap) ? "wrapped" : "clipped",
+	   nValid, nKernelDiff);
+    nDiff += nKernelDiff;
+  }
+  return nDiff;
+}
+
+
+/**
+ * Wall clock time in seconds
+ */
+double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+/* CPU time of the calling thread only, so not of the writer thread */
+double threadCpu(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + 1.0e-9 * ts.tv_nsec;
+}
+
+
+int main(int argc, char *argv[]) {
+  int nrays = (argc > 1) ? atoi(argv[1]) : 360;
+  int ngates = (argc > 2) ? atoi(argv[2]) : 2000;
+  unsigned int seed = (argc > 3) ? (unsigned int)atoi(argv[3]) : 1;
+  int nGatesStats = 9;                     /* KdpFilt default */
+  int nGatesStatsHalf = nGatesStats / 2 + 1;
+  std::mt19937 rng(seed);
+  std::vector<BenchRay_t> rays;
+  std::vector<KdpFilt::PhidpRun> runs, legacy, comb;
+  double t0, tLegacy = 0.0, tComb = 0.0;
+  long nruns = 0, ncomb = 0;
+  int ndiff = 0;
+
+  /* Runs just long enough to be kept, with gaps which are mostly closed */
+  for (int iray = 0; iray < nrays; iray++) {
+    rays.push_back(makeFragmentedRay(ngates, nGatesStats + 1, 2 * nGatesStats,
+				     1, nGatesStatsHalf + 2, rng));
+  }
+
+  /* Combining runs, old and new */
+  for (int iray = 0; iray < nrays; iray++) {
+    findRuns(&rays[iray].phidp[0], ngates, nGatesStats, runs);
+    t0 = now();
+    legacyCombineRuns(runs, legacy, nGatesStatsHalf);
+    tLegacy += now() - t0;
+    t0 = now();
+    KdpFilt::combineRuns(runs, comb, nGatesStatsHalf);
+    tComb += now() - t0;
+    nruns += runs.size();
+    ncomb += comb.size();
+    if (legacy.size() != comb.size()) {
+      ndiff++;
+      continue;
+    }
+    for (size_t irun = 0; irun < comb.size(); irun++) {
+      if (legacy[irun].ibegin != comb[irun].ibegin ||
+	  legacy[irun].iend != comb[irun].iend) {
+	ndiff++;
+	break;
+      }
+    }
+  }
+  printf("combineRuns: %d rays, %.1f runs/ray -> %.1f combined\n",
+	 nrays, (double)nruns / nrays, (double)ncomb / nrays);
+  printf("  legacy %10.3f ms   single pass %10.3f ms   speedup %.1fx\n",
+	 1.0e3 * tLegacy, 1.0e3 * tComb, (tComb > 0.0) ? tLegacy / tComb : 0.0);
+  printf("  rays with different results: %d\n", ndiff);
+
+  /* Texture over azimuth and range */
+  printf("computeSdevInBox against a brute-force box sdev:\n");
+  int nSdevDiff = checkSdevInBox(rng);
+
+  /* Whole rays, one at a time */
+  KdpFilt kdp;
+  std::vector<double> kdpRays(nrays * ngates);
+  t0 = now();
+  for (int iray = 0; iray < nrays; iray++) {
+    BenchRay_t &ray = rays[iray];
+    kdp.compute(0, 0.0, 0.5, iray * 360.0 / nrays, 10.0, ngates, 0.125, 0.25,
+		&ray.snr[0], &ray.dbz[0], &ray.zdr[0], &ray.rhohv[0],
+		&ray.phidp[0], missing);
+    memcpy(&kdpRays[iray * ngates], kdp.getKdp(), ngates * sizeof(double));
+  }
+  double tKdp = now() - t0;
+  printf("KdpFilt::compute: %10.3f ms, %.3f ms/ray\n",
+	 1.0e3 * tKdp, 1.0e3 * tKdp / nrays);
+
+  /* Iterative filtering, all iterations and stopping on convergence.
+     A tolerance of 0 stops at a fixed point, so must not change KDP. */
+  double tolerances[3] = { -1.0, 0.0, 0.01 };
+  std::vector<double> kdpAll(nrays * ngates);
+  double tAll = 0.0;
+  int nIterDiff = 0;
+  for (int itol = 0; itol < 3; itol++) {
+    double tol = tolerances[itol];
+    KdpFilt iter;
+    iter.setUseIterativeFiltering(true);
+    iter.setIterCondConvergence(tol >= 0.0, tol);
+    long niter = 0;
+    int nGateIterDiff = 0;
+    double maxDiff = 0.0;
+    t0 = now();
+    for (int iray = 0; iray < nrays; iray++) {
+      BenchRay_t &ray = rays[iray];
+      iter.compute(0, 0.0, 0.5, iray * 360.0 / nrays, 10.0, ngates, 0.125, 0.25,
+		   &ray.snr[0], &ray.dbz[0], &ray.zdr[0], &ray.rhohv[0],
+		   &ray.phidp[0], missing);
+      niter += iter.getNFiltIterCondUsed();
+      double *ref = &kdpAll[iray * ngates];
+      if (tol < 0.0) {
+	memcpy(ref, iter.getKdp(), ngates * sizeof(double));
+	continue;
+      }
+      for (int igate = 0; igate < ngates; igate++) {
+	double diff = fabs(iter.getKdp()[igate] - ref[igate]);
+	if (diff > 0.0) nGateIterDiff++;
+	if (diff > maxDiff) maxDiff = diff;
+      }
+    }
+    double tIter = now() - t0;
+    if (tol < 0.0) {
+      tAll = tIter;
+      printf("Iterative filtering, all iterations: %10.3f ms, %.2f iterations/ray\n",
+	     1.0e3 * tIter, (double)niter / nrays);
+    } else {
+      printf("  tolerance %g: %10.3f ms, %.2f iterations/ray   speedup %.1fx\n",
+	     tol, 1.0e3 * tIter, (double)niter / nrays,
+	     (tIter > 0.0) ? tAll / tIter : 0.0);
+      printf("    gates with different results: %d, max diff %g\n",
+	     nGateIterDiff, maxDiff);
+      if (tol == 0.0) nIterDiff = nGateIterDiff;
+    }
+  }
+
+  /* Several filter configurations, each from scratch and as an ensemble
+     sharing the unfolding */
+  const int NCONFIGS = 6;
+  KdpFilt configs[NCONFIGS];
+  configs[0].setFIRFilterLen(KdpFilt::FIR_LENGTH_125);
+  configs[1].setFIRFilterLen(KdpFilt::FIR_LENGTH_60);
+  configs[2].setFIRFilterLen(KdpFilt::FIR_LENGTH_40);
+  configs[3].setFIRFilterLen(KdpFilt::FIR_LENGTH_20);
+  configs[4].setFIRFilterLen(KdpFilt::FIR_LENGTH_10);
+  configs[5].setUseIterativeFiltering(true);
+  std::vector<double> kdpConfigs(NCONFIGS * nrays * ngates);
+  t0 = now();
+  for (int iconfig = 0; iconfig < NCONFIGS; iconfig++) {
+    for (int iray = 0; iray < nrays; iray++) {
+      BenchRay_t &ray = rays[iray];
+      configs[iconfig].compute(0, 0.0, 0.5, iray * 360.0 / nrays, 10.0, ngates,
+			       0.125, 0.25, &ray.snr[0], &ray.dbz[0], &ray.zdr[0],
+			       &ray.rhohv[0], &ray.phidp[0], missing);
+      memcpy(&kdpConfigs[(iconfig * nrays + iray) * ngates],
+	     configs[iconfig].getKdp(), ngates * sizeof(double));
+    }
+  }
+  double tConfigs = now() - t0;
+  KdpFiltEnsemble ensemble;
+  for (int iconfig = 0; iconfig < NCONFIGS; iconfig++) {
+    ensemble.addConfig(configs[iconfig]);
+  }
+  int nEnsDiff = 0;
+  t0 = now();
+  for (int iray = 0; iray < nrays; iray++) {
+    BenchRay_t &ray = rays[iray];
+    ensemble.compute(0, 0.0, 0.5, iray * 360.0 / nrays, 10.0, ngates,
+		     0.125, 0.25, &ray.snr[0], &ray.dbz[0], &ray.zdr[0],
+		     &ray.rhohv[0], &ray.phidp[0], missing);
+    for (int iconfig = 0; iconfig < NCONFIGS; iconfig++) {
+      const double *ref = &kdpConfigs[(iconfig * nrays + iray) * ngates];
+      for (int igate = 0; igate < ngates; igate++) {
+	if (ensemble.getKdp(iconfig)[igate] != ref[igate]) nEnsDiff++;
+      }
+    }
+  }
+  double tEns = now() - t0;
+  printf("%d filter configurations, separately: %10.3f ms\n",
+	 NCONFIGS, 1.0e3 * tConfigs);
+  printf("  KdpFiltEnsemble: %10.3f ms   speedup %.1fx\n",
+	 1.0e3 * tEns, (tEns > 0.0) ? tConfigs / tEns : 0.0);
+  printf("  gates with different results: %d\n", nEnsDiff);
+
+  /* The repeated filter passes as one composite filter, against iterating
+     them, on rays four times as long. The composite filter is not used
+     unless it is cheaper, so the shorter filters are iterated either way;
+     long filters with many passes use FFT convolution. The gates within
+     reach of the ends of the ray are still iterated, so the composite
+     filter only pays on long rays. KDP must agree to rounding precision. */
+  int nCompGates = 4 * ngates;
+  std::vector<BenchRay_t> longRays;
+  for (int iray = 0; iray < nrays; iray++) {
+    longRays.push_back(makeFragmentedRay(nCompGates, nGatesStats + 1,
+					 2 * nGatesStats, 1,
+					 nGatesStatsHalf + 2, rng));
+  }
+  const int NCOMPOSITE = 3;
+  KdpFilt::fir_filter_len_t compLen[NCOMPOSITE] =
+    { KdpFilt::FIR_LENGTH_20, KdpFilt::FIR_LENGTH_60, KdpFilt::FIR_LENGTH_125 };
+  int compGates[NCOMPOSITE] = { 20, 60, 125 };
+  int compIter[NCOMPOSITE][2] = { { 2, 4 }, { 4, 4 }, { 8, 8 } };
+  int nCompDiff = 0;
+  for (int ic = 0; ic < NCOMPOSITE; ic++) {
+    KdpFilt iterated, composite;
+    iterated.setFIRFilterLen(compLen[ic]);
+    iterated.setNFiltIterUnfolded(compIter[ic][0]);
+    iterated.setNFiltIterCond(compIter[ic][1]);
+    composite.setFIRFilterLen(compLen[ic]);
+    composite.setNFiltIterUnfolded(compIter[ic][0]);
+    composite.setNFiltIterCond(compIter[ic][1]);
+    composite.setUseCompositeFilter(true);
+    std::vector<double> kdpIterated(nrays * nCompGates);
+    t0 = now();
+    for (int iray = 0; iray < nrays; iray++) {
+      BenchRay_t &ray = longRays[iray];
+      iterated.compute(0, 0.0, 0.5, iray * 360.0 / nrays, 10.0, nCompGates,
+		       0.125, 0.25, &ray.snr[0], &ray.dbz[0], &ray.zdr[0],
+		       &ray.rhohv[0], &ray.phidp[0], missing);
+      memcpy(&kdpIterated[iray * nCompGates], iterated.getKdp(),
+	     nCompGates * sizeof(double));
+    }
+    double tIterated = now() - t0;
+    double maxDiff = 0.0;
+    t0 = now();
+    for (int iray = 0; iray < nrays; iray++) {
+      BenchRay_t &ray = longRays[iray];
+      composite.compute(0, 0.0, 0.5, iray * 360.0 / nrays, 10.0, nCompGates,
+			0.125, 0.25, &ray.snr[0], &ray.dbz[0], &ray.zdr[0],
+			&ray.rhohv[0], &ray.phidp[0], missing);
+      const double *ref = &kdpIterated[iray * nCompGates];
+      for (int igate = 0; igate < nCompGates; igate++) {
+	double diff = fabs(composite.getKdp()[igate] - ref[igate]);
+	if (diff > maxDiff) maxDiff = diff;
+      }
+    }
+    double tComposite = now() - t0;
+    printf("Composite filter, %d gates x %d/%d passes, %d-gate rays: "
+	   "iterated %10.3f ms, composite %10.3f ms   speedup %.1fx\n",
+	   compGates[ic], compIter[ic][0], compIter[ic][1], nCompGates,
+	   1.0e3 * tIterated, 1.0e3 * tComposite,
+	   (tComposite > 0.0) ? tIterated / tComposite : 0.0);
+    printf("  max KDP diff %g\n", maxDiff);
+    if (maxDiff > 1.0e-9) nCompDiff++;
+  }
+
+  /* Diagnostics written for every ray, through the writer thread.
+     The overhead on the computing thread is its own CPU time; the
+     elapsed time also includes the writer when it shares a core.
+     Best of five passes each way, alternating. */
+  const char *diagPath = "kdpFiltBench.diag";
+  KdpDiagSink sink;
+  int nDiagDiff = 0;
+  if (sink.open(diagPath) == 0) {
+    KdpFilt diag;
+    double tPlain = 1.0e30, cPlain = 1.0e30, tDiag = 1.0e30, cDiag = 1.0e30;
+    for (int pass = 0; pass < 10; pass++) {
+      bool withSink = (pass % 2 == 1);
+      diag.setDiagSink(withSink ? &sink : NULL);
+      t0 = now();
+      double c0 = threadCpu();
+      for (int iray = 0; iray < nrays; iray++) {
+	BenchRay_t &ray = rays[iray];
+	diag.compute(0, 0.0, 0.5, iray * 360.0 / nrays, 10.0, ngates, 0.125, 0.25,
+		     &ray.snr[0], &ray.dbz[0], &ray.zdr[0], &ray.rhohv[0],
+		     &ray.phidp[0], missing);
+	const double *ref = &kdpRays[iray * ngates];
+	for (int igate = 0; igate < ngates; igate++) {
+	  if (diag.getKdp()[igate] != ref[igate]) nDiagDiff++;
+	}
+      }
+      double tt = now() - t0;
+      double cc = threadCpu() - c0;
+      if (withSink) {
+	tDiag = std::min(tDiag, tt);
+	cDiag = std::min(cDiag, cc);
+      } else {
+	tPlain = std::min(tPlain, tt);
+	cPlain = std::min(cPlain, cc);
+      }
+    }
+    sink.close();
+    printf("KdpFilt::compute with diagnostics: %10.3f ms, %.3f ms/ray   overhead %.1f%%\n",
+	   1.0e3 * tDiag, 1.0e3 * tDiag / nrays,
+	   (tPlain > 0.0) ? 100.0 * (tDiag - tPlain) / tPlain : 0.0);
+    printf("  computing thread CPU: %10.3f ms without, %10.3f ms with   overhead %.1f%%\n",
+	   1.0e3 * cPlain, 1.0e3 * cDiag,
+	   (cPlain > 0.0) ? 100.0 * (cDiag - cPlain) / cPlain : 0.0);
+    printf("  rays written %ld, dropped %ld, gates with different results: %d\n",
+	   sink.getNRaysWritten(), sink.getNRaysDropped(), nDiagDiff);
+    remove(diagPath);
+  }
+
+  return (ndiff == 0 && nSdevDiff == 0 && nIterDiff == 0 &&
+	  nEnsDiff == 0 && nCompDiff == 0 && nDiagDiff == 0) ? 0 : 1;
+}
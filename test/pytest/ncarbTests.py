@@ -72,6 +72,339 @@ class ncarbTest(unittest.TestCase):
         self.assertFalse(different(scan, ref, "CLASS2"))
         #rio.save(self.REF_FIXTURE)
 
+    def test_generateNcar_pid_texture2D(self):
+        profile = ncarb.readProfile(self.PROFILE, scale_height=1000)
+        ncarb.THRESHOLDS_FILE['nexrad'] = self.THRESHOLDS
+        ref = _raveio.open(self.REF_FIXTURE).object
+
+        # A single ray keeps the texture along range only
+        scan = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', keepExtras=True,
+                      texture_rays=1)
+        self.assertFalse(different(scan, ref))
+
+        # Texture over several rays changes the class of some gates,
+        # and more rays change it again
+        scan = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', texture_rays=5)
+        self.assertTrue(different(scan, ref))
+        scan2 = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan2, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', texture_rays=3)
+        self.assertTrue(different(scan2, ref))
+        self.assertTrue(different(scan, scan2))
+
+    def test_generateNcar_pid_computeKdp(self):
+        profile = ncarb.readProfile(self.PROFILE, scale_height=1000)
+        ncarb.THRESHOLDS_FILE['nexrad'] = self.THRESHOLDS
+
+        # KDP derived in a separate pass first
+        scan = _raveio.open(self.FIXTURE).object
+        _ncarb.kdpScan(scan)
+        ncarb.pidScan(scan, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', keepExtras=True)
+
+        # KDP derived along each ray during PID gives the same result
+        scan2 = _raveio.open(self.FIXTURE).object
+        kdp = scan2.getParameter("KDP").getData()
+        ncarb.pidScan(scan2, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', keepExtras=True,
+                      compute_kdp=True)
+        self.assertFalse(different(scan, scan2))
+        self.assertFalse(different(scan, scan2, "CLASS2"))
+        self.assertTrue(np.array_equal(scan2.getParameter("KDP").getData(), kdp))
+
+        scan3 = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan3, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', compute_kdp=True,
+                      keep_kdp=True)
+        self.assertFalse(different(scan, scan3))
+        self.assertFalse(different(scan, scan3, "KDP"))
+
+    def test_generateNcar_pid_attenCorr(self):
+        profile = ncarb.readProfile(self.PROFILE, scale_height=1000)
+        ncarb.THRESHOLDS_FILE['nexrad'] = self.THRESHOLDS
+
+        # Attenuation correction derives KDP, so the scan needn't contain it
+        scan = _raveio.open(self.FIXTURE).object
+        scan.removeParameter("KDP")
+        ncarb.pidScan(scan, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', atten_corr=True,
+                      keep_kdp=True)
+        self.assertTrue(scan.hasParameter("CLASS"))
+        self.assertTrue(scan.hasParameter("KDP"))
+
+        # and the same KDP is derived with and without correction
+        scan2 = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan2, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', compute_kdp=True,
+                      keep_kdp=True)
+        self.assertFalse(different(scan, scan2, "KDP"))
+
+    def test_generateNcar_pid_kdpTexture(self):
+        profile = ncarb.readProfile(self.PROFILE, scale_height=1000)
+        ncarb.THRESHOLDS_FILE['nexrad'] = self.THRESHOLDS
+
+        scan = _raveio.open(self.FIXTURE).object
+        scan.removeParameter("KDP")
+        ncarb.pidScan(scan, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', kdp_texture=True)
+        self.assertTrue(scan.hasParameter("CLASS"))
+
+        # The 2-D texture takes precedence
+        scan2 = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan2, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', texture_rays=3,
+                      compute_kdp=True)
+        scan3 = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan3, profile, median_filter_len=7,
+                      pid_thresholds='nexrad', texture_rays=3,
+                      kdp_texture=True)
+        self.assertFalse(different(scan2, scan3))
+
+    def test_generateNcar_pid_nativeTempc(self):
+        profile = ncarb.readProfile(self.PROFILE, scale_height=1000)
+        ncarb.THRESHOLDS_FILE['nexrad'] = self.THRESHOLDS
+
+        scan = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan, profile, median_filter_len=7,
+                      pid_thresholds='nexrad')
+        try:
+            scan2 = _raveio.open(self.FIXTURE).object
+            ncarb.pidScan(scan2, profile, median_filter_len=7,
+                          pid_thresholds='nexrad', native_tempc=True)
+            self.assertFalse(scan2.hasAttribute("how/tempc"))
+
+            # Beam heights differ slightly from RAVE's, so allow a few bins
+            a = scan.getParameter("CLASS").getData()
+            b = scan2.getParameter("CLASS").getData()
+            self.assertTrue(np.sum(a != b) < 0.01 * a.size)
+
+            # The profile is kept for the next scan
+            scan3 = _raveio.open(self.FIXTURE).object
+            ncarb.pidScan(scan3, None, median_filter_len=7,
+                          pid_thresholds='nexrad', native_tempc=True)
+            self.assertFalse(different(scan2, scan3))
+        finally:
+            _ncarb.setTempProfile(None)
+
+    def test_generateNcar_pid_perRayTempc(self):
+        profile = ncarb.readProfile(self.PROFILE, scale_height=1000)
+        ncarb.THRESHOLDS_FILE['nexrad'] = self.THRESHOLDS
+        try:
+            scan = _raveio.open(self.FIXTURE).object
+            ncarb.pidScan(scan, profile, pid_thresholds='nexrad',
+                          native_tempc=True)
+
+            # The same elevation for every ray gives the same result
+            scan2 = _raveio.open(self.FIXTURE).object
+            elangles = np.repeat(scan2.elangle * 180.0 / np.pi, scan2.nrays)
+            scan2.addAttribute('how/elangles', elangles)
+            ncarb.pidScan(scan2, None, pid_thresholds='nexrad',
+                          per_ray_tempc=True)
+            self.assertFalse(different(scan, scan2))
+
+            # Rays at higher elevations reach colder air
+            scan3 = _raveio.open(self.FIXTURE).object
+            scan3.addAttribute('how/elangles', elangles + 10.0)
+            ncarb.pidScan(scan3, None, pid_thresholds='nexrad',
+                          per_ray_tempc=True)
+            self.assertTrue(different(scan, scan3))
+        finally:
+            _ncarb.setPerRayTempc(0)
+            _ncarb.setTempProfile(None)
+
+    def test_generateNcar_pid_geometryCache(self):
+        profile = ncarb.readProfile(self.PROFILE, scale_height=1000)
+        ncarb.THRESHOLDS_FILE['nexrad'] = self.THRESHOLDS
+        try:
+            scan = _raveio.open(self.FIXTURE).object
+            ncarb.pidScan(scan, profile, pid_thresholds='nexrad',
+                          native_tempc=True, keepExtras=True)
+
+            # Same geometry and the same profile again, from the cache
+            scan2 = _raveio.open(self.FIXTURE).object
+            ncarb.pidScan(scan2, profile, pid_thresholds='nexrad',
+                          native_tempc=True, keepExtras=True)
+
+            # Computed again, with nothing else kept in the cache
+            _ncarb.setGeometryCacheLimit(0)
+            _ncarb.setTempProfile(None)
+            scan3 = _raveio.open(self.FIXTURE).object
+            ncarb.pidScan(scan3, profile, pid_thresholds='nexrad',
+                          native_tempc=True, keepExtras=True)
+            for param in ["CLASS", "SNRH"]:
+                self.assertFalse(different(scan, scan2, param))
+                self.assertFalse(different(scan, scan3, param))
+        finally:
+            _ncarb.setGeometryCacheLimit(96 * 1024 * 1024)
+            _ncarb.setTempProfile(None)
+
+    def test_getPidEligibleCounts(self):
+        profile = ncarb.readProfile(self.PROFILE, scale_height=1000)
+        ncarb.THRESHOLDS_FILE['nexrad'] = self.THRESHOLDS
+        scan = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan, profile, pid_thresholds='nexrad')
+        counts = _ncarb.getPidEligibleCounts()
+        ngates = scan.nrays * scan.nbins
+        self.assertEqual(len(counts), 19)
+        for label in ["cl", "drz", "lr", "mr", "hr", "gcl"]:
+            self.assertTrue(label in counts)
+        for count in counts.values():
+            self.assertTrue(0 <= count <= ngates)
+        self.assertTrue(sum(counts.values()) > 0)
+
+    def test_generateNcar_pid_tempGrid(self):
+        import temp_grid
+        profile = ncarb.readProfile(self.PROFILE, scale_height=1000)
+        ncarb.THRESHOLDS_FILE['nexrad'] = self.THRESHOLDS
+        path = 'temp_grid.bin'
+
+        scan = _raveio.open(self.FIXTURE).object
+        ncarb.pidScan(scan, profile, pid_thresholds='nexrad',
+                      native_tempc=True)
+        try:
+            # The same profile everywhere, around the radar
+            lat = scan.latitude * 180.0 / np.pi
+            lon = scan.longitude * 180.0 / np.pi
+            temp_grid.writeFromProfile(path, profile, lon - 5.0, lat - 5.0,
+                                       0.5, 0.5, 21, 21)
+            _ncarb.setTempGrid(path)
+            scan2 = _raveio.open(self.FIXTURE).object
+            ncarb.pidScan(scan2, None, pid_thresholds='nexrad',
+                          native_tempc=True, temp_grid=True)
+
+            a = scan.getParameter("CLASS").getData()
+            b = scan2.getParameter("CLASS").getData()
+            self.assertTrue(np.sum(a != b) < 0.01 * a.size)
+        finally:
+            _ncarb.setTempGrid(None)
+            _ncarb.setTempProfile(None)
+            if os.path.isfile(path): os.remove(path)
+
+    def test_setTempProfileFromArchive(self):
+        path = 'soundings.bin'
+        height = np.linspace(0.0, 16000.0, 50)
+        pressure = 1000.0 * np.exp(-height / 8000.0)
+        t0 = 1564500000
+        try:
+            for i in range(4):
+                # The third sounding is too short to pass the checks
+                n = 10 if i == 2 else 50
+                _ncarb.appendSounding(path, 'CASBV', t0 + i * 43200,
+                                      pressure[:n], height[:n],
+                                      20.0 - 0.0065 * height[:n])
+            self.assertEqual(_ncarb.setTempProfileFromArchive(
+                path, 'CASBV', t0 + 43200 + 60), t0 + 43200)
+            self.assertEqual(_ncarb.setTempProfileFromArchive(
+                path, 'CASBV', t0 + 2 * 43200 + 60), t0 + 43200)
+            self.assertEqual(_ncarb.setTempProfileFromArchive(
+                path, 'CASBV', t0 + 2 * 43200 + 60, 3600), None)
+            self.assertEqual(_ncarb.setTempProfileFromArchive(
+                path, 'CASRA', t0 + 43200), None)
+        finally:
+            _ncarb.setTempProfile(None)
+            for f in [path, path + '.idx']:
+                if os.path.isfile(f): os.remove(f)
+
+    def test_kdpScan(self):
+        scan = _raveio.open(self.FIXTURE).object
+        _ncarb.kdpScan(scan)
+        self.assertTrue(scan.hasParameter("KDP"))
+        self.assertFalse(scan.hasParameter("PSOB"))
+        self.assertFalse(scan.hasParameter("PIA"))
+
+        # Sharing the rays between threads gives the same result
+        scan2 = _raveio.open(self.FIXTURE).object
+        _ncarb.kdpScan(scan2, 4, 1, 1)
+        self.assertFalse(different(scan, scan2, "KDP"))
+        for p in ["PSOB", "PIA", "PIDA"]:
+            self.assertTrue(scan2.hasParameter(p))
+
+    def test_kdpScan_maxRange(self):
+        scan = _raveio.open(self.FIXTURE).object
+        rscale = scan.rscale * 0.001
+        max_range = scan.rstart + scan.nbins * rscale * 0.5
+        _ncarb.kdpScan(scan, 1, 0, 1, max_range)
+        limit = int((max_range - scan.rstart) / rscale)
+
+        # Nothing is derived beyond the max range
+        kdp = scan.getParameter("KDP").getData()
+        self.assertTrue(np.all(kdp[:, limit + 1:] == 0.0))
+        pia = scan.getParameter("PIA").getData()
+        self.assertTrue(np.all(pia[:, limit + 1:] == pia[:, -1:]))
+
+    def test_kdpScan_compositeFilter(self):
+        try:
+            # Long filter with many passes, so the composite filter is
+            # applied by FFT where the rays are long enough
+            _ncarb.setKdpFirFilter(125, 8, 8)
+            scan = _raveio.open(self.FIXTURE).object
+            _ncarb.kdpScan(scan)
+            scan2 = _raveio.open(self.FIXTURE).object
+            _ncarb.kdpScan(scan2, 1, 0, 0, 0.0, 1)
+
+            # Same result as iterating, to rounding precision
+            kdp = scan.getParameter("KDP").getData()
+            kdp2 = scan2.getParameter("KDP").getData()
+            self.assertTrue(np.allclose(kdp, kdp2, rtol=0.0, atol=1e-9))
+            self.assertRaises(ValueError, _ncarb.setKdpFirFilter, 50)
+        finally:
+            _ncarb.setKdpFirFilter(20)
+
+
+    def test_kdpScan_iterativeConvergence(self):
+        try:
+            _ncarb.setKdpIterativeFiltering(1)
+            scan = _raveio.open(self.FIXTURE).object
+            _ncarb.kdpScan(scan)
+            kdp = scan.getParameter("KDP")
+            self.assertEqual(kdp.getAttribute("how/kdp_cond_iterations_max"), 4)
+
+            # Stopping at a fixed point gives the same result
+            _ncarb.setKdpIterativeFiltering(1, 0.0)
+            scan2 = _raveio.open(self.FIXTURE).object
+            _ncarb.kdpScan(scan2)
+            self.assertFalse(different(scan, scan2, "KDP"))
+            kdp2 = scan2.getParameter("KDP")
+            self.assertTrue(kdp2.getAttribute("how/kdp_cond_iterations") <= 4.0)
+        finally:
+            _ncarb.setKdpIterativeFiltering(0)
+
+    def test_kdpScan_diagnostics(self):
+        import kdp_diag
+        path = 'kdp_diagnostics.bin'
+        try:
+            # Rays in a sector across north, shared between threads
+            _ncarb.setKdpDiagnostics(path, -90.0, 90.0, 350.0, 10.0)
+            scan = _raveio.open(self.FIXTURE).object
+            _ncarb.kdpScan(scan, 4)
+            _ncarb.setKdpDiagnostics(None)
+
+            # Rays are selected by their own azimuths, the centres
+            # between the start azimuths
+            names, rays = kdp_diag.read(path)
+            startaz = np.array(scan.getAttribute("how/startazA"))
+            step = np.remainder(np.diff(startaz) + 180.0, 360.0) - 180.0
+            azimuths = np.remainder(startaz + 0.5 * np.mean(step), 360.0)
+            sector = azimuths[(azimuths >= 350.0) | (azimuths <= 10.0)]
+            self.assertEqual(len(rays), len(sector))
+            self.assertTrue("phidpUnfold" in names)
+
+            # KDP is the same as in the scan, to float precision
+            kdp = scan.getParameter("KDP").getData()
+            for ray in rays:
+                offset = np.remainder(azimuths - ray.azimuth + 180.0, 360.0)
+                i = np.argmin(np.abs(offset - 180.0))
+                self.assertTrue(np.all(ray.fields["kdp"] ==
+                                       kdp[i].astype('f4')))
+        finally:
+            _ncarb.setKdpDiagnostics(None)
+            if os.path.isfile(path):
+                os.remove(path)
+
 
 # Helper function to determine whether two parameter arrays differ
 def different(scan1, scan2, param="CLASS"):